@@ -9,20 +9,52 @@
  *	http://plindenbaum.blogspot.com
  *	http://samtools.sourceforge.net/
  * Motivation:
- *	dump DNA genomic sequence as a CGI
+ *	dump DNA genomic sequence as a CGI, or as a long-lived local HTTP server
  * Compilation:
  *	export SAMDIR=\$\{HOME\}/samtools-0.1.17
  *	export BUILD="\\\"toy"\\\"
  *	export GENOME_PATH="\\\"/home/lindenb/samtools-0.1.17/examples/toy.fa\\\""
  *	make bin/faidx.cgi
+ * Usage:
+ *	as a CGI: faidx.cgi?chrom=chr1&start=100&end=200&fmt=fa (fmt: fa, text, json, xml)
+ *	as a server: faidx.cgi -p 8080 -t 8 then GET http://127.0.0.1:8080/?chrom=chr1&start=100&end=200
+ *	batch: faidx.cgi?region=chr1:100-200&region=chr2:5-10 or POST one BED line per region
+ *	load test: faidx.cgi -p 8080 -t 8 --bench 10000
+ *	metrics: GET http://127.0.0.1:8080/metrics (Prometheus), -l or FAIDX_LOG=1 (CGI) log each request
+ *	GENOME_PATH may also be a .2bit file created with fa2bit
+ *	or a fasta compressed with 'bgzip -i' (.gzi index), the inflated blocks are cached
+ *	several builds: a config file with one '<build> <path>' per line, GENOME_CONFIG or option -c,
+ *	then faidx.cgi?build=hg19&chrom=chr1&start=100&end=200 . The first build is the default.
+ *	aliases of the names: '<path>.alias' (or a third column of the config), one line per
+ *	sequence listing its names, e.g. 'chr1 1 NC_000001.11'. 'chr1'/'1' and 'chrM'/'MT' are also tried.
+ *	the body is gzipped when the client sends 'Accept-Encoding: gzip'; fmt=text
+ *	answers a 'Range: bytes=a-b' with the bases [start+a,start+b]
  */
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <limits.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "twobit.h"
+#include "gzi.h"
 #ifndef _NO_RAZF
 #include "razf.h"
 #else
@@ -34,10 +66,8 @@
 #define razf_tell(fp) ftello(fp)
 #endif
 
-#ifndef GENOME_PATH
-    #error macro GENOME_PATH was not defined (full path to a genome indexed with faidx)
-#else
-    #define GENOME_FAIDX GENOME_PATH ".fai"
+#if !defined(GENOME_PATH) && !defined(GENOME_CONFIG)
+    #error macro GENOME_PATH (full path to a genome indexed with faidx) or GENOME_CONFIG (list of genomes) was not defined
 #endif
 
 #ifndef BUILD
@@ -49,12 +79,43 @@
 #endif
 
 
-#define NOTEMPTY(var,msg)  if(var==NULL || var[0]==0) die(msg " undefined",400)
-#define CONTENT_DISPOSITION(ext)    printf("Content-Disposition: inline; filename=" BUILD "_%s_%ld_%ld.%s;\n",chrom,chromStart,chromEnd,ext)
-#define HEADER(mime,ext) CONTENT_DISPOSITION(ext);printf("Content-Type:" mime ";charset=UTF-8%c%c",10,10);header_printed=1;
+#define NOTEMPTY(var,msg)  if(var==NULL || var[0]==0) return fail(out,msg " undefined",400)
 
 static const int BUFFER_LENGTH=100000;
 
+/* size of the output buffer */
+#define OUTPUT_BUFFER 65536
+/* max size of the headers of a HTTP request */
+#define HTTP_MAX_HEADER 16384
+/* max size of a POST body */
+#define MAX_BODY_SIZE (64*1024*1024)
+/* a batch is read in windows of at most BATCH_REGIONS regions or BATCH_BASES bases */
+#define BATCH_REGIONS 4096
+#define BATCH_BASES (16*1024*1024)
+/* number of threads of the server */
+#define DEFAULT_THREADS 4
+/* max number of accepted connections waiting for a thread */
+#define QUEUE_SIZE 256
+/* seconds before an idle keep-alive connection is closed */
+#define KEEP_ALIVE_TIMEOUT 5
+/* compression level of the gzip responses */
+#define GZIP_LEVEL 1
+/* inflated blocks cached for each bgzip'd genome (64Kb each) */
+#define GZI_CACHE_BLOCKS 256
+/* memory budget of the loaded genomes of the server, in Mb */
+#define DEFAULT_BUDGET 4096
+/* the phases of a request, timed in microseconds */
+enum { PHASE_PARSE, PHASE_INDEX, PHASE_READ, PHASE_WRITE, PHASE_TOTAL, N_PHASES };
+static const char* PHASE_NAMES[]={"parse","index","read","write","total"};
+/* upper bounds of the buckets of the histograms of the phases, in microseconds */
+#define N_BUCKETS 13
+static const uint64_t BUCKETS[N_BUCKETS]={50,100,250,500,1000,2500,5000,10000,25000,50000,100000,250000,1000000};
+/* a counter updated by one thread and read by /metrics without lock */
+#define STAT_ADD(x,n) __atomic_store_n(&(x),(x)+(n),__ATOMIC_RELAXED)
+#define STAT_GET(x) __atomic_load_n(&(x),__ATOMIC_RELAXED)
+/* max number of segments of sequence sent in one writev */
+#define IOV_BATCH 256
+
 typedef struct
 	{
 	int32_t line_len, line_blen;
@@ -62,27 +123,537 @@ typedef struct
 	uint64_t offset;
 	}faidx1_t;
 
+/* one line of the .fai file */
+typedef struct
+	{
+	char* name;
+	faidx1_t index;
+	/* index of the sequence in a .2bit genome */
+	int tid;
+	}FaiEntry;
+
+/* another name of a sequence */
+typedef struct
+	{
+	char* name;
+	/* index of the entry */
+	int32_t entry;
+	}Alias;
+
+/* an indexed genome, loaded once by the server */
+typedef struct
+	{
+	const char* build;
+	const char* path;
+	FaiEntry* entries;
+	size_t n_entries;
+	/* open addressing hash table of the index of the entries, -1 if empty */
+	int32_t* slots;
+	size_t n_slots;
+	/* the uncompressed fasta mapped in memory, NULL if compressed */
+	const char* map;
+	size_t map_len;
+	/* a .2bit genome, or NULL */
+	twobit_t* tb;
+	/* a bgzip'd fasta, or NULL */
+	gzi_t* gz;
+	/* the aliases of the names, with their own hash table */
+	Alias* aliases;
+	size_t n_aliases;
+	int32_t* alias_slots;
+	size_t n_alias_slots;
+	}Genome;
+
+/* a build of the config file, its genome is loaded on the first request
+ * and unloaded when the least recently used one exceeds the memory budget */
+typedef struct
+	{
+	char* build;
+	char* path;
+	/* file of the aliases of the names, or NULL for '<path>.alias' */
+	char* alias;
+	/* NULL if not loaded */
+	Genome* genome;
+	/* memory of the index and of the mapped file */
+	size_t bytes;
+	/* number of requests using the genome */
+	size_t users;
+	uint64_t last_used;
+	/* hits and misses of the cache of blocks of the unloaded genomes */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	/* held while the genome is loaded */
+	pthread_mutex_t load_lock;
+	}Assembly;
+
+/* the builds known by the server, the first one is the default */
+typedef struct
+	{
+	Assembly* assemblies;
+	size_t n_assemblies;
+	/* memory budget and memory of the loaded genomes */
+	size_t budget;
+	size_t used;
+	uint64_t tick;
+	/* genomes loaded and unloaded */
+	uint64_t loads;
+	uint64_t evictions;
+	pthread_mutex_t lock;
+	}Registry;
+
+/* one region of a request */
+typedef struct
+	{
+	const char* chrom;
+	long chromStart;
+	long chromEnd;
+	const faidx1_t* index;
+	int tid;
+	/* offset of the first base in the file, regions of a batch are read in this order */
+	int64_t offset;
+	/* bases read in advance from a compressed genome, or NULL */
+	char* seq;
+	long seq_len;
+	}Region;
+
+/* the parameters of a request */
+typedef struct
+	{
+	char* format;
+	char* chrom;
+	char* chrom_start_str;
+	char* chrom_end_str;
+	long chromStart;
+	long chromEnd;
+	/* batch of regions: repeated 'region=' or the lines of a POST body */
+	Region* regions;
+	size_t n_regions;
+	size_t max_regions;
+	/* first region that cannot be parsed */
+	const char* bad_region;
+	/* transforms: strand=-, translate=1|2|3, stats=1 */
+	char* strand;
+	char* translate;
+	char* stats;
+	int reverse;
+	int frame;
+	int stats_only;
+	/* the build, or NULL for the default one */
+	const char* build;
+	/* value of the HTTP Range header, or NULL */
+	const char* range;
+	}Request;
+
+/* where the response is written: stdout for the CGI, a socket for the server.
+ * The headers are sent with the first bytes of the body: a body that fits in the
+ * buffer, or whose length is known in advance, gets a Content-Length, otherwise it is chunked */
+typedef struct
+	{
+	int fd;
+	/* 1: HTTP response, 0: CGI */
+	int http;
+	/* the client understands the chunked transfer encoding (HTTP/1.1) */
+	int can_chunk;
+	/* the body is sent chunked */
+	int chunked;
+	int keep_alive;
+	/* the client accepts a gzip body */
+	int accept_gzip;
+	/* outHeader was called */
+	int header_printed;
+	/* the headers were written */
+	int header_sent;
+	int error;
+	/* the headers */
+	int status;
+	const char* mime;
+	char disposition[BUFSIZ];
+	char content_range[100];
+	int accept_ranges;
+	/* length of the body if known in advance, -1 otherwise */
+	int64_t content_length;
+	/* time spent in each phase, bytes sent */
+	uint64_t phase_us[N_PHASES];
+	uint64_t bytes;
+	/* the build of the request, or NULL */
+	const char* build;
+	int assembly;
+	/* the gzip stream, NULL if the body is not compressed */
+	z_stream* gz;
+	char zbuffer[OUTPUT_BUFFER];
+	size_t zlen;
+	char buffer[OUTPUT_BUFFER];
+	size_t len;
+	}Output;
+
 static char* decode (char* str)
     {
     char* p=str;
+    char* q=str;
     while(*p!=0)
         {
         if(*p=='+')
             {
-            *p=' ';
+            *q=' ';
             }
         else if(*p=='%' && *(p+1)!=0 && *(p+2)!=0)
             {
             char buffer[3]={*(p+1),*(p+2),0};
-            *p=(char)strtoul(buffer,NULL,16);
-            *(p+1)=0;
+            *q=(char)strtoul(buffer,NULL,16);
             p+=2;
             }
+        else
+            {
+            *q=*p;
+            }
         ++p;
+        ++q;
         }
+    *q=0;
     return str;
     }
 
+static int writeFully(int fd,const char* p,size_t n)
+	{
+	while(n>0)
+		{
+		ssize_t w=write(fd,p,n);
+		if(w<0)
+			{
+			if(errno==EINTR) continue;
+			return -1;
+			}
+		p+=w;
+		n-=w;
+		}
+	return 0;
+	}
+
+/* write all the iovecs, the array is modified */
+static int writevFully(int fd,struct iovec* iov,int n)
+	{
+	while(n>0)
+		{
+		ssize_t w=writev(fd,iov,n);
+		if(w<0)
+			{
+			if(errno==EINTR) continue;
+			return -1;
+			}
+		while(n>0 && (size_t)w>=iov->iov_len)
+			{
+			w-=iov->iov_len;
+			++iov;
+			--n;
+			}
+		if(n>0)
+			{
+			iov->iov_base=(char*)iov->iov_base+w;
+			iov->iov_len-=w;
+			}
+		}
+	return 0;
+	}
+
+static void outInit(Output* out,int fd,int http)
+	{
+	memset(out,0,sizeof(Output));
+	out->fd=fd;
+	out->http=http;
+	out->content_length=-1;
+	out->assembly=-1;
+	}
+
+static uint64_t nowMicros()
+	{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+	}
+
+static const char* httpReason(int status)
+	{
+	switch(status)
+		{
+		case 200: return "OK";
+		case 206: return "Partial Content";
+		case 400: return "Bad Request";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 406: return "Not Acceptable";
+		case 411: return "Length Required";
+		case 413: return "Payload Too Large";
+		case 416: return "Range Not Satisfiable";
+		case 431: return "Request Header Fields Too Large";
+		default: return "Internal Server Error";
+		}
+	}
+
+/* writes the headers in 'hdr', 'length' is the length of the body or -1 if unknown */
+static int renderHeaders(Output* out,char* hdr,size_t size,int64_t length)
+	{
+	const char* eol=(out->http?"\r\n":"\n");
+	int n=0;
+	if(out->gz==NULL && out->content_length>=0) length=out->content_length;
+#define ADD(...) if(n<(int)size) n+=snprintf(&hdr[n],size-n,__VA_ARGS__)
+	if(out->http)
+		{
+		ADD("HTTP/1.1 %d %s\r\n",out->status,httpReason(out->status));
+		}
+	else if(out->status!=200)
+		{
+		ADD("Status: %d\n",out->status);
+		}
+	if(out->disposition[0]!=0) ADD("Content-Disposition: %s%s",out->disposition,eol);
+	if(out->content_range[0]!=0) ADD("Content-Range: %s%s",out->content_range,eol);
+	if(out->accept_ranges) ADD("Accept-Ranges: bytes%s",eol);
+	if(out->gz!=NULL) ADD("Content-Encoding: gzip%sVary: Accept-Encoding%s",eol,eol);
+	out->chunked=0;
+	if(length>=0)
+		{
+		ADD("Content-Length: %lld%s",(long long)length,eol);
+		}
+	else if(out->http && out->can_chunk)
+		{
+		ADD("Transfer-Encoding: chunked\r\n");
+		out->chunked=1;
+		}
+	else
+		{
+		/* the end of the body is the end of the connection */
+		out->keep_alive=0;
+		}
+	if(out->http)
+		{
+		ADD("Content-Type: %s;charset=UTF-8\r\n",out->mime);
+		if(!out->keep_alive) ADD("Connection: close\r\n");
+		ADD("\r\n");
+		}
+	else
+		{
+		ADD("Content-Type:%s;charset=UTF-8%c%c",out->mime,10,10);
+		}
+#undef ADD
+	return n<(int)size?n:(int)size-1;
+	}
+
+/* sends the headers if needed, then 'total' bytes of body. 'final' is set for the last bytes */
+static void sendBody(Output* out,const struct iovec* iov,int n,size_t total,int final)
+	{
+	struct iovec v[IOV_BATCH+5];
+	char hdr[BUFSIZ+512];
+	char size[24];
+	int k=0;
+	if(out->error) return;
+	if(!out->header_sent)
+		{
+		v[k].iov_base=hdr;
+		v[k].iov_len=renderHeaders(out,hdr,sizeof(hdr),final?(int64_t)total:-1);
+		k++;
+		out->header_sent=1;
+		}
+	if(out->chunked && total>0)
+		{
+		v[k].iov_base=size;
+		v[k].iov_len=sprintf(size,"%lx\r\n",(unsigned long)total);
+		k++;
+		}
+	memcpy(&v[k],iov,n*sizeof(struct iovec));
+	k+=n;
+	if(out->chunked && total>0)
+		{
+		v[k].iov_base="\r\n";
+		v[k].iov_len=2;
+		k++;
+		}
+	if(out->chunked && final)
+		{
+		v[k].iov_base="0\r\n\r\n";
+		v[k].iov_len=5;
+		k++;
+		}
+	if(k>0)
+		{
+		uint64_t t0=nowMicros();
+		int i;
+		for(i=0;i< k;++i) out->bytes+=v[i].iov_len;
+		if(writevFully(out->fd,v,k)!=0) out->error=1;
+		out->phase_us[PHASE_WRITE]+=nowMicros()-t0;
+		}
+	}
+
+/* compresses the body if needed, then sends it */
+static void outDeliver(Output* out,const struct iovec* iov,int n,size_t total,int final)
+	{
+	int i;
+	if(out->gz==NULL)
+		{
+		sendBody(out,iov,n,total,final);
+		return;
+		}
+	for(i=0;i<=n;++i)
+		{
+		int flush=(i<n?Z_NO_FLUSH:(final?Z_FINISH:-1));
+		int ret;
+		if(flush==-1) break;
+		out->gz->next_in=(Bytef*)(i<n?iov[i].iov_base:NULL);
+		out->gz->avail_in=(i<n?iov[i].iov_len:0);
+		do
+			{
+			out->gz->next_out=(Bytef*)&out->zbuffer[out->zlen];
+			out->gz->avail_out=OUTPUT_BUFFER-out->zlen;
+			ret=deflate(out->gz,flush);
+			out->zlen=OUTPUT_BUFFER-out->gz->avail_out;
+			if(out->zlen==OUTPUT_BUFFER)
+				{
+				struct iovec z;
+				z.iov_base=out->zbuffer;
+				z.iov_len=out->zlen;
+				sendBody(out,&z,1,out->zlen,0);
+				out->zlen=0;
+				}
+			} while(ret==Z_OK && (out->gz->avail_in>0 || (flush==Z_FINISH)));
+		}
+	if(final)
+		{
+		struct iovec z;
+		z.iov_base=out->zbuffer;
+		z.iov_len=out->zlen;
+		sendBody(out,&z,1,out->zlen,1);
+		out->zlen=0;
+		deflateEnd(out->gz);
+		free(out->gz);
+		out->gz=NULL;
+		}
+	}
+
+static void outFlush(Output* out)
+	{
+	struct iovec iov;
+	if(out->len==0 || out->error) { out->len=0; return; }
+	iov.iov_base=out->buffer;
+	iov.iov_len=out->len;
+	outDeliver(out,&iov,1,out->len,0);
+	out->len=0;
+	}
+
+static void outWrite(Output* out,const char* s,size_t n)
+	{
+	while(n>0)
+		{
+		size_t k=OUTPUT_BUFFER-out->len;
+		if(k>n) k=n;
+		memcpy(&out->buffer[out->len],s,k);
+		out->len+=k;
+		s+=k;
+		n-=k;
+		if(out->len==OUTPUT_BUFFER) outFlush(out);
+		}
+	}
+
+#define outPuts(out,s) outWrite(out,s,strlen(s))
+
+static void outPutc(Output* out,char c)
+	{
+	if(out->len==OUTPUT_BUFFER) outFlush(out);
+	out->buffer[out->len++]=c;
+	}
+
+/* write 'total' bytes pointed by the iovecs. Small writes are copied in the
+ * buffer, larger ones are sent with the pending bytes in one writev, without copy */
+static void outWritev(Output* out,const struct iovec* iov,int n,size_t total)
+	{
+	struct iovec v[IOV_BATCH+1];
+	int i,k=0;
+	if(out->error) return;
+	if(out->len+total<=OUTPUT_BUFFER || n>IOV_BATCH || out->gz!=NULL)
+		{
+		for(i=0;i< n;++i) outWrite(out,iov[i].iov_base,iov[i].iov_len);
+		return;
+		}
+	if(out->len>0)
+		{
+		v[k].iov_base=out->buffer;
+		v[k].iov_len=out->len;
+		k++;
+		}
+	memcpy(&v[k],iov,n*sizeof(struct iovec));
+	k+=n;
+	outDeliver(out,v,k,total+out->len,0);
+	out->len=0;
+	}
+
+static void outPrintf(Output* out,const char* fmt,...)
+	{
+	char tmp[BUFSIZ];
+	int n;
+	va_list ap;
+	va_start(ap,fmt);
+	n=vsnprintf(tmp,BUFSIZ,fmt,ap);
+	va_end(ap);
+	if(n<0) return;
+	if(n>=BUFSIZ) n=BUFSIZ-1;
+	outWrite(out,tmp,n);
+	}
+
+/* end of the response */
+static void outEnd(Output* out)
+	{
+	struct iovec iov;
+	if(!out->header_printed) return;
+	iov.iov_base=out->buffer;
+	iov.iov_len=out->len;
+	outDeliver(out,&iov,1,out->len,1);
+	out->len=0;
+	}
+
+/* the headers of the response, the disposition may be NULL. The body is
+ * compressed if the client accepts gzip */
+static void outHeader(Output* out,int status,const char* mime,const char* disposition)
+	{
+	out->status=status;
+	out->mime=mime;
+	snprintf(out->disposition,BUFSIZ,"%s",disposition==NULL?"":disposition);
+	out->header_printed=1;
+	if(out->accept_gzip && status==200 && (out->gz=calloc(1,sizeof(z_stream)))!=NULL)
+		{
+		/* 15+16: a gzip header */
+		if(deflateInit2(out->gz,GZIP_LEVEL,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY)!=Z_OK)
+			{
+			free(out->gz);
+			out->gz=NULL;
+			}
+		}
+	}
+
+/* print an error message, returns -1 */
+static int fail(Output* out,const char*message,int status)
+	{
+	if(out->header_sent)
+		{
+		/* too late for a status */
+		fprintf(stderr,"[faidx] %s\n",message);
+		out->keep_alive=0;
+		return -1;
+		}
+	/* discard what was not sent */
+	out->len=0;
+	out->zlen=0;
+	if(out->gz!=NULL)
+		{
+		deflateEnd(out->gz);
+		free(out->gz);
+		out->gz=NULL;
+		}
+	out->content_range[0]=0;
+	out->accept_ranges=0;
+	out->content_length=-1;
+	out->accept_gzip=0;
+	outHeader(out,status,"text/plain",NULL);
+	outPrintf(out,"%s.\n",message);
+	return -1;
+	}
+
 static void die(const char*message,int status)
 	{
 	printf("Status: %d\n",status);
@@ -92,234 +663,2187 @@ static void die(const char*message,int status)
 	exit(EXIT_FAILURE);
 	}
 
-static void echo(
-	const char* chrom,
-	long chromStart,
-	long chromEnd,
-	faidx1_t* index,
-	int every
-	)
+static size_t hashName(const char* s)
 	{
-	RAZF *rz;
-	int64_t pos;
-	long toPrint;
-	long printed=0L;	
-	
-	if(chromStart>= index->len) return ;
-	chromEnd=MIN(index->len,chromEnd);
-	if(chromStart==chromEnd) return;
-	toPrint=chromEnd-chromStart;
-	
-	rz = razf_open(GENOME_PATH, "r");
-	if (rz == NULL)
+	/* FNV-1a */
+	size_t h=2166136261U;
+	while(*s!=0)
 		{
-		die("Cannot open " GENOME_PATH,500);
+		h=(h^(unsigned char)(*s++))*16777619U;
 		}
-	pos= 	index->offset +
-		chromStart / (index->line_blen * index->line_len) +
-		chromStart % index->line_blen
-		;
-	razf_seek(rz,pos , SEEK_SET);
-	while(printed<toPrint)
+	return h;
+	}
+
+static const FaiEntry* lookupEntry(const Genome* g,const char* chrom)
+	{
+	size_t i=hashName(chrom)&(g->n_slots-1);
+	while(g->slots[i]!=-1)
 		{
-		long i=0;
-		char buff[BUFSIZ];
-		long nRead=razf_read(rz,buff,BUFSIZ);
-		while(i<nRead && printed<toPrint)
+		const FaiEntry* e=&g->entries[g->slots[i]];
+		if(strcmp(e->name,chrom)==0) return e;
+		i=(i+1)&(g->n_slots-1);
+		}
+	return NULL;
+	}
+
+static const Alias* lookupAlias(const Genome* g,const char* chrom)
+	{
+	size_t i;
+	if(g->n_alias_slots==0) return NULL;
+	i=hashName(chrom)&(g->n_alias_slots-1);
+	while(g->alias_slots[i]!=-1)
+		{
+		const Alias* a=&g->aliases[g->alias_slots[i]];
+		if(strcmp(a->name,chrom)==0) return a;
+		i=(i+1)&(g->n_alias_slots-1);
+		}
+	return NULL;
+	}
+
+static const FaiEntry* lookupName(const Genome* g,const char* chrom)
+	{
+	const FaiEntry* e=lookupEntry(g,chrom);
+	const Alias* a;
+	if(e!=NULL) return e;
+	a=lookupAlias(g,chrom);
+	return a==NULL?NULL:&g->entries[a->entry];
+	}
+
+/* the entry of a name or of an alias. Without alias, the UCSC and Ensembl
+ * names are tried: 'chr1' and '1', 'chrM' and 'MT' */
+static const FaiEntry* findEntry(const Genome* g,const char* chrom)
+	{
+	char other[BUFSIZ];
+	const FaiEntry* e=lookupName(g,chrom);
+	if(e!=NULL) return e;
+	if(strncmp(chrom,"chr",3)==0)
+		{
+		return lookupName(g,strcmp(chrom,"chrM")==0?"MT":chrom+3);
+		}
+	if(strlen(chrom)+4>BUFSIZ) return NULL;
+	sprintf(other,"chr%s",strcmp(chrom,"MT")==0?"M":chrom);
+	return lookupName(g,other);
+	}
+
+/* reads the aliases: each line lists the names of one sequence (e.g. 'chr1 1 NC_000001.11 CM000663.2'),
+ * separated by tabulations, spaces or commas. Lines without a name of the index are ignored,
+ * an alias defined twice keeps its first sequence. A missing file is not an error */
+static int loadAliases(Genome* g,const char* filename)
+	{
+	char* line=NULL;
+	size_t line_buff=0,buffer=0,i;
+	FILE* in=fopen(filename,"r");
+	if(in==NULL) return 0;
+	while(getline(&line,&line_buff,in)!=-1)
+		{
+		const FaiEntry* e=NULL;
+		char* tokens[64];
+		size_t n=0;
+		char* p=strtok(line,"\t ,\r\n");
+		if(p==NULL || p[0]=='#') continue;
+		while(p!=NULL && n< 64)
+			{
+			tokens[n++]=p;
+			p=strtok(NULL,"\t ,\r\n");
+			}
+		for(i=0;i< n && e==NULL;++i) e=lookupEntry(g,tokens[i]);
+		if(e==NULL) continue;
+		for(i=0;i< n;++i)
 			{
-			if(isgraph(buff[i]))
+			Alias* a;
+			if(lookupEntry(g,tokens[i])!=NULL) continue;
+			if(g->n_aliases==buffer)
 				{
-				if(every!=-1 && printed%every==0)
-					{
-					fputc('\n',stdout);
-					}
-				fputc(buff[i],stdout);
-				printed++;
+				buffer+=BUFSIZ;
+				a=realloc(g->aliases,buffer*sizeof(Alias));
+				if(a==NULL) { free(line); fclose(in); return -1; }
+				g->aliases=a;
 				}
-			++i;
+			a=&g->aliases[g->n_aliases];
+			if((a->name=strdup(tokens[i]))==NULL) { free(line); fclose(in); return -1; }
+			a->entry=(int32_t)(e-g->entries);
+			g->n_aliases++;
+			}
+		}
+	free(line);
+	fclose(in);
+	if(g->n_aliases==0) return 0;
+	/* hash table of the aliases */
+	g->n_alias_slots=16;
+	while(g->n_alias_slots< 2*g->n_aliases) g->n_alias_slots*=2;
+	if((g->alias_slots=malloc(g->n_alias_slots*sizeof(int32_t)))==NULL) return -1;
+	for(i=0;i< g->n_alias_slots;++i) g->alias_slots[i]=-1;
+	for(i=0;i< g->n_aliases;++i)
+		{
+		size_t h=hashName(g->aliases[i].name)&(g->n_alias_slots-1);
+		while(g->alias_slots[h]!=-1)
+			{
+			if(strcmp(g->aliases[g->alias_slots[h]].name,g->aliases[i].name)==0) break;
+			h=(h+1)&(g->n_alias_slots-1);
 			}
+		if(g->alias_slots[h]==-1) g->alias_slots[h]=(int32_t)i;
 		}
-	razf_close(rz);
+	return 0;
 	}
 
+/* fills the hash table of the names */
+static int hashEntries(Genome* g)
+	{
+	size_t i;
+	/* power of 2, at least twice the number of entries */
+	g->n_slots=16;
+	while(g->n_slots< 2*g->n_entries) g->n_slots*=2;
+	if((g->slots=malloc(g->n_slots*sizeof(int32_t)))==NULL) return -1;
+	for(i=0;i< g->n_slots;++i) g->slots[i]=-1;
+	for(i=0;i< g->n_entries;++i)
+		{
+		size_t h=hashName(g->entries[i].name)&(g->n_slots-1);
+		while(g->slots[h]!=-1) h=(h+1)&(g->n_slots-1);
+		g->slots[h]=(int32_t)i;
+		}
+	return 0;
+	}
 
-int main(int argc,char** argv)
-    {
-    char* endptr=NULL;
- #ifndef TEST 
-    char* method=getenv("REQUEST_METHOD");
-    char* query_string=getenv("QUERY_STRING");
- #else
-    char* query_string=NULL;
- #endif
-    char* format=NULL;
-    char* chrom=NULL;
-    char* chrom_start_str=NULL;
-    char* chrom_end_str=NULL;
+/* a genome packed with fa2bit */
+static int loadTwoBit(Genome* g)
+	{
+	int i;
+	if((g->tb=twobit_open(g->path))==NULL) return -1;
+	g->n_entries=twobit_nseq(g->tb);
+	if((g->entries=calloc(g->n_entries+1,sizeof(FaiEntry)))==NULL) return -1;
+	for(i=0;i< (int)g->n_entries;++i)
+		{
+		FaiEntry* e=&g->entries[i];
+		e->name=(char*)twobit_name(g->tb,i);
+		e->index.len=twobit_length(g->tb,i);
+		e->tid=i;
+		}
+	return hashEntries(g);
+	}
 
+/* load the .fai in a hash table and map the fasta if it is not compressed */
+static int loadGenome(Genome* g,const char* build,const char* path)
+	{
+	char* fai=malloc(strlen(path)+5);
+	char* line=NULL;
+	size_t line_buff=0;
+	size_t buffer=0;
+	unsigned char magic[2];
+	struct stat st;
+	FILE* in;
+	int fd;
+	memset(g,0,sizeof(Genome));
+	g->build=build;
+	g->path=path;
+	if(fai==NULL) return -1;
+	if(strlen(path)>5 && strcmp(path+strlen(path)-5,".2bit")==0)
+		{
+		free(fai);
+		return loadTwoBit(g);
+		}
+	sprintf(fai,"%s.fai",path);
+	in=fopen(fai,"r");
+	if(in==NULL)
+		{
+		fprintf(stderr,"[faidx] cannot load index %s: %s\n",fai,strerror(errno));
+		free(fai);
+		return -1;
+		}
+	while(getline(&line,&line_buff,in)!=-1)
+		{
+		FaiEntry* e;
+		char* p=strchr(line,'\t');
+		char* endptr;
+		if(p==NULL) continue;
+		*p++=0;
+		if(g->n_entries+1>buffer)
+			{
+			buffer+=BUFSIZ;
+			g->entries=realloc(g->entries,buffer*sizeof(FaiEntry));
+			if(g->entries==NULL) { fclose(in); return -1; }
+			}
+		e=&g->entries[g->n_entries];
+		e->index.len=strtoll(p,&endptr,10);
+		e->index.offset=strtoull(endptr,&endptr,10);
+		e->index.line_blen=(int32_t)strtol(endptr,&endptr,10);
+		e->index.line_len=(int32_t)strtol(endptr,&endptr,10);
+		if(e->index.line_blen<=0 || e->index.line_len< e->index.line_blen)
+			{
+			fprintf(stderr,"[faidx] cannot read index %s: %s\n",fai,line);
+			continue;
+			}
+		if((e->name=strdup(line))==NULL) { fclose(in); return -1; }
+		g->n_entries++;
+		}
+	free(line);
+	fclose(in);
+	free(fai);
+	if(hashEntries(g)!=0) return -1;
+	/* a compressed fasta is read with razf */
+	if((fd=open(path,O_RDONLY))<0 || fstat(fd,&st)!=0)
+		{
+		fprintf(stderr,"[faidx] cannot open %s: %s\n",path,strerror(errno));
+		if(fd>=0) close(fd);
+		return -1;
+		}
+	if(read(fd,magic,2)==2 && magic[0]==0x1f && magic[1]==0x8b)
+		{
+		close(fd);
+		/* bgzip: random access with the .gzi, the legacy RAZF otherwise */
+		if(gzi_is_bgzf(path) && (g->gz=gzi_open(path,GZI_CACHE_BLOCKS))==NULL) return -1;
+		return 0;
+		}
+	g->map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(g->map==MAP_FAILED)
+		{
+		g->map=NULL;
+		return 0;
+		}
+	g->map_len=st.st_size;
+	return 0;
+	}
 
-#ifndef TEST 
-    if(method==NULL || strcmp(method,"GET")!=0)
-        {
-        die("GET method expected",406);
-        }
-#endif
+static void freeGenome(Genome* g)
+	{
+	size_t i;
+	/* the names of a .2bit belong to the file */
+	if(g->tb!=NULL) twobit_close(g->tb);
+	else for(i=0;i< g->n_entries;++i) free(g->entries[i].name);
+	gzi_close(g->gz);
+	for(i=0;i< g->n_aliases;++i) free(g->aliases[i].name);
+	free(g->aliases);
+	free(g->alias_slots);
+	free(g->entries);
+	free(g->slots);
+	if(g->map!=NULL) munmap((void*)g->map,g->map_len);
+	}
 
-#ifdef TEST
-   if(argc<2) return EXIT_FAILURE;
-   query_string=argv[1];
-#endif
+/* memory of the index and of the mapped file or of the cache of blocks */
+static size_t genomeFootprint(const Genome* g)
+	{
+	struct stat st;
+	size_t i,n=g->n_entries*sizeof(FaiEntry)+g->n_slots*sizeof(int32_t)+g->map_len;
+	if(g->gz!=NULL) n+=gzi_footprint(g->gz);
+	n+=g->n_aliases*sizeof(Alias)+g->n_alias_slots*sizeof(int32_t);
+	for(i=0;i< g->n_aliases;++i) n+=strlen(g->aliases[i].name)+1;
+	if(g->tb!=NULL)
+		{
+		if(stat(g->path,&st)==0) n+=st.st_size;
+		}
+	else
+		{
+		for(i=0;i< g->n_entries;++i) n+=strlen(g->entries[i].name)+1;
+		}
+	return n;
+	}
 
+static int addAssembly(Registry* reg,const char* build,const char* path,const char* alias)
+	{
+	Assembly* a;
+	size_t i;
+	for(i=0;i< reg->n_assemblies;++i)
+		{
+		if(strcmp(reg->assemblies[i].build,build)==0)
+			{
+			fprintf(stderr,"[faidx] duplicate build %s\n",build);
+			return -1;
+			}
+		}
+	a=realloc(reg->assemblies,(reg->n_assemblies+1)*sizeof(Assembly));
+	if(a==NULL) return -1;
+	reg->assemblies=a;
+	a=&reg->assemblies[reg->n_assemblies];
+	memset(a,0,sizeof(Assembly));
+	if((a->build=strdup(build))==NULL || (a->path=strdup(path))==NULL) return -1;
+	if(alias!=NULL && (a->alias=strdup(alias))==NULL) return -1;
+	pthread_mutex_init(&a->load_lock,NULL);
+	reg->n_assemblies++;
+	return 0;
+	}
 
-    if(query_string==NULL || query_string[0]==0)
-        {
-        die("QUERY_STRING missing",406);
-        }
-    /* decode CGI string */
-    const char* end=query_string+strlen(query_string);
-    char* prev=query_string;
-    while(prev!=end)
-        {
-        char* amp=strchr(prev,'&');
-        char* eq=NULL;
-        if(amp==NULL) amp=(char*)end;
-        *amp=0;
-        eq=strchr(prev,'=');
-        if(eq!=NULL && eq!=prev)
-            {
-            char* key=prev;
-            char* value;
-            *eq=0;
-            value=++eq;
-            key=decode(key);
-            value=decode(value);
-            if(strcmp(key,"tid")==0 || strcmp(key,"chrom")==0)
-                {
-                chrom=value;
-                }
-            else if(strcmp(key,"start")==0)
-                {
-                chrom_start_str=value;
-                }
-            else if(strcmp(key,"end")==0)
-                {
-                chrom_end_str=value;
-                }
-            else if(strcmp(key,"fmt")==0 || strcmp(key,"format")==0)
-                {
-                format=value;
-                }
-            }
-        if(amp==end) break;
-        prev=++amp;
-        }
-    if(query_string==NULL || query_string[0]==0)
-        {
-        die("chrom missing",400);
-        }
-    NOTEMPTY(chrom,"chrom");
-    NOTEMPTY(chrom_start_str,"start");
-    NOTEMPTY(chrom_end_str,"end");
-    errno=0;
-    long chromStart=strtol(chrom_start_str,&endptr,10);
-    if(chromStart<0 || errno!=0 ||*endptr!=0) die("bad value for chromStart",400);
-    long chromEnd=strtol(chrom_end_str,&endptr,10);
-    if(chromEnd<chromStart || errno!=0 ||*endptr!=0) die("bad value for chromEnd",400);
-    
-    faidx1_t index;
-    index.len=-1;
-    /* open index */
-    FILE* faidx=fopen(GENOME_FAIDX,"r");
-    if(faidx==NULL)
-    	{
-    	die("cannot load index " GENOME_FAIDX ".",500);
-    	}
-    else
-    	{
-    	int c;
-    	int len=0;
-    	size_t line_buff=BUFSIZ;
-    	char* line=malloc(line_buff*sizeof(char));
-    	int nameLength=strlen(chrom);
-    	if(line==NULL)
-    		{
-    		die("Out of memory.",500);
-    		}
-    	while((c=fgetc(faidx))!=EOF)
-    		{
-    		if(c=='\n')
-    			{
-    			line[len]=0;
-    			if(len>0 &&
-    			   strncmp(chrom,line,nameLength)==0 &&
-    			   line[nameLength]=='\t'
-    			   )
-				{
-				if(sscanf(&line[nameLength+1],"%Ld\t%Ld\t%d\t%d",
-					&index.len, &index.offset, &index.line_blen,&index.line_len
-					)!=4)
-					{
-					fprintf(stderr,"#%s\n",line);
-					die("Cannot read index",500);
-					}
-				break;
-				}
-    			len=0;
-    			continue;	
-    			}
-    		if(len+2>=line_buff)
-    			{
-    			line_buff+=BUFSIZ;
-    			line=realloc(line,line_buff*sizeof(char));
-    			if(line==NULL)
-		    		{
-		    		die("Out of memory.",500);
-		    		}
-		    	
-    			}
-    		line[len++]=c;
-    		}
-    	fclose(faidx);
-    	}
-    if(index.len<1)
-    	{
-    	die("Unknown chromosome",404);
-    	}
-    	
-    int header_printed=0;
-    if(format!=NULL && strcasecmp(format,"json")==0)
-        {
-        HEADER("application/json","json");
-        printf("{\"build\":\"%s\",\"chrom\":\"%s\",",BUILD,chrom);
-        printf("\"start\":%ld,",chromStart);
-        printf("\"end\":%ld,",chromEnd);
-        printf("\"sequence\":\"");
-        echo(chrom,chromStart,chromEnd,&index,-1);
-        printf("\"}\n");
-        }
-    else if(format!=NULL && strcasecmp(format,"xml")==0)
+/* reads the builds of a config file: '<build> <path> [aliases]' per line, '#' for the comments.
+ * Nothing is opened before the first request */
+static int loadConfig(Registry* reg,const char* filename)
+	{
+	char* line=NULL;
+	size_t line_buff=0;
+	int ret=0;
+	FILE* in=fopen(filename,"r");
+	if(in==NULL)
+		{
+		fprintf(stderr,"[faidx] cannot open %s: %s\n",filename,strerror(errno));
+		return -1;
+		}
+	while(ret==0 && getline(&line,&line_buff,in)!=-1)
+		{
+		char* build=strtok(line," \t\r\n");
+		char* path=(build==NULL?NULL:strtok(NULL," \t\r\n"));
+		char* alias=(path==NULL?NULL:strtok(NULL," \t\r\n"));
+		if(build==NULL || build[0]=='#') continue;
+		if(path==NULL)
+			{
+			fprintf(stderr,"[faidx] no path for build %s in %s\n",build,filename);
+			ret=-1;
+			}
+		else
+			{
+			ret=addAssembly(reg,build,path,alias);
+			}
+		}
+	free(line);
+	fclose(in);
+	return ret;
+	}
+
+/* unload the least recently used genomes until the budget is respected. The registry is locked */
+static void evictGenomes(Registry* reg,const Assembly* keep)
+	{
+	while(reg->used>reg->budget)
+		{
+		Assembly* lru=NULL;
+		size_t i;
+		for(i=0;i< reg->n_assemblies;++i)
+			{
+			Assembly* a=&reg->assemblies[i];
+			if(a==keep || a->genome==NULL || a->users>0) continue;
+			if(lru==NULL || a->last_used< lru->last_used) lru=a;
+			}
+		if(lru==NULL) break;
+		if(lru->genome->gz!=NULL)
+			{
+			uint64_t hits,misses;
+			gzi_stats(lru->genome->gz,&hits,&misses);
+			lru->cache_hits+=hits;
+			lru->cache_misses+=misses;
+			}
+		freeGenome(lru->genome);
+		free(lru->genome);
+		reg->evictions++;
+		lru->genome=NULL;
+		reg->used-=lru->bytes;
+		lru->bytes=0;
+		}
+	}
+
+/* the genome of a build (the default one if NULL), loaded if needed. Returns NULL if the
+ * build is unknown (*status=404) or cannot be loaded (*status=500). Must be released */
+static Assembly* acquireGenome(Registry* reg,const char* build,int* status)
+	{
+	Assembly* a=NULL;
+	size_t i;
+	pthread_mutex_lock(&reg->lock);
+	for(i=0;i< reg->n_assemblies;++i)
+		{
+		if(build==NULL || build[0]==0 || strcmp(reg->assemblies[i].build,build)==0)
+			{
+			a=&reg->assemblies[i];
+			break;
+			}
+		}
+	if(a!=NULL)
+		{
+		a->users++;
+		a->last_used=++reg->tick;
+		}
+	pthread_mutex_unlock(&reg->lock);
+	if(a==NULL)
+		{
+		*status=404;
+		return NULL;
+		}
+	/* a genome in use is never unloaded */
+	pthread_mutex_lock(&a->load_lock);
+	if(a->genome==NULL)
+		{
+		Genome* g=calloc(1,sizeof(Genome));
+		char* alias=malloc(strlen(a->path)+7);
+		if(alias!=NULL) sprintf(alias,"%s.alias",a->path);
+		if(g!=NULL && (alias==NULL || loadGenome(g,a->build,a->path)!=0 ||
+			loadAliases(g,a->alias!=NULL?a->alias:alias)!=0))
+			{
+			freeGenome(g);
+			free(g);
+			g=NULL;
+			}
+		free(alias);
+		pthread_mutex_lock(&reg->lock);
+		if(g!=NULL)
+			{
+			a->genome=g;
+			a->bytes=genomeFootprint(g);
+			reg->loads++;
+			reg->used+=a->bytes;
+			evictGenomes(reg,a);
+			}
+		else
+			{
+			a->users--;
+			}
+		pthread_mutex_unlock(&reg->lock);
+		if(g==NULL)
+			{
+			pthread_mutex_unlock(&a->load_lock);
+			*status=500;
+			return NULL;
+			}
+		}
+	pthread_mutex_unlock(&a->load_lock);
+	return a;
+	}
+
+static void releaseGenome(Registry* reg,Assembly* a)
+	{
+	pthread_mutex_lock(&reg->lock);
+	a->users--;
+	evictGenomes(reg,NULL);
+	pthread_mutex_unlock(&reg->lock);
+	}
+
+/* the builds compiled in, then the ones of the config file */
+static int initRegistry(Registry* reg,const char* config)
+	{
+	memset(reg,0,sizeof(Registry));
+	reg->budget=(size_t)DEFAULT_BUDGET*1024*1024;
+	pthread_mutex_init(&reg->lock,NULL);
+#ifdef GENOME_PATH
+	if(addAssembly(reg,BUILD,GENOME_PATH,NULL)!=0) return -1;
+#endif
+#ifdef GENOME_CONFIG
+	if(loadConfig(reg,GENOME_CONFIG)!=0) return -1;
+#endif
+	if(config!=NULL && loadConfig(reg,config)!=0) return -1;
+	if(reg->n_assemblies==0)
+		{
+		fprintf(stderr,"[faidx] no genome defined\n");
+		return -1;
+		}
+	return 0;
+	}
+
+/* complement of each base, the case is kept */
+static char COMPLEMENT[256];
+/* T=0 C=1 A=2 G=3, 4 for the other characters */
+static unsigned char BASE_CODE[256];
+
+/* called once before the threads are started */
+static void initTables()
+	{
+	static const char* from="ACGTUMRWSYKVHDBNacgtumrwsykvhdbn";
+	static const char* to  ="TGCAAKYWSRMBDHVNtgcaakywsrmbdhvn";
+	int i;
+	for(i=0;i< 256;++i)
+		{
+		COMPLEMENT[i]=(char)i;
+		BASE_CODE[i]=4;
+		}
+	for(i=0;from[i]!=0;++i) COMPLEMENT[(unsigned char)from[i]]=to[i];
+	BASE_CODE['T']=BASE_CODE['t']=BASE_CODE['U']=BASE_CODE['u']=0;
+	BASE_CODE['C']=BASE_CODE['c']=1;
+	BASE_CODE['A']=BASE_CODE['a']=2;
+	BASE_CODE['G']=BASE_CODE['g']=3;
+	}
+
+static void reverseComplement(char* s,long n)
+	{
+	long i=0,j=n-1;
+	while(i<j)
+		{
+		char c=COMPLEMENT[(unsigned char)s[i]];
+		s[i]=COMPLEMENT[(unsigned char)s[j]];
+		s[j]=c;
+		++i;
+		--j;
+		}
+	if(i==j) s[i]=COMPLEMENT[(unsigned char)s[i]];
+	}
+
+/* translates in place from 'frame' (0,1,2) with the standard code, returns the length of the protein */
+static long translate(char* s,long n,int frame)
+	{
+	static const char* CODE="FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG";
+	long i,k=0;
+	for(i=frame;i+3<=n;i+=3)
+		{
+		int a=BASE_CODE[(unsigned char)s[i]];
+		int b=BASE_CODE[(unsigned char)s[i+1]];
+		int c=BASE_CODE[(unsigned char)s[i+2]];
+		s[k++]=((a|b|c)&4)?'X':CODE[a*16+b*4+c];
+		}
+	return k;
+	}
+
+/* 4 interleaved histograms: consecutive increments do not wait for each other */
+static void countBases(uint64_t counts[4][256],const char* p,size_t n)
+	{
+	const unsigned char* u=(const unsigned char*)p;
+	size_t i=0;
+	for(;i+4<=n;i+=4)
+		{
+		counts[0][u[i]]++;
+		counts[1][u[i+1]]++;
+		counts[2][u[i+2]]++;
+		counts[3][u[i+3]]++;
+		}
+	for(;i<n;++i) counts[0][u[i]]++;
+	}
+
+/* collects the segments of sequence, wrapped every 'every' bases, before a writev */
+typedef struct
+	{
+	Output* out;
+	int every;
+	long printed;
+	struct iovec iov[IOV_BATCH];
+	int n;
+	size_t total;
+	/* if not NULL, the bases are copied here instead of being written */
+	char* dest;
+	/* if not NULL, the bases are counted in 4 histograms instead of being written */
+	uint64_t (*counts)[256];
+	}Emitter;
+
+static void emitInit(Emitter* e,Output* out,int every,char* dest)
+	{
+	e->out=out;
+	e->every=every;
+	e->printed=0L;
+	e->n=0;
+	e->total=0;
+	e->dest=dest;
+	e->counts=NULL;
+	}
+
+static void emitFlush(Emitter* e)
+	{
+	if(e->n==0) return;
+	outWritev(e->out,e->iov,e->n,e->total);
+	e->n=0;
+	e->total=0;
+	}
+
+static void emitSegment(Emitter* e,const char* p,size_t n)
+	{
+	if(e->n==IOV_BATCH) emitFlush(e);
+	e->iov[e->n].iov_base=(void*)p;
+	e->iov[e->n].iov_len=n;
+	e->n++;
+	e->total+=n;
+	}
+
+/* p must stay valid until emitFlush */
+static void emitBases(Emitter* e,const char* p,size_t n)
+	{
+	if(e->counts!=NULL)
+		{
+		countBases(e->counts,p,n);
+		e->printed+=n;
+		return;
+		}
+	if(e->dest!=NULL)
+		{
+		memcpy(&e->dest[e->printed],p,n);
+		e->printed+=n;
+		return;
+		}
+	while(n>0)
+		{
+		size_t k=n;
+		if(e->every>0)
+			{
+			long column=e->printed%e->every;
+			if(column==0) emitSegment(e,"\n",1);
+			if(k>(size_t)(e->every-column)) k=e->every-column;
+			}
+		emitSegment(e,p,k);
+		p+=k;
+		n-=k;
+		e->printed+=k;
+		}
+	}
+
+static void emitRegion(
+	Emitter* e,
+	const Genome* g,
+	RAZF *rz,
+	long chromStart,
+	long chromEnd,
+	const faidx1_t* index,
+	int tid
+	)
+	{
+	int64_t pos;
+	long toPrint;
+	uint64_t t0;
+
+	if(chromStart>= index->len) return ;
+	chromEnd=MIN(index->len,chromEnd);
+	if(chromStart>=chromEnd) return;
+	toPrint=chromEnd-chromStart;
+	if(g->tb!=NULL)
+		{
+		char buff[BUFSIZ*8];
+		t0=nowMicros();
+		if(e->dest!=NULL)
+			{
+			e->printed+=twobit_fetch(g->tb,tid,chromStart,chromEnd,&e->dest[e->printed]);
+			e->out->phase_us[PHASE_READ]+=nowMicros()-t0;
+			return;
+			}
+		while(chromStart<chromEnd)
+			{
+			long n;
+			t0=nowMicros();
+			n=twobit_fetch(g->tb,tid,chromStart,MIN(chromEnd,chromStart+BUFSIZ*8),buff);
+			e->out->phase_us[PHASE_READ]+=nowMicros()-t0;
+			if(n<=0) break;
+			emitBases(e,buff,n);
+			emitFlush(e);
+			chromStart+=n;
+			}
+		return;
+		}
+
+	pos= 	index->offset +
+		(chromStart / index->line_blen) * index->line_len +
+		chromStart % index->line_blen
+		;
+	if(g->map!=NULL)
+		{
+		/* line-aligned segments of the mapped file */
+		while(chromStart<chromEnd)
+			{
+			long column=chromStart % index->line_blen;
+			long n=MIN(index->line_blen-column,chromEnd-chromStart);
+			if(pos+n>(int64_t)g->map_len) break;
+			emitBases(e,g->map+pos,n);
+			chromStart+=n;
+			pos+=index->line_len-column;
+			}
+		emitFlush(e);
+		return;
+		}
+	t0=nowMicros();
+	if(g->gz==NULL) razf_seek(rz,pos , SEEK_SET);
+	e->out->phase_us[PHASE_READ]+=nowMicros()-t0;
+	while(toPrint>0)
+		{
+		long i=0;
+		char buff[BUFSIZ*8];
+		/* the bases left and their ends of line */
+		long want=MIN(BUFSIZ*8,(toPrint/index->line_blen+2)*(long)index->line_len);
+		long nRead;
+		t0=nowMicros();
+		nRead=(g->gz!=NULL?
+			(long)gzi_read(g->gz,pos,buff,want):
+			(long)razf_read(rz,buff,want));
+		e->out->phase_us[PHASE_READ]+=nowMicros()-t0;
+		if(nRead<=0) break;
+		while(i<nRead && toPrint>0)
+			{
+			/* skip the end of the line */
+			long column=(pos+i-index->offset)%index->line_len;
+			long n;
+			if(column>=index->line_blen)
+				{
+				i+=index->line_len-column;
+				continue;
+				}
+			n=MIN(index->line_blen-column,nRead-i);
+			n=MIN(n,toPrint);
+			emitBases(e,&buff[i],n);
+			i+=n;
+			toPrint-=n;
+			}
+		emitFlush(e);
+		pos+=nRead;
+		}
+	}
+
+static void echo(
+	Output* out,
+	const Genome* g,
+	RAZF *rz,
+	const Region* r,
+	int every
+	)
+	{
+	Emitter e;
+	emitInit(&e,out,every,NULL);
+	if(r->seq!=NULL)
+		{
+		emitBases(&e,r->seq,r->seq_len);
+		emitFlush(&e);
+		}
+	else
+		{
+		emitRegion(&e,g,rz,r->chromStart,r->chromEnd,r->index,r->tid);
+		}
+	}
+
+static Region* newRegion(Request* req)
+	{
+	Region* r;
+	if(req->n_regions==req->max_regions)
+		{
+		Region* array=realloc(req->regions,(req->max_regions+BUFSIZ)*sizeof(Region));
+		if(array==NULL) return NULL;
+		req->regions=array;
+		req->max_regions+=BUFSIZ;
+		}
+	r=&req->regions[req->n_regions++];
+	memset(r,0,sizeof(Region));
+	return r;
+	}
+
+/* add a region 'chrom:start-end' or a BED line 'chrom start end', the string is modified */
+static void addRegion(Request* req,char* s)
+	{
+	char* chrom=s;
+	char* endptr;
+	char* p;
+	Region* r;
+	while(isspace(*chrom)) ++chrom;
+	if(*chrom==0 || *chrom=='#' || strncmp(chrom,"track",5)==0 || strncmp(chrom,"browser",7)==0) return;
+	p=strpbrk(chrom," \t");
+	if(p==NULL) p=strrchr(chrom,':');
+	if(p==NULL || (r=newRegion(req))==NULL)
+		{
+		if(req->bad_region==NULL) req->bad_region=s;
+		return;
+		}
+	*p++=0;
+	r->chrom=chrom;
+	errno=0;
+	r->chromStart=strtol(p,&endptr,10);
+	if(endptr==p || (*endptr!='-' && !isspace(*endptr)) || r->chromStart<0 || errno!=0)
+		{
+		if(req->bad_region==NULL) req->bad_region=chrom;
+		req->n_regions--;
+		return;
+		}
+	p=endptr+1;
+	r->chromEnd=strtol(p,&endptr,10);
+	if(endptr==p || (*endptr!=0 && !isspace(*endptr)) || r->chromEnd<r->chromStart || errno!=0)
+		{
+		if(req->bad_region==NULL) req->bad_region=chrom;
+		req->n_regions--;
+		return;
+		}
+	}
+
+/* add the lines of a POST body, the body is modified */
+static void addRegions(Request* req,char* body)
+	{
+	while(body!=NULL && *body!=0)
+		{
+		char* eol=strchr(body,'\n');
+		if(eol!=NULL) *eol++=0;
+		addRegion(req,body);
+		body=eol;
+		}
+	}
+
+/* decode the CGI string, the string is modified */
+static void parseQuery(char* query_string,Request* req)
+	{
+	const char* end=query_string+strlen(query_string);
+	char* prev=query_string;
+	while(prev!=end)
+		{
+		char* amp=strchr(prev,'&');
+		char* eq=NULL;
+		if(amp==NULL) amp=(char*)end;
+		*amp=0;
+		eq=strchr(prev,'=');
+		if(eq!=NULL && eq!=prev)
+			{
+			char* key=prev;
+			char* value;
+			*eq=0;
+			value=++eq;
+			key=decode(key);
+			value=decode(value);
+			if(strcmp(key,"tid")==0 || strcmp(key,"chrom")==0)
+				{
+				req->chrom=value;
+				}
+			else if(strcmp(key,"start")==0)
+				{
+				req->chrom_start_str=value;
+				}
+			else if(strcmp(key,"end")==0)
+				{
+				req->chrom_end_str=value;
+				}
+			else if(strcmp(key,"fmt")==0 || strcmp(key,"format")==0)
+				{
+				req->format=value;
+				}
+			else if(strcmp(key,"region")==0)
+				{
+				addRegion(req,value);
+				}
+			else if(strcmp(key,"strand")==0)
+				{
+				req->strand=value;
+				}
+			else if(strcmp(key,"translate")==0)
+				{
+				req->translate=value;
+				}
+			else if(strcmp(key,"stats")==0)
+				{
+				req->stats=value;
+				}
+			else if(strcmp(key,"build")==0)
+				{
+				req->build=value;
+				}
+			}
+		if(amp==end) break;
+		prev=++amp;
+		}
+	}
+
+enum { FORMAT_FASTA, FORMAT_TEXT, FORMAT_JSON, FORMAT_XML };
+
+static const char* FORMAT_MIME[]={"text/plain","text/plain","application/json","text/xml"};
+static const char* FORMAT_EXT[]={"fa","txt","json","xml"};
+
+static int parseFormat(const char* format)
+	{
+	if(format!=NULL && strcasecmp(format,"json")==0) return FORMAT_JSON;
+	if(format!=NULL && strcasecmp(format,"xml")==0) return FORMAT_XML;
+	if(format!=NULL && strcasecmp(format,"text")==0) return FORMAT_TEXT;
+	return FORMAT_FASTA;
+	}
+
+/* number of bases of the region in the genome */
+static long regionLength(const Region* r)
+	{
+	if(r->chromStart>=r->index->len) return 0;
+	return MIN(r->index->len,r->chromEnd)-r->chromStart;
+	}
+
+/* reads the bases of the region in memory */
+static int loadSequence(Output* out,const Genome* g,RAZF* rz,Region* r)
+	{
+	Emitter e;
+	long len=regionLength(r);
+	if(r->seq!=NULL) return 0;
+	if((r->seq=malloc(len>0?len:1))==NULL) return -1;
+	emitInit(&e,out,-1,r->seq);
+	emitRegion(&e,g,rz,r->chromStart,r->chromEnd,r->index,r->tid);
+	r->seq_len=e.printed;
+	return 0;
+	}
+
+#define STATS_HEADER "#build\tchrom\tstart\tend\tlength\tgc_percent\tA\tC\tG\tT\tN\tlowercase_fraction\n"
+
+/* prints the composition of the region, the sequence is not sent */
+static void printStats(Output* out,const Genome* g,RAZF* rz,int format,const Region* r,long i)
+	{
+	uint64_t counts[4][256];
+	uint64_t total[256];
+	uint64_t length=0,lower=0,a,c,gg,t,n,acgt;
+	double gc,lowercase;
+	Emitter e;
+	int j;
+	memset(counts,0,sizeof(counts));
+	if(r->seq!=NULL)
+		{
+		countBases(counts,r->seq,r->seq_len);
+		}
+	else
+		{
+		emitInit(&e,out,-1,NULL);
+		e.counts=counts;
+		emitRegion(&e,g,rz,r->chromStart,r->chromEnd,r->index,r->tid);
+		}
+	for(j=0;j< 256;++j)
+		{
+		total[j]=counts[0][j]+counts[1][j]+counts[2][j]+counts[3][j];
+		length+=total[j];
+		if(islower(j)) lower+=total[j];
+		}
+	a=total['A']+total['a'];
+	c=total['C']+total['c'];
+	gg=total['G']+total['g'];
+	t=total['T']+total['t'];
+	n=total['N']+total['n'];
+	acgt=a+c+gg+t;
+	gc=(acgt==0?0.0:(100.0*(gg+c))/acgt);
+	lowercase=(length==0?0.0:(double)lower/length);
+	switch(format)
+		{
+		case FORMAT_JSON:
+			if(i>0) outPuts(out,",\n");
+			outPrintf(out,"{\"build\":\"%s\",\"chrom\":\"%s\",",g->build,r->chrom);
+			outPrintf(out,"\"start\":%ld,\"end\":%ld,",r->chromStart,r->chromEnd);
+			outPrintf(out,"\"length\":%llu,\"gc_percent\":%.3f,",(unsigned long long)length,gc);
+			outPrintf(out,"\"A\":%llu,\"C\":%llu,\"G\":%llu,\"T\":%llu,\"N\":%llu,",
+				(unsigned long long)a,(unsigned long long)c,(unsigned long long)gg,(unsigned long long)t,(unsigned long long)n);
+			outPrintf(out,"\"lowercase_fraction\":%.5f}",lowercase);
+			if(i<0) outPutc(out,'\n');
+			break;
+		case FORMAT_XML:
+			outPrintf(out,"<stats build=\"%s\" chrom=\"%s\"",g->build,r->chrom);
+			outPrintf(out," start=\"%ld\" end=\"%ld\"",r->chromStart,r->chromEnd);
+			outPrintf(out," length=\"%llu\" gc_percent=\"%.3f\"",(unsigned long long)length,gc);
+			outPrintf(out," A=\"%llu\" C=\"%llu\" G=\"%llu\" T=\"%llu\" N=\"%llu\"",
+				(unsigned long long)a,(unsigned long long)c,(unsigned long long)gg,(unsigned long long)t,(unsigned long long)n);
+			outPrintf(out," lowercase_fraction=\"%.5f\"/>\n",lowercase);
+			break;
+		default:
+			outPrintf(out,"%s\t%s\t%ld\t%ld\t%llu\t%.3f\t%llu\t%llu\t%llu\t%llu\t%llu\t%.5f\n",
+				g->build,r->chrom,r->chromStart,r->chromEnd,
+				(unsigned long long)length,gc,
+				(unsigned long long)a,(unsigned long long)c,(unsigned long long)gg,(unsigned long long)t,(unsigned long long)n,
+				lowercase);
+			break;
+		}
+	}
+
+/* print one record, 'i' is the index of the record in a batch, or -1 for a single region */
+static void printRecord(Output* out,const Genome* g,RAZF* rz,const Request* req,int format,Region* r,long i)
+	{
+	if(req->stats_only)
+		{
+		printStats(out,g,rz,format,r,i);
+		return;
+		}
+	if(req->reverse || req->frame>0)
+		{
+		if(loadSequence(out,g,rz,r)!=0)
+			{
+			fail(out,"Out of memory",500);
+			return;
+			}
+		if(req->reverse) reverseComplement(r->seq,r->seq_len);
+		if(req->frame>0) r->seq_len=translate(r->seq,r->seq_len,req->frame-1);
+		}
+	switch(format)
+		{
+		case FORMAT_JSON:
+			if(i>0) outPuts(out,",\n");
+			outPrintf(out,"{\"build\":\"%s\",\"chrom\":\"%s\",",g->build,r->chrom);
+			outPrintf(out,"\"start\":%ld,",r->chromStart);
+			outPrintf(out,"\"end\":%ld,",r->chromEnd);
+			if(req->reverse) outPuts(out,"\"strand\":\"-\",");
+			if(req->frame>0) outPrintf(out,"\"frame\":%d,",req->frame);
+			outPuts(out,"\"sequence\":\"");
+			echo(out,g,rz,r,-1);
+			outPuts(out,i<0?"\"}\n":"\"}");
+			break;
+		case FORMAT_XML:
+			outPuts(out,"<sequence");
+			outPrintf(out," build=\"%s\"",g->build);
+			outPrintf(out," chrom=\"%s\"",r->chrom);
+			outPrintf(out," start=\"%ld\"",r->chromStart);
+			outPrintf(out," end=\"%ld\"",r->chromEnd);
+			if(req->reverse) outPuts(out," strand=\"-\"");
+			if(req->frame>0) outPrintf(out," frame=\"%d\"",req->frame);
+			outPutc(out,'>');
+			echo(out,g,rz,r,-1);
+			outPuts(out,"</sequence>\n");
+			break;
+		case FORMAT_TEXT:
+			echo(out,g,rz,r,-1);
+			if(i>=0) outPutc(out,'\n');
+			break;
+		default:
+			outPrintf(out,">%s|%s:%ld-%ld",g->build,r->chrom,r->chromStart,r->chromEnd);
+			if(req->reverse) outPuts(out," strand=-");
+			if(req->frame>0) outPrintf(out," frame=%d",req->frame);
+			echo(out,g,rz,r,50);
+			outPutc(out,'\n');
+			break;
+		}
+	}
+
+static int compareOffsets(const void* a,const void* b)
+	{
+	const Region* r1=*(const Region**)a;
+	const Region* r2=*(const Region**)b;
+	if(r1->offset!=r2->offset) return r1->offset<r2->offset?-1:1;
+	return r1<r2?-1:(r1>r2?1:0);
+	}
+
+/* prints a batch of regions in the order of the request. Each window of regions is
+ * read in the order of the file: prefetched for a mapped genome, decompressed in memory
+ * otherwise */
+static void printBatch(Output* out,const Genome* g,RAZF* rz,int format,const Request* req)
+	{
+	Region** sorted=malloc(sizeof(Region*)*BATCH_REGIONS);
+	long pagesize=sysconf(_SC_PAGESIZE);
+	size_t i=0,j,k;
+	if(sorted==NULL)
+		{
+		fail(out,"Out of memory",500);
+		return;
+		}
+	while(i< req->n_regions && !out->error)
+		{
+		size_t bases=0;
+		for(j=i;j< req->n_regions && j-i< BATCH_REGIONS && bases< BATCH_BASES;++j)
+			{
+			sorted[j-i]=&req->regions[j];
+			bases+=regionLength(&req->regions[j]);
+			}
+		qsort(sorted,j-i,sizeof(Region*),compareOffsets);
+		for(k=0;k< j-i;++k)
+			{
+			Region* r=sorted[k];
+			long len=regionLength(r);
+			if(len<=0) continue;
+			if(g->map!=NULL)
+				{
+				int64_t start=r->offset-(r->offset%pagesize);
+				int64_t end=r->offset+(len/r->index->line_blen+1)*r->index->line_len;
+				if(end>(int64_t)g->map_len) end=g->map_len;
+				uint64_t t0=nowMicros();
+				madvise((void*)(g->map+start),end-start,MADV_WILLNEED);
+				out->phase_us[PHASE_READ]+=nowMicros()-t0;
+				}
+			else if((r->seq=malloc(len))!=NULL)
+				{
+				Emitter e;
+				emitInit(&e,out,-1,r->seq);
+				emitRegion(&e,g,rz,r->chromStart,r->chromEnd,r->index,r->tid);
+				r->seq_len=e.printed;
+				}
+			}
+		for(k=i;k< j;++k)
+			{
+			printRecord(out,g,rz,req,format,&req->regions[k],(long)k);
+			free(req->regions[k].seq);
+			req->regions[k].seq=NULL;
+			}
+		i=j;
+		}
+	free(sorted);
+	}
+
+/* parses a HTTP Range 'bytes=first-last' over a body of 'total' bytes.
+ * returns 1 if satisfiable, -1 if not, 0 if the range is ignored (malformed, or several ranges) */
+static int parseRange(const char* s,long total,long* first,long* last)
+	{
+	char* endptr;
+	long a,b;
+	while(*s==' ') ++s;
+	if(strncmp(s,"bytes=",6)!=0 || strchr(s,',')!=NULL) return 0;
+	s+=6;
+	if(*s=='-')
+		{
+		/* the last bytes */
+		b=strtol(s+1,&endptr,10);
+		if(endptr==s+1 || b<0) return 0;
+		if(b==0 || total==0) return -1;
+		a=(b>total?0:total-b);
+		b=total-1;
+		}
+	else
+		{
+		a=strtol(s,&endptr,10);
+		if(endptr==s || *endptr!='-' || a<0) return 0;
+		s=endptr+1;
+		if(*s==0)
+			{
+			b=total-1;
+			}
+		else
+			{
+			b=strtol(s,&endptr,10);
+			if(endptr==s || b<a) return 0;
+			}
+		if(a>=total) return -1;
+		if(b>=total) b=total-1;
+		}
+	*first=a;
+	*last=b;
+	return 1;
+	}
+
+/* answer a request. returns 0 on success */
+static int handleRequest(const Genome* g,Request* req,Output* out)
+	{
+	char disposition[BUFSIZ];
+	int format=parseFormat(req->format);
+	RAZF* rz=NULL;
+	size_t i;
+
+	if(req->bad_region!=NULL)
+		{
+		snprintf(disposition,BUFSIZ,"bad region '%s'",req->bad_region);
+		return fail(out,disposition,400);
+		}
+	if(req->strand!=NULL && req->strand[0]!=0)
+		{
+		/* a '+' was decoded as a space */
+		if(strcmp(req->strand,"-")==0) req->reverse=1;
+		else if(strcmp(req->strand,"+")!=0 && strcmp(req->strand," ")!=0) return fail(out,"bad value for strand",400);
+		}
+	if(req->translate!=NULL && req->translate[0]!=0)
+		{
+		if(strlen(req->translate)!=1 || req->translate[0]<'0' || req->translate[0]>'3') return fail(out,"bad value for translate (1,2,3)",400);
+		req->frame=req->translate[0]-'0';
+		}
+	if(req->stats!=NULL)
+		{
+		req->stats_only=(strcmp(req->stats,"1")==0 || strcasecmp(req->stats,"true")==0 || strcasecmp(req->stats,"yes")==0);
+		}
+	if(req->n_regions==0)
+		{
+		char* endptr=NULL;
+		Region* r;
+		NOTEMPTY(req->chrom,"chrom");
+		NOTEMPTY(req->chrom_start_str,"start");
+		NOTEMPTY(req->chrom_end_str,"end");
+		errno=0;
+		req->chromStart=strtol(req->chrom_start_str,&endptr,10);
+		if(req->chromStart<0 || errno!=0 ||*endptr!=0) return fail(out,"bad value for chromStart",400);
+		req->chromEnd=strtol(req->chrom_end_str,&endptr,10);
+		if(req->chromEnd<req->chromStart || errno!=0 ||*endptr!=0) return fail(out,"bad value for chromEnd",400);
+		if((r=newRegion(req))==NULL) return fail(out,"Out of memory",500);
+		r->chrom=req->chrom;
+		r->chromStart=req->chromStart;
+		r->chromEnd=req->chromEnd;
+		}
+	for(i=0;i< req->n_regions;++i)
+		{
+		Region* r=&req->regions[i];
+		const FaiEntry* entry=findEntry(g,r->chrom);
+		if(entry==NULL || entry->index.len<1)
+			{
+			if(req->n_regions==1) return fail(out,"Unknown chromosome",404);
+			snprintf(disposition,BUFSIZ,"Unknown chromosome '%s'",r->chrom);
+			return fail(out,disposition,404);
+			}
+		r->index=&entry->index;
+		r->tid=entry->tid;
+		if(g->tb!=NULL)
+			{
+			/* the sequences of a .2bit are stored in the order of their index */
+			r->offset=((int64_t)r->tid<<32)+r->chromStart;
+			}
+		else
+			{
+			r->offset=r->index->offset+
+				(r->chromStart / r->index->line_blen) * r->index->line_len +
+				r->chromStart % r->index->line_blen;
+			}
+		}
+	if(g->map==NULL && g->tb==NULL && g->gz==NULL)
+		{
+		rz = razf_open(g->path, "r");
+		if (rz == NULL)
+			{
+			return fail(out,"Cannot open genome",500);
+			}
+		}
+	if(req->chrom!=NULL && req->n_regions==1 && req->regions[0].chrom==req->chrom)
+		{
+		Region* r=&req->regions[0];
+		int status=200;
+		snprintf(disposition,BUFSIZ,"inline; filename=%s_%s_%ld_%ld.%s;",g->build,r->chrom,r->chromStart,r->chromEnd,FORMAT_EXT[format]);
+		if(format==FORMAT_TEXT && !req->stats_only && !req->reverse && req->frame==0)
+			{
+			/* the raw bases: the length is known and a byte range is a range of bases */
+			long total=regionLength(r),first,last;
+			int ret=(req->range==NULL?0:parseRange(req->range,total,&first,&last));
+			out->accept_ranges=1;
+			if(ret<0)
+				{
+				if(rz!=NULL) razf_close(rz);
+				fail(out,"Range Not Satisfiable",416);
+				snprintf(out->content_range,sizeof(out->content_range),"bytes */%ld",total);
+				return -1;
+				}
+			else if(ret>0)
+				{
+				snprintf(out->content_range,sizeof(out->content_range),"bytes %ld-%ld/%ld",first,last,total);
+				out->accept_gzip=0;
+				r->chromEnd=r->chromStart+last+1;
+				r->chromStart+=first;
+				status=206;
+				total=last-first+1;
+				}
+			out->content_length=total;
+			}
+		outHeader(out,status,FORMAT_MIME[format],disposition);
+		if(format==FORMAT_XML) outPuts(out,"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n");
+		else if(req->stats_only && format!=FORMAT_JSON) outPuts(out,STATS_HEADER);
+		printRecord(out,g,rz,req,format,&req->regions[0],-1);
+		free(req->regions[0].seq);
+		req->regions[0].seq=NULL;
+		}
+	else
+		{
+		snprintf(disposition,BUFSIZ,"inline; filename=%s_regions.%s;",g->build,FORMAT_EXT[format]);
+		outHeader(out,200,FORMAT_MIME[format],disposition);
+		if(format==FORMAT_XML) outPuts(out,"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n<sequences>\n");
+		else if(format==FORMAT_JSON) outPuts(out,"[");
+		else if(req->stats_only) outPuts(out,STATS_HEADER);
+		printBatch(out,g,rz,format,req);
+		if(format==FORMAT_XML) outPuts(out,"</sequences>\n");
+		else if(format==FORMAT_JSON) outPuts(out,"]\n");
+		}
+	if(rz!=NULL) razf_close(rz);
+	return 0;
+	}
+
+/* answer a request with the genome of its build */
+static int answer(Registry* reg,Request* req,Output* out)
+	{
+	char message[BUFSIZ];
+	int status=500,ret;
+	uint64_t t0=nowMicros();
+	Assembly* a=acquireGenome(reg,req->build,&status);
+	out->phase_us[PHASE_INDEX]+=nowMicros()-t0;
+	if(a!=NULL)
+		{
+		out->build=a->build;
+		out->assembly=(int)(a-reg->assemblies);
+		}
+	else
+		{
+		if(status==404) snprintf(message,BUFSIZ,"Unknown build '%s'",req->build);
+		else snprintf(message,BUFSIZ,"Cannot load genome %s",req->build==NULL?"":req->build);
+		return fail(out,message,status);
+		}
+	ret=handleRequest(a->genome,req,out);
+	releaseGenome(reg,a);
+	return ret;
+	}
+
+/* the counters of one thread of the server, only written by this thread */
+typedef struct
+	{
+	uint64_t requests;
+	/* responses by class of status: 1xx...5xx */
+	uint64_t responses[6];
+	uint64_t bytes;
+	/* requests of each build of the registry */
+	uint64_t* build_requests;
+	/* histograms of the phases, the last bucket is +Inf */
+	uint64_t histogram[N_PHASES][N_BUCKETS+1];
+	uint64_t sum_us[N_PHASES];
+	/* not on the cache line of the next thread */
+	char padding[64];
+	}ThreadStats;
+
+static void recordRequest(ThreadStats* st,const Output* out)
+	{
+	int i,b;
+	STAT_ADD(st->requests,1);
+	STAT_ADD(st->responses[MIN(out->status/100,5)],1);
+	STAT_ADD(st->bytes,out->bytes);
+	if(out->assembly>=0) STAT_ADD(st->build_requests[out->assembly],1);
+	for(i=0;i< N_PHASES;++i)
+		{
+		for(b=0;b< N_BUCKETS && out->phase_us[i]>BUCKETS[b];++b) {}
+		STAT_ADD(st->histogram[i][b],1);
+		STAT_ADD(st->sum_us[i],out->phase_us[i]);
+		}
+	}
+
+/* one line per request on stderr */
+static void logRequest(const Output* out,const Request* req)
+	{
+	int i;
+	char line[BUFSIZ];
+	int n=snprintf(line,BUFSIZ,"[faidx] build=%s status=%d regions=%lu bytes=%llu",
+		out->build==NULL?"-":out->build,out->status,
+		(unsigned long)req->n_regions,(unsigned long long)out->bytes);
+	for(i=0;i< N_PHASES && n< BUFSIZ;++i)
+		{
+		n+=snprintf(&line[n],BUFSIZ-n," %s_us=%llu",PHASE_NAMES[i],(unsigned long long)out->phase_us[i]);
+		}
+	fprintf(stderr,"%s\n",line);
+	}
+
+/** the HTTP server */
+typedef struct
+	{
+	Registry* registry;
+	/* one per thread, n_started were given to a thread */
+	ThreadStats* stats;
+	int n_stats;
+	int n_started;
+	/* log each request */
+	int log;
+	/* accepted sockets waiting for a thread */
+	int queue[QUEUE_SIZE];
+	size_t q_head;
+	size_t q_count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	}Server;
+
+/* a connection with a client, requests may be pipelined */
+typedef struct
+	{
+	int fd;
+	char buffer[HTTP_MAX_HEADER+1];
+	size_t len;
+	}Connection;
+
+/* end of the headers in the buffer, NULL if not complete */
+static char* endOfHeaders(Connection* c,size_t* header_len)
+	{
+	char* p=strstr(c->buffer,"\r\n\r\n");
+	if(p!=NULL)
+		{
+		*header_len=(p+4)-c->buffer;
+		return p;
+		}
+	p=strstr(c->buffer,"\n\n");
+	if(p!=NULL)
+		{
+		*header_len=(p+2)-c->buffer;
+		return p;
+		}
+	return NULL;
+	}
+
+/* copy the value of a header in 'value', returns NULL if missing. The headers must be nul-terminated,
+ * a header is matched at the start of 'headers' and after each '\n' */
+static char* findHeader(const char* headers,const char* name,char* value,size_t size)
+	{
+	size_t n=strlen(name),k=0;
+	const char* p=headers;
+	for(;;)
+		{
+		if(*p=='\n') ++p;
+		if(strncasecmp(p,name,n)==0 && p[n]==':')
+			{
+			p+=n+1;
+			while(*p==' ' || *p=='\t') ++p;
+			while(p[k]!=0 && p[k]!='\r' && p[k]!='\n' && k+1<size)
+				{
+				value[k]=p[k];
+				++k;
+				}
+			value[k]=0;
+			return value;
+			}
+		if((p=strchr(p,'\n'))==NULL) return NULL;
+		}
+	}
+
+/* the client accepts a gzip body: 'gzip' listed in Accept-Encoding without q=0 */
+static int acceptGzip(const char* encodings)
+	{
+	const char* p=(encodings==NULL?NULL:strstr(encodings,"gzip"));
+	if(p==NULL) return 0;
+	p+=4;
+	while(*p==' ') ++p;
+	if(*p!=';') return 1;
+	++p;
+	while(*p==' ') ++p;
+	return !(p[0]=='q' && p[1]=='=' && atof(p+2)==0);
+	}
+
+/* read a body of 'length' bytes following the headers, returns NULL on error */
+static char* readBody(Connection* c,size_t header_len,size_t length,size_t* consumed)
+	{
+	char* body=malloc(length+1);
+	size_t n=c->len-header_len;
+	if(body==NULL) return NULL;
+	if(n>length) n=length;
+	memcpy(body,&c->buffer[header_len],n);
+	*consumed=header_len+n;
+	while(n< length)
+		{
+		ssize_t r=read(c->fd,&body[n],length-n);
+		if(r<0 && errno==EINTR) continue;
+		if(r<=0)
+			{
+			free(body);
+			return NULL;
+			}
+		n+=r;
+		}
+	body[length]=0;
+	return body;
+	}
+
+/* the counters of the threads and of the genomes, in the Prometheus text format */
+static void printMetrics(Server* server,Output* out)
+	{
+	Registry* reg=server->registry;
+	ThreadStats sum;
+	/* requests, cache hits and cache misses of each build */
+	uint64_t* builds=calloc(3*(reg->n_assemblies+1),sizeof(uint64_t));
+	uint64_t* hits=builds+(reg->n_assemblies+1);
+	uint64_t* misses=hits+(reg->n_assemblies+1);
+	uint64_t loads,evictions;
+	size_t loaded=0,used;
+	int i,j,b;
+	if(builds==NULL)
+		{
+		fail(out,"Out of memory",500);
+		return;
+		}
+	memset(&sum,0,sizeof(ThreadStats));
+	for(i=0;i< server->n_stats;++i)
+		{
+		ThreadStats* st=&server->stats[i];
+		sum.requests+=STAT_GET(st->requests);
+		sum.bytes+=STAT_GET(st->bytes);
+		for(j=0;j< 6;++j) sum.responses[j]+=STAT_GET(st->responses[j]);
+		for(j=0;j< (int)reg->n_assemblies;++j) builds[j]+=STAT_GET(st->build_requests[j]);
+		for(j=0;j< N_PHASES;++j)
+			{
+			sum.sum_us[j]+=STAT_GET(st->sum_us[j]);
+			for(b=0;b<=N_BUCKETS;++b) sum.histogram[j][b]+=STAT_GET(st->histogram[j][b]);
+			}
+		}
+	outHeader(out,200,"text/plain; version=0.0.4",NULL);
+	outPuts(out,"# HELP faidx_requests_total Requests answered.\n# TYPE faidx_requests_total counter\n");
+	outPrintf(out,"faidx_requests_total %llu\n",(unsigned long long)sum.requests);
+	outPuts(out,"# HELP faidx_responses_total Responses by class of status.\n# TYPE faidx_responses_total counter\n");
+	for(j=1;j< 6;++j) outPrintf(out,"faidx_responses_total{code=\"%dxx\"} %llu\n",j,(unsigned long long)sum.responses[j]);
+	outPuts(out,"# HELP faidx_response_bytes_total Bytes sent, headers included.\n# TYPE faidx_response_bytes_total counter\n");
+	outPrintf(out,"faidx_response_bytes_total %llu\n",(unsigned long long)sum.bytes);
+	outPuts(out,"# HELP faidx_phase_duration_seconds Time spent in each phase of a request.\n# TYPE faidx_phase_duration_seconds histogram\n");
+	for(j=0;j< N_PHASES;++j)
+		{
+		uint64_t n=0;
+		for(b=0;b<=N_BUCKETS;++b)
+			{
+			n+=sum.histogram[j][b];
+			if(b< N_BUCKETS) outPrintf(out,"faidx_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",PHASE_NAMES[j],BUCKETS[b]/1.0E6,(unsigned long long)n);
+			else outPrintf(out,"faidx_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",PHASE_NAMES[j],(unsigned long long)n);
+			}
+		outPrintf(out,"faidx_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n",PHASE_NAMES[j],sum.sum_us[j]/1.0E6);
+		outPrintf(out,"faidx_phase_duration_seconds_count{phase=\"%s\"} %llu\n",PHASE_NAMES[j],(unsigned long long)n);
+		}
+	outPuts(out,"# HELP faidx_build_requests_total Requests of each build.\n# TYPE faidx_build_requests_total counter\n");
+	for(j=0;j< (int)reg->n_assemblies;++j)
+		{
+		outPrintf(out,"faidx_build_requests_total{build=\"%s\"} %llu\n",reg->assemblies[j].build,(unsigned long long)builds[j]);
+		}
+	/* the genomes cannot be unloaded while the registry is locked:
+	 * copy the counters and release the lock before writing them */
+	pthread_mutex_lock(&reg->lock);
+	for(j=0;j< (int)reg->n_assemblies;++j)
+		{
+		Assembly* a=&reg->assemblies[j];
+		hits[j]=a->cache_hits;
+		misses[j]=a->cache_misses;
+		if(a->genome!=NULL) loaded++;
+		if(a->genome!=NULL && a->genome->gz!=NULL)
+			{
+			uint64_t h,m;
+			gzi_stats(a->genome->gz,&h,&m);
+			hits[j]+=h;
+			misses[j]+=m;
+			}
+		}
+	used=reg->used;
+	loads=reg->loads;
+	evictions=reg->evictions;
+	pthread_mutex_unlock(&reg->lock);
+	outPuts(out,"# HELP faidx_block_cache_hits_total Inflated blocks of a bgzip'd genome found in the cache.\n# TYPE faidx_block_cache_hits_total counter\n");
+	outPuts(out,"# HELP faidx_block_cache_misses_total Blocks of a bgzip'd genome inflated.\n# TYPE faidx_block_cache_misses_total counter\n");
+	for(j=0;j< (int)reg->n_assemblies;++j)
+		{
+		if(hits[j]+misses[j]==0) continue;
+		outPrintf(out,"faidx_block_cache_hits_total{build=\"%s\"} %llu\n",reg->assemblies[j].build,(unsigned long long)hits[j]);
+		outPrintf(out,"faidx_block_cache_misses_total{build=\"%s\"} %llu\n",reg->assemblies[j].build,(unsigned long long)misses[j]);
+		}
+	outPuts(out,"# HELP faidx_genomes_loaded Genomes in memory.\n# TYPE faidx_genomes_loaded gauge\n");
+	outPrintf(out,"faidx_genomes_loaded %lu\n",(unsigned long)loaded);
+	outPuts(out,"# HELP faidx_genome_memory_bytes Memory of the loaded genomes.\n# TYPE faidx_genome_memory_bytes gauge\n");
+	outPrintf(out,"faidx_genome_memory_bytes %lu\n",(unsigned long)used);
+	outPuts(out,"# HELP faidx_genome_loads_total Genomes loaded.\n# TYPE faidx_genome_loads_total counter\n");
+	outPrintf(out,"faidx_genome_loads_total %llu\n",(unsigned long long)loads);
+	outPuts(out,"# HELP faidx_genome_evictions_total Genomes unloaded to respect the memory budget.\n# TYPE faidx_genome_evictions_total counter\n");
+	outPrintf(out,"faidx_genome_evictions_total %llu\n",(unsigned long long)evictions);
+	free(builds);
+	}
+
+static void serveConnection(Server* server,ThreadStats* stats,Connection* c)
+	{
+	Registry* reg=server->registry;
+	Output* out=malloc(sizeof(Output));
+	if(out==NULL) return;
+	c->len=0;
+	c->buffer[0]=0;
+	for(;;)
+		{
+		size_t header_len=0,consumed;
+		Request req;
+		char* body=NULL;
+		char* eoh;
+		char* method;
+		char* target;
+		char* version;
+		char* query;
+		char value[BUFSIZ];
+		char range[100];
+		char* p;
+		int http11;
+		uint64_t t_start;
+		while((eoh=endOfHeaders(c,&header_len))==NULL)
+			{
+			ssize_t n;
+			if(c->len>=HTTP_MAX_HEADER)
+				{
+				outInit(out,c->fd,1);
+				fail(out,"Request header too large",431);
+				outEnd(out);
+				free(out);
+				return;
+				}
+			n=read(c->fd,&c->buffer[c->len],HTTP_MAX_HEADER-c->len);
+			if(n<0 && errno==EINTR) continue;
+			if(n<=0)
+				{
+				free(out);
+				return;
+				}
+			c->len+=n;
+			c->buffer[c->len]=0;
+			}
+		t_start=nowMicros();
+		*eoh=0;
+		/* request line */
+		method=c->buffer;
+		while(*method=='\r' || *method=='\n') ++method;
+		target=strchr(method,' ');
+		if(target!=NULL) *target++=0;
+		version=(target==NULL?NULL:strchr(target,' '));
+		if(version!=NULL) *version++=0;
+		p=(version==NULL?NULL:strpbrk(version,"\r\n"));
+		if(p!=NULL)
+			{
+			/* 'p' is the start of the headers, after the "\r\n" or "\n" of the request line */
+			if(*p=='\r' && p[1]=='\n') *p++=0;
+			*p++=0;
+			}
+		http11=(version!=NULL && strncmp(version,"HTTP/1.1",8)==0);
+		outInit(out,c->fd,1);
+		out->can_chunk=http11;
+		out->keep_alive=http11;
+		memset(&req,0,sizeof(Request));
+		if(p!=NULL)
+			{
+			if(findHeader(p,"Connection",value,sizeof(value))!=NULL && strncasecmp(value,"close",5)==0) out->keep_alive=0;
+			out->accept_gzip=acceptGzip(findHeader(p,"Accept-Encoding",value,sizeof(value)));
+			req.range=findHeader(p,"Range",range,sizeof(range));
+			}
+		consumed=header_len;
+		query=(target==NULL?NULL:strchr(target,'?'));
+		if(target==NULL || version==NULL)
+			{
+			out->keep_alive=0;
+			fail(out,"Bad request",400);
+			}
+		else if(strcmp(method,"POST")==0)
+			{
+			/* a batch of regions, one per line */
+			long n=-1;
+			if(p!=NULL && findHeader(p,"Content-Length",value,sizeof(value))!=NULL) n=atol(value);
+			if(n<0)
+				{
+				out->keep_alive=0;
+				fail(out,"Content-Length missing",411);
+				}
+			else if(n>MAX_BODY_SIZE)
+				{
+				out->keep_alive=0;
+				fail(out,"Body too large",413);
+				}
+			else if((body=readBody(c,header_len,n,&consumed))==NULL)
+				{
+				out->keep_alive=0;
+				fail(out,"Cannot read body",400);
+				}
+			else
+				{
+				if(query!=NULL) parseQuery(query+1,&req);
+				addRegions(&req,body);
+				out->phase_us[PHASE_PARSE]=nowMicros()-t_start;
+				if(req.n_regions==0 && req.bad_region==NULL) fail(out,"No region",400);
+				else answer(reg,&req,out);
+				}
+			}
+		else if(strcmp(method,"GET")!=0)
+			{
+			out->keep_alive=0;
+			fail(out,"GET method expected",406);
+			}
+		else if(strncmp(target,"/metrics",8)==0 && (target[8]==0 || target[8]=='?'))
+			{
+			printMetrics(server,out);
+			}
+		else if(query==NULL || query[1]==0)
+			{
+			fail(out,"QUERY_STRING missing",406);
+			}
+		else
+			{
+			parseQuery(query+1,&req);
+			out->phase_us[PHASE_PARSE]=nowMicros()-t_start;
+			answer(reg,&req,out);
+			}
+		outEnd(out);
+		out->phase_us[PHASE_TOTAL]=nowMicros()-t_start;
+		recordRequest(stats,out);
+		if(server->log) logRequest(out,&req);
+		free(req.regions);
+		free(body);
+		/* keep the next pipelined requests */
+		memmove(c->buffer,&c->buffer[consumed],c->len-consumed);
+		c->len-=consumed;
+		c->buffer[c->len]=0;
+		if(!out->keep_alive || out->error) break;
+		}
+	free(out);
+	}
+
+static void* serverWorker(void* ptr)
+	{
+	Server* server=(Server*)ptr;
+	Connection* c=malloc(sizeof(Connection));
+	ThreadStats* stats;
+	if(c==NULL) return NULL;
+	pthread_mutex_lock(&server->lock);
+	stats=&server->stats[server->n_started++];
+	pthread_mutex_unlock(&server->lock);
+	for(;;)
+		{
+		pthread_mutex_lock(&server->lock);
+		while(server->q_count==0) pthread_cond_wait(&server->not_empty,&server->lock);
+		c->fd=server->queue[server->q_head];
+		server->q_head=(server->q_head+1)%QUEUE_SIZE;
+		server->q_count--;
+		pthread_cond_signal(&server->not_full);
+		pthread_mutex_unlock(&server->lock);
+		serveConnection(server,stats,c);
+		close(c->fd);
+		}
+	free(c);
+	return NULL;
+	}
+
+static int openServerSocket(const char* host,int port)
+	{
+	struct sockaddr_in addr;
+	int on=1;
+	int fd=socket(AF_INET,SOCK_STREAM,0);
+	if(fd<0) return -1;
+	setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	if(inet_pton(AF_INET,host,&addr.sin_addr)!=1 ||
+	   bind(fd,(struct sockaddr*)&addr,sizeof(addr))!=0 ||
+	   listen(fd,SOMAXCONN)!=0)
+		{
+		close(fd);
+		return -1;
+		}
+	return fd;
+	}
+
+/* the main thread accepts the connections, a pool of threads answers them */
+static int serve(Registry* reg,const char* host,int port,int nthreads,int log)
+	{
+	Server server;
+	pthread_t thread;
+	int i;
+	int fd=openServerSocket(host,port);
+	if(fd<0)
+		{
+		fprintf(stderr,"[faidx] cannot listen on %s:%d %s\n",host,port,strerror(errno));
+		return EXIT_FAILURE;
+		}
+	signal(SIGPIPE,SIG_IGN);
+	memset(&server,0,sizeof(Server));
+	server.registry=reg;
+	server.log=log;
+	server.n_stats=nthreads;
+	if((server.stats=calloc(nthreads,sizeof(ThreadStats)))==NULL) return EXIT_FAILURE;
+	for(i=0;i< nthreads;++i)
+		{
+		if((server.stats[i].build_requests=calloc(reg->n_assemblies,sizeof(uint64_t)))==NULL) return EXIT_FAILURE;
+		}
+	pthread_mutex_init(&server.lock,NULL);
+	pthread_cond_init(&server.not_empty,NULL);
+	pthread_cond_init(&server.not_full,NULL);
+	for(i=0;i< nthreads;++i)
+		{
+		if(pthread_create(&thread,NULL,serverWorker,&server)!=0)
+			{
+			fprintf(stderr,"[faidx] cannot create thread\n");
+			return EXIT_FAILURE;
+			}
+		pthread_detach(thread);
+		}
+	fprintf(stderr,"[faidx] listening on http://%s:%d/ with %d threads, %lu builds\n",host,port,nthreads,(unsigned long)reg->n_assemblies);
+	for(;;)
+		{
+		int on=1;
+		struct timeval timeout;
+		int client=accept(fd,NULL,NULL);
+		if(client<0)
+			{
+			if(errno==EINTR) continue;
+			fprintf(stderr,"[faidx] accept failed %s\n",strerror(errno));
+			break;
+			}
+		/* the responses are already buffered, an idle client must not keep a thread */
+		setsockopt(client,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+		timeout.tv_sec=KEEP_ALIVE_TIMEOUT;
+		timeout.tv_usec=0;
+		setsockopt(client,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+		pthread_mutex_lock(&server.lock);
+		while(server.q_count==QUEUE_SIZE) pthread_cond_wait(&server.not_full,&server.lock);
+		server.queue[(server.q_head+server.q_count)%QUEUE_SIZE]=client;
+		server.q_count++;
+		pthread_cond_signal(&server.not_empty);
+		pthread_mutex_unlock(&server.lock);
+		}
+	close(fd);
+	return EXIT_FAILURE;
+	}
+
+/** the load generator */
+typedef struct
+	{
+	const Genome* genome;
+	const char* host;
+	int port;
+	int length;
+	const char* format;
+	size_t n_requests;
+	unsigned int seed;
+	/* latencies in milliseconds */
+	double* latencies;
+	size_t failed;
+	uint64_t bytes;
+	}Bench;
+
+/* buffered reader of a HTTP response */
+typedef struct
+	{
+	int fd;
+	char buffer[OUTPUT_BUFFER];
+	size_t pos;
+	size_t len;
+	}Reader;
+
+static int readerGetc(Reader* r)
+	{
+	if(r->pos==r->len)
+		{
+		ssize_t n;
+		while((n=read(r->fd,r->buffer,OUTPUT_BUFFER))<0 && errno==EINTR) {}
+		if(n<=0) return -1;
+		r->pos=0;
+		r->len=n;
+		}
+	return (unsigned char)r->buffer[r->pos++];
+	}
+
+/* read a line without the CRLF, returns -1 at EOF */
+static int readerLine(Reader* r,char* line,size_t size)
+	{
+	size_t n=0;
+	int c;
+	while((c=readerGetc(r))!=-1 && c!='\n')
+		{
+		if(c!='\r' && n+1< size) line[n++]=c;
+		}
+	line[n]=0;
+	return (c==-1 && n==0)?-1:0;
+	}
+
+static int readerSkip(Reader* r,uint64_t n)
+	{
+	while(n>0)
+		{
+		size_t k;
+		if(r->pos==r->len && readerGetc(r)!=-1) { r->pos--; }
+		if(r->pos==r->len) return -1;
+		k=r->len-r->pos;
+		if(k>n) k=n;
+		r->pos+=k;
+		n-=k;
+		}
+	return 0;
+	}
+
+/* read a response, returns the size of the body or -1 */
+static int64_t readResponse(Reader* r)
+	{
+	char line[BUFSIZ];
+	int status=0,chunked=0;
+	int64_t length=-1,total=0;
+	if(readerLine(r,line,BUFSIZ)!=0 || sscanf(line,"HTTP/%*d.%*d %d",&status)!=1) return -1;
+	while(readerLine(r,line,BUFSIZ)==0 && line[0]!=0)
+		{
+		if(strncasecmp(line,"Content-Length:",15)==0) length=strtoll(line+15,NULL,10);
+		else if(strncasecmp(line,"Transfer-Encoding:",18)==0 && strstr(line,"chunked")!=NULL) chunked=1;
+		}
+	if(chunked)
+		{
+		for(;;)
+			{
+			int64_t n;
+			if(readerLine(r,line,BUFSIZ)!=0) return -1;
+			n=strtoll(line,NULL,16);
+			if(n==0) break;
+			if(readerSkip(r,n)!=0 || readerLine(r,line,BUFSIZ)!=0) return -1;
+			total+=n;
+			}
+		/* trailer */
+		while(readerLine(r,line,BUFSIZ)==0 && line[0]!=0) {}
+		}
+	else if(length>=0)
+		{
+		if(readerSkip(r,length)!=0) return -1;
+		total=length;
+		}
+	return status==200?total:-1;
+	}
+
+static int connectServer(const char* host,int port)
+	{
+	struct sockaddr_in addr;
+	int on=1;
+	int fd=socket(AF_INET,SOCK_STREAM,0);
+	if(fd<0) return -1;
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	if(inet_pton(AF_INET,host,&addr.sin_addr)!=1 || connect(fd,(struct sockaddr*)&addr,sizeof(addr))!=0)
+		{
+		close(fd);
+		return -1;
+		}
+	return fd;
+	}
+
+/* one keep-alive connection sending random regions */
+static void* benchWorker(void* ptr)
+	{
+	Bench* b=(Bench*)ptr;
+	Reader* r=malloc(sizeof(Reader));
+	size_t i;
+	if(r==NULL) return NULL;
+	r->fd=-1;
+	for(i=0;i< b->n_requests;++i)
+		{
+		char request[BUFSIZ];
+		struct timeval start,end;
+		const FaiEntry* e=&b->genome->entries[rand_r(&b->seed)%b->genome->n_entries];
+		long chromStart=(e->index.len>b->length?(long)(rand_r(&b->seed)%(e->index.len-b->length)):0);
+		int64_t n;
+		int len=snprintf(request,BUFSIZ,
+			"GET /?build=%s&chrom=%s&start=%ld&end=%ld&fmt=%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+			b->genome->build,e->name,chromStart,chromStart+b->length,b->format,b->host);
+		gettimeofday(&start,NULL);
+		if(r->fd<0)
+			{
+			r->pos=r->len=0;
+			if((r->fd=connectServer(b->host,b->port))<0)
+				{
+				b->latencies[i]=-1;
+				b->failed++;
+				continue;
+				}
+			}
+		if(writeFully(r->fd,request,len)!=0 || (n=readResponse(r))<0)
+			{
+			close(r->fd);
+			r->fd=-1;
+			b->latencies[i]=-1;
+			b->failed++;
+			continue;
+			}
+		gettimeofday(&end,NULL);
+		b->bytes+=n;
+		b->latencies[i]=(end.tv_sec-start.tv_sec)*1000.0+(end.tv_usec-start.tv_usec)/1000.0;
+		}
+	if(r->fd>=0) close(r->fd);
+	free(r);
+	return NULL;
+	}
+
+static int compareDouble(const void* a,const void* b)
+	{
+	double x=*(const double*)a;
+	double y=*(const double*)b;
+	return x<y?-1:(x>y?1:0);
+	}
+
+/* send 'n_requests' requests of random regions with 'nthreads' connections, print the latencies */
+static int benchmark(const Genome* g,const char* host,int port,int nthreads,size_t n_requests,int length,const char* format)
+	{
+	pthread_t* threads=malloc(sizeof(pthread_t)*nthreads);
+	Bench* benchs=malloc(sizeof(Bench)*nthreads);
+	double* latencies=malloc(sizeof(double)*(n_requests+1));
+	struct timeval start,end;
+	size_t i,j,n_ok=0,failed=0;
+	uint64_t bytes=0;
+	double elapsed;
+	if(threads==NULL || benchs==NULL || latencies==NULL || g->n_entries==0) return EXIT_FAILURE;
+	signal(SIGPIPE,SIG_IGN);
+	gettimeofday(&start,NULL);
+	for(i=0,j=0;i< (size_t)nthreads;++i)
+		{
+		Bench* b=&benchs[i];
+		b->genome=g;
+		b->host=host;
+		b->port=port;
+		b->length=length;
+		b->format=format;
+		b->n_requests=n_requests/nthreads+(i< n_requests%nthreads?1:0);
+		b->seed=(unsigned int)(i+1);
+		b->latencies=&latencies[j];
+		b->failed=0;
+		b->bytes=0;
+		j+=b->n_requests;
+		if(pthread_create(&threads[i],NULL,benchWorker,b)!=0) return EXIT_FAILURE;
+		}
+	for(i=0;i< (size_t)nthreads;++i)
+		{
+		pthread_join(threads[i],NULL);
+		failed+=benchs[i].failed;
+		bytes+=benchs[i].bytes;
+		}
+	gettimeofday(&end,NULL);
+	elapsed=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)/1.0E6;
+	for(i=0;i< n_requests;++i)
+		{
+		if(latencies[i]>=0) latencies[n_ok++]=latencies[i];
+		}
+	qsort(latencies,n_ok,sizeof(double),compareDouble);
+	printf("requests\t%lu\n",(unsigned long)n_requests);
+	printf("failed\t%lu\n",(unsigned long)failed);
+	printf("connections\t%d\n",nthreads);
+	printf("region.length\t%d\n",length);
+	printf("bytes\t%llu\n",(unsigned long long)bytes);
+	printf("requests.per.second\t%.1f\n",elapsed>0?n_ok/elapsed:0.0);
+	if(n_ok>0)
+		{
+		printf("p50.ms\t%.3f\n",latencies[n_ok*50/100]);
+		printf("p90.ms\t%.3f\n",latencies[n_ok*90/100]);
+		printf("p99.ms\t%.3f\n",latencies[n_ok*99/100]);
+		printf("max.ms\t%.3f\n",latencies[n_ok-1]);
+		}
+	free(latencies);
+	free(benchs);
+	free(threads);
+	return failed==0?EXIT_SUCCESS:EXIT_FAILURE;
+	}
+
+static void usage(const char* prg)
+	{
+	fprintf(stdout,"Author: Pierre Lindenbaum PHD. 2011.\n");
+	fprintf(stdout,"Last compilation:%s %s\n",__DATE__,__TIME__);
+#ifdef GENOME_PATH
+	fprintf(stdout,"Genome: %s (%s)\n",BUILD,GENOME_PATH);
+#endif
+#ifdef GENOME_CONFIG
+	fprintf(stdout,"Genomes: %s\n",GENOME_CONFIG);
+#endif
+	fprintf(stdout,"Usage:\n");
+	fprintf(stdout,"  as a CGI: QUERY_STRING=\"chrom=<chrom>&start=<int>&end=<int>&fmt=<fa|text|json|xml>\" %s\n",prg);
+	fprintf(stdout,"  a batch of regions: repeat 'region=<chrom>:<start>-<end>' or POST one BED line per region.\n");
+	fprintf(stdout,"  transforms: strand=- (reverse complement), translate=<1|2|3> (frame), stats=1 (composition only).\n");
+	fprintf(stdout,"  'Accept-Encoding: gzip' compresses the body. 'Range: bytes=<a>-<b>' selects bases of a fmt=text region.\n");
+	fprintf(stdout,"  several builds: build=<name> selects a build of the config file, the first one is the default.\n");
+	fprintf(stdout,"  as a server: %s -p <port> [-t <threads>] [-H <host>] [-c <config>] [-m <Mb>] [-l]\n",prg);
+	fprintf(stdout,"  the server exports its counters and the histograms of the phases on /metrics (Prometheus).\n");
+	fprintf(stdout,"  as a CGI, FAIDX_LOG=1 logs the request on stderr like -l.\n");
+	fprintf(stdout,"Options:\n");
+	fprintf(stdout,"  -p <port> run a HTTP server on this port.\n");
+	fprintf(stdout,"  -H <host> address of the server (127.0.0.1).\n");
+	fprintf(stdout,"  -l log each request on stderr: build, status, bytes and microseconds of each phase.\n");
+	fprintf(stdout,"  -c <file> config file of the builds: '<build> <path> [aliases]' per line, opened on the first request.\n");
+	fprintf(stdout,"  -m <Mb> memory budget of the loaded genomes, the least recently used are unloaded (%d).\n",DEFAULT_BUDGET);
+	fprintf(stdout,"  -t <int> number of threads of the server, or connections of the benchmark (%d).\n",DEFAULT_THREADS);
+	fprintf(stdout,"  --bench <int> send <int> requests of random regions to the server and print the latencies.\n");
+	fprintf(stdout,"  --bench-length <int> length of the random regions (1000).\n");
+	fprintf(stdout,"  --bench-format <fmt> format of the random regions (fa).\n");
+	fprintf(stdout,"  --bench-build <name> build of the random regions (default build).\n");
+	}
+
+int main(int argc,char** argv)
+    {
+ #ifndef TEST
+    char* method=getenv("REQUEST_METHOD");
+    char* query_string=getenv("QUERY_STRING");
+ #else
+    char* method=NULL;
+    char* query_string=NULL;
+ #endif
+    char* body=NULL;
+    Registry registry;
+    Request req;
+    Output* out;
+    int ret;
+    uint64_t t_start=nowMicros();
+
+    initTables();
+    if(argc>1 && argv[1][0]=='-')
+        {
+        const char* host="127.0.0.1";
+        const char* bench_format="fa";
+        const char* bench_build=NULL;
+        const char* config=NULL;
+        long budget=DEFAULT_BUDGET;
+        int log=0;
+        Assembly* bench_genome;
+        int status;
+        int port=-1;
+        int nthreads=DEFAULT_THREADS;
+        int bench_length=1000;
+        long n_bench=0;
+        int optind=1;
+        while(optind< argc)
+            {
+            if(strcmp(argv[optind],"-h")==0)
+                {
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+                }
+            else if(strcmp(argv[optind],"-p")==0 && optind+1< argc)
+                {
+                port=atoi(argv[++optind]);
+                }
+            else if(strcmp(argv[optind],"-H")==0 && optind+1< argc)
+                {
+                host=argv[++optind];
+                }
+            else if(strcmp(argv[optind],"-l")==0)
+                {
+                log=1;
+                }
+            else if(strcmp(argv[optind],"-c")==0 && optind+1< argc)
+                {
+                config=argv[++optind];
+                }
+            else if(strcmp(argv[optind],"-m")==0 && optind+1< argc)
+                {
+                budget=atol(argv[++optind]);
+                if(budget<0) budget=0;
+                }
+            else if(strcmp(argv[optind],"-t")==0 && optind+1< argc)
+                {
+                nthreads=atoi(argv[++optind]);
+                if(nthreads<1) nthreads=1;
+                }
+            else if(strcmp(argv[optind],"--bench")==0 && optind+1< argc)
+                {
+                n_bench=atol(argv[++optind]);
+                }
+            else if(strcmp(argv[optind],"--bench-length")==0 && optind+1< argc)
+                {
+                bench_length=atoi(argv[++optind]);
+                if(bench_length<1) bench_length=1;
+                }
+            else if(strcmp(argv[optind],"--bench-format")==0 && optind+1< argc)
+                {
+                bench_format=argv[++optind];
+                }
+            else if(strcmp(argv[optind],"--bench-build")==0 && optind+1< argc)
+                {
+                bench_build=argv[++optind];
+                }
+            else
+                {
+                fprintf(stderr,"%s: unknown option '%s'\n",argv[0],argv[optind]);
+                return EXIT_FAILURE;
+                }
+            ++optind;
+            }
+        if(port<=0)
+            {
+            fprintf(stderr,"%s: undefined port (-p)\n",argv[0]);
+            return EXIT_FAILURE;
+            }
+        if(initRegistry(&registry,config)!=0)
+            {
+            return EXIT_FAILURE;
+            }
+        registry.budget=(size_t)budget*1024*1024;
+        if(n_bench>0)
+            {
+            /* the random regions are picked in the local copy of the genome */
+            if((bench_genome=acquireGenome(&registry,bench_build,&status))==NULL)
+                {
+                fprintf(stderr,"%s: cannot load build %s\n",argv[0],bench_build==NULL?"":bench_build);
+                return EXIT_FAILURE;
+                }
+            return benchmark(bench_genome->genome,host,port,nthreads,(size_t)n_bench,bench_length,bench_format);
+            }
+        return serve(&registry,host,port,nthreads,log);
+        }
+
+#ifdef TEST
+   if(argc<2) return EXIT_FAILURE;
+   query_string=argv[1];
+   /* a batch of regions can be sent on stdin */
+   method=getenv("REQUEST_METHOD");
+   if(method==NULL) method="GET";
+#endif
+
+    memset(&req,0,sizeof(Request));
+    if(method!=NULL && strcmp(method,"POST")==0)
+        {
+        /* a batch of regions, one per line */
+        char* length=getenv("CONTENT_LENGTH");
+        long n=(length==NULL?-1:atol(length));
+        size_t nRead=0;
+        if(n<0) die("Content-Length missing",411);
+        if(n>MAX_BODY_SIZE) die("Body too large",413);
+        if((body=malloc(n+1))==NULL) die("Out of memory.",500);
+        while(nRead<(size_t)n)
+            {
+            size_t k=fread(&body[nRead],1,n-nRead,stdin);
+            if(k==0) die("Cannot read body",400);
+            nRead+=k;
+            }
+        body[n]=0;
+        addRegions(&req,body);
+        if(req.n_regions==0 && req.bad_region==NULL) die("No region",400);
+        }
+    else if(method==NULL || strcmp(method,"GET")!=0)
+        {
+        die("GET method expected",406);
+        }
+    else if(query_string==NULL || query_string[0]==0)
         {
-        HEADER("text/xml","xml");
-        fputs("<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n<sequence",stdout);
-        printf(" build=\"%s\"",BUILD);
-        printf(" chrom=\"%s\"",chrom);
-        printf(" start=\"%ld\"",chromStart);
-        printf(" end=\"%ld\">",chromEnd);
-        echo(chrom,chromStart,chromEnd,&index,-1);
-        printf("</sequence>\n");
+        die("QUERY_STRING missing",406);
         }
-    else if(format!=NULL && strcasecmp(format,"text")==0)
+    if(initRegistry(&registry,NULL)!=0)
         {
-        HEADER("text/plain","txt");
-        echo(chrom,chromStart,chromEnd,&index,-1);
+        die("cannot load the list of genomes.",500);
         }
-    else
+    /* decode CGI string */
+    if(query_string!=NULL) parseQuery(query_string,&req);
+    out=calloc(1,sizeof(Output));
+    if(out==NULL)
         {
-        HEADER("text/plain","fa");
-        printf(">%s|%s:%ld-%ld",BUILD,chrom,chromStart,chromEnd);
-        echo(chrom,chromStart,chromEnd,&index,50);
-        fputc('\n',stdout);
+        die("Out of memory.",500);
         }
-    fflush(stdout);
-    return 0;
+    outInit(out,STDOUT_FILENO,0);
+    out->accept_gzip=acceptGzip(getenv("HTTP_ACCEPT_ENCODING"));
+    req.range=getenv("HTTP_RANGE");
+    out->phase_us[PHASE_PARSE]=nowMicros()-t_start;
+    ret=answer(&registry,&req,out);
+    outEnd(out);
+    out->phase_us[PHASE_TOTAL]=nowMicros()-t_start;
+    if(getenv("FAIDX_LOG")!=NULL && strcmp(getenv("FAIDX_LOG"),"0")!=0) logRequest(out,&req);
+    free(out);
+    return ret==0?0:EXIT_FAILURE;
     }
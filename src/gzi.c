@@ -0,0 +1,463 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ *	http://samtools.github.io/hts-specs/SAMv1.pdf (BGZF)
+ * Motivation:
+ *	random access to a bgzip'd file with its '.gzi' index, used by faidx.cgi.
+ *	A BGZF file is a series of gzip members of at most 64Kb, the '.gzi' lists the
+ *	compressed and uncompressed offsets of the blocks. The blocks are read with
+ *	pread, so one gzi_t is shared by all the threads of a server.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "gzi.h"
+
+/* max size of a block, compressed or not */
+#define BGZF_MAX_BLOCK 65536
+/* size of the header of a block: gzip header + the 'BC' extra field */
+#define BGZF_HEADER 18
+
+/* one block of the file */
+typedef struct
+	{
+	uint64_t coffset;
+	uint64_t uoffset;
+	}GziBlock;
+
+/* one inflated block of the cache */
+typedef struct
+	{
+	/* index of the block, -1 if empty */
+	int64_t block;
+	char* data;
+	uint32_t len;
+	/* the block is being inflated */
+	int loading;
+	/* readers copying the data */
+	int refs;
+	uint64_t last_used;
+	/* next slot of the same bucket, or -1 */
+	int32_t next;
+	}GziSlot;
+
+struct gzi_t
+	{
+	int fd;
+	uint64_t file_size;
+	GziBlock* blocks;
+	size_t n_blocks;
+	/* size of the uncompressed data */
+	uint64_t size;
+	GziSlot* slots;
+	size_t n_slots;
+	/* hash of the block index to the first slot, n_buckets is a power of 2 */
+	int32_t* buckets;
+	size_t n_buckets;
+	uint64_t tick;
+	uint64_t hits;
+	uint64_t misses;
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+	};
+
+static uint16_t le16(const unsigned char* p)
+	{
+	return (uint16_t)(p[0]|(p[1]<<8));
+	}
+
+static uint32_t le32(const unsigned char* p)
+	{
+	return (uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24);
+	}
+
+static uint64_t le64(const unsigned char* p)
+	{
+	return (uint64_t)le32(p)|((uint64_t)le32(p+4)<<32);
+	}
+
+/* size of the compressed block from its header, or 0 if this is not a BGZF block */
+static uint32_t blockSize(const unsigned char* h,size_t n)
+	{
+	size_t xlen,i;
+	if(n< BGZF_HEADER || h[0]!=0x1f || h[1]!=0x8b || h[2]!=8 || (h[3]&4)==0) return 0;
+	xlen=le16(&h[10]);
+	/* the subfields of the extra field */
+	for(i=12;i+4<=12+xlen && i+4<=n;i+=4+le16(&h[i+2]))
+		{
+		if(h[i]=='B' && h[i+1]=='C' && le16(&h[i+2])==2 && i+6<=n)
+			{
+			return (uint32_t)le16(&h[i+4])+1;
+			}
+		}
+	return 0;
+	}
+
+int gzi_is_bgzf(const char* path)
+	{
+	unsigned char h[BGZF_HEADER];
+	ssize_t n;
+	int fd=open(path,O_RDONLY);
+	if(fd<0) return 0;
+	n=read(fd,h,BGZF_HEADER);
+	close(fd);
+	return n==BGZF_HEADER && blockSize(h,n)>0;
+	}
+
+static int addBlock(gzi_t* gz,size_t* buffer,uint64_t coffset,uint64_t uoffset)
+	{
+	if(gz->n_blocks==*buffer)
+		{
+		GziBlock* p;
+		*buffer=(*buffer==0?BUFSIZ:*buffer*2);
+		p=realloc(gz->blocks,(*buffer)*sizeof(GziBlock));
+		if(p==NULL) return -1;
+		gz->blocks=p;
+		}
+	gz->blocks[gz->n_blocks].coffset=coffset;
+	gz->blocks[gz->n_blocks].uoffset=uoffset;
+	gz->n_blocks++;
+	return 0;
+	}
+
+/* compressed size and uncompressed size (ISIZE) of the block at 'coffset' */
+static int readBlockSizes(gzi_t* gz,uint64_t coffset,uint32_t* bsize,uint32_t* isize)
+	{
+	unsigned char h[BGZF_HEADER];
+	unsigned char tail[4];
+	if(pread(gz->fd,h,BGZF_HEADER,coffset)!=BGZF_HEADER) return -1;
+	if((*bsize=blockSize(h,BGZF_HEADER))==0 || coffset+*bsize>gz->file_size) return -1;
+	if(pread(gz->fd,tail,4,coffset+*bsize-4)!=4) return -1;
+	*isize=le32(tail);
+	return 0;
+	}
+
+/* the blocks of the '.gzi': a count, then pairs of compressed/uncompressed offsets.
+ * The first block is implicit */
+static int loadIndex(gzi_t* gz,FILE* in)
+	{
+	unsigned char buf[16];
+	size_t buffer=0;
+	uint64_t i,n;
+	uint32_t bsize,isize;
+	if(fread(buf,1,8,in)!=8) return -1;
+	n=le64(buf);
+	if(addBlock(gz,&buffer,0,0)!=0) return -1;
+	for(i=0;i< n;++i)
+		{
+		GziBlock* last=&gz->blocks[gz->n_blocks-1];
+		uint64_t coffset,uoffset;
+		if(fread(buf,1,16,in)!=16) return -1;
+		coffset=le64(buf);
+		uoffset=le64(buf+8);
+		if(coffset<=last->coffset || uoffset< last->uoffset) return -1;
+		if(addBlock(gz,&buffer,coffset,uoffset)!=0) return -1;
+		}
+	/* the size of the last block is in its trailer */
+	if(readBlockSizes(gz,gz->blocks[gz->n_blocks-1].coffset,&bsize,&isize)!=0) return -1;
+	gz->size=gz->blocks[gz->n_blocks-1].uoffset+isize;
+	return 0;
+	}
+
+/* no '.gzi': walk the headers of the blocks, nothing is inflated */
+static int scanBlocks(gzi_t* gz)
+	{
+	size_t buffer=0;
+	uint64_t coffset=0,uoffset=0;
+	while(coffset< gz->file_size)
+		{
+		uint32_t bsize,isize;
+		if(readBlockSizes(gz,coffset,&bsize,&isize)!=0) return -1;
+		if(addBlock(gz,&buffer,coffset,uoffset)!=0) return -1;
+		coffset+=bsize;
+		uoffset+=isize;
+		}
+	gz->size=uoffset;
+	return gz->n_blocks>0?0:-1;
+	}
+
+void gzi_close(gzi_t* gz)
+	{
+	size_t i;
+	if(gz==NULL) return;
+	if(gz->fd>=0) close(gz->fd);
+	for(i=0;i< gz->n_slots;++i) free(gz->slots[i].data);
+	free(gz->slots);
+	free(gz->buckets);
+	free(gz->blocks);
+	pthread_mutex_destroy(&gz->lock);
+	pthread_cond_destroy(&gz->loaded);
+	free(gz);
+	}
+
+gzi_t* gzi_open(const char* path,size_t cache_blocks)
+	{
+	char* filename=malloc(strlen(path)+5);
+	struct stat st;
+	FILE* in;
+	size_t i;
+	int ret;
+	gzi_t* gz=calloc(1,sizeof(gzi_t));
+	if(gz==NULL || filename==NULL)
+		{
+		free(gz);
+		free(filename);
+		return NULL;
+		}
+	pthread_mutex_init(&gz->lock,NULL);
+	pthread_cond_init(&gz->loaded,NULL);
+	if((gz->fd=open(path,O_RDONLY))<0 || fstat(gz->fd,&st)!=0)
+		{
+		fprintf(stderr,"[gzi] cannot open %s: %s\n",path,strerror(errno));
+		free(filename);
+		gzi_close(gz);
+		return NULL;
+		}
+	gz->file_size=st.st_size;
+	sprintf(filename,"%s.gzi",path);
+	if((in=fopen(filename,"rb"))!=NULL)
+		{
+		ret=loadIndex(gz,in);
+		fclose(in);
+		}
+	else
+		{
+		ret=scanBlocks(gz);
+		}
+	if(ret!=0)
+		{
+		fprintf(stderr,"[gzi] cannot index the blocks of %s\n",path);
+		free(filename);
+		gzi_close(gz);
+		return NULL;
+		}
+	free(filename);
+	if(cache_blocks< 2) cache_blocks=2;
+	gz->n_buckets=16;
+	while(gz->n_buckets< cache_blocks) gz->n_buckets*=2;
+	gz->slots=calloc(cache_blocks,sizeof(GziSlot));
+	gz->buckets=malloc(gz->n_buckets*sizeof(int32_t));
+	if(gz->slots==NULL || gz->buckets==NULL)
+		{
+		gzi_close(gz);
+		return NULL;
+		}
+	gz->n_slots=cache_blocks;
+	for(i=0;i< gz->n_slots;++i) gz->slots[i].block=-1;
+	for(i=0;i< gz->n_buckets;++i) gz->buckets[i]=-1;
+	return gz;
+	}
+
+uint64_t gzi_size(const gzi_t* gz)
+	{
+	return gz->size;
+	}
+
+size_t gzi_footprint(const gzi_t* gz)
+	{
+	return gz->n_blocks*sizeof(GziBlock)+
+		gz->n_slots*(sizeof(GziSlot)+BGZF_MAX_BLOCK)+
+		gz->n_buckets*sizeof(int32_t);
+	}
+
+void gzi_stats(gzi_t* gz,uint64_t* hits,uint64_t* misses)
+	{
+	pthread_mutex_lock(&gz->lock);
+	*hits=gz->hits;
+	*misses=gz->misses;
+	pthread_mutex_unlock(&gz->lock);
+	}
+
+/* index of the block containing the uncompressed 'offset' */
+static size_t findBlock(const gzi_t* gz,uint64_t offset)
+	{
+	size_t lo=0,hi=gz->n_blocks;
+	while(hi-lo>1)
+		{
+		size_t mid=(lo+hi)/2;
+		if(gz->blocks[mid].uoffset<=offset) lo=mid;
+		else hi=mid;
+		}
+	return lo;
+	}
+
+/* inflate the block 'b' in 'dest', returns its size or -1 */
+static int64_t inflateBlock(gzi_t* gz,size_t b,char* dest)
+	{
+	unsigned char compressed[BGZF_MAX_BLOCK];
+	uint64_t coffset=gz->blocks[b].coffset;
+	size_t n=(b+1< gz->n_blocks?gz->blocks[b+1].coffset-coffset:gz->file_size-coffset);
+	uint32_t bsize,xlen;
+	z_stream zs;
+	int64_t len;
+	if(n>BGZF_MAX_BLOCK) n=BGZF_MAX_BLOCK;
+	if(pread(gz->fd,compressed,n,coffset)!=(ssize_t)n) return -1;
+	if((bsize=blockSize(compressed,n))==0 || bsize>n) return -1;
+	xlen=le16(&compressed[10]);
+	/* raw deflate between the header and the CRC32+ISIZE trailer */
+	memset(&zs,0,sizeof(z_stream));
+	if(inflateInit2(&zs,-15)!=Z_OK) return -1;
+	zs.next_in=&compressed[12+xlen];
+	zs.avail_in=bsize-12-xlen-8;
+	zs.next_out=(Bytef*)dest;
+	zs.avail_out=BGZF_MAX_BLOCK;
+	if(inflate(&zs,Z_FINISH)!=Z_STREAM_END)
+		{
+		inflateEnd(&zs);
+		return -1;
+		}
+	len=BGZF_MAX_BLOCK-zs.avail_out;
+	inflateEnd(&zs);
+	if((uint32_t)len!=le32(&compressed[bsize-4])) return -1;
+	return len;
+	}
+
+static void unlinkSlot(gzi_t* gz,int32_t k)
+	{
+	int32_t* p=&gz->buckets[gz->slots[k].block&(gz->n_buckets-1)];
+	while(*p!=-1)
+		{
+		if(*p==k)
+			{
+			*p=gz->slots[k].next;
+			return;
+			}
+		p=&gz->slots[*p].next;
+		}
+	}
+
+/* the slot holding the inflated block 'b', pinned until releaseBlock. NULL on error */
+static GziSlot* acquireBlock(gzi_t* gz,size_t b)
+	{
+	GziSlot* victim=NULL;
+	int64_t len;
+	int32_t k;
+	size_t i;
+	pthread_mutex_lock(&gz->lock);
+	for(;;)
+		{
+		for(k=gz->buckets[b&(gz->n_buckets-1)];k!=-1;k=gz->slots[k].next)
+			{
+			if(gz->slots[k].block==(int64_t)b) break;
+			}
+		if(k==-1) break;
+		if(!gz->slots[k].loading)
+			{
+			GziSlot* slot=&gz->slots[k];
+			slot->refs++;
+			slot->last_used=++gz->tick;
+			gz->hits++;
+			pthread_mutex_unlock(&gz->lock);
+			return slot;
+			}
+		/* another thread is inflating this block */
+		pthread_cond_wait(&gz->loaded,&gz->lock);
+		}
+	gz->misses++;
+	/* an empty slot, or the least recently used one */
+	for(i=0;i< gz->n_slots;++i)
+		{
+		GziSlot* slot=&gz->slots[i];
+		if(slot->refs>0 || slot->loading) continue;
+		if(slot->block==-1)
+			{
+			victim=slot;
+			break;
+			}
+		if(victim==NULL || slot->last_used< victim->last_used) victim=slot;
+		}
+	if(victim==NULL)
+		{
+		/* every slot is in use */
+		pthread_mutex_unlock(&gz->lock);
+		return NULL;
+		}
+	k=(int32_t)(victim-gz->slots);
+	if(victim->block!=-1) unlinkSlot(gz,k);
+	victim->block=(int64_t)b;
+	victim->loading=1;
+	victim->refs=1;
+	victim->last_used=++gz->tick;
+	victim->next=gz->buckets[b&(gz->n_buckets-1)];
+	gz->buckets[b&(gz->n_buckets-1)]=k;
+	pthread_mutex_unlock(&gz->lock);
+
+	if(victim->data==NULL) victim->data=malloc(BGZF_MAX_BLOCK);
+	len=(victim->data==NULL?-1:inflateBlock(gz,b,victim->data));
+
+	pthread_mutex_lock(&gz->lock);
+	victim->loading=0;
+	if(len<0)
+		{
+		unlinkSlot(gz,k);
+		victim->block=-1;
+		victim->refs=0;
+		victim=NULL;
+		}
+	else
+		{
+		victim->len=(uint32_t)len;
+		}
+	pthread_cond_broadcast(&gz->loaded);
+	pthread_mutex_unlock(&gz->lock);
+	return victim;
+	}
+
+static void releaseBlock(gzi_t* gz,GziSlot* slot)
+	{
+	pthread_mutex_lock(&gz->lock);
+	slot->refs--;
+	pthread_mutex_unlock(&gz->lock);
+	}
+
+int64_t gzi_read(gzi_t* gz,uint64_t offset,char* dest,size_t n)
+	{
+	size_t done=0;
+	size_t b;
+	if(offset>=gz->size) return 0;
+	b=findBlock(gz,offset);
+	while(done< n && offset< gz->size && b< gz->n_blocks)
+		{
+		uint64_t skip=offset-gz->blocks[b].uoffset;
+		size_t k;
+		GziSlot* slot=acquireBlock(gz,b);
+		GziSlot tmp;
+		if(slot==NULL)
+			{
+			/* every slot is pinned by other readers: inflate without the cache */
+			int64_t len;
+			if((tmp.data=malloc(BGZF_MAX_BLOCK))==NULL) return done>0?(int64_t)done:-1;
+			if((len=inflateBlock(gz,b,tmp.data))<0)
+				{
+				free(tmp.data);
+				return done>0?(int64_t)done:-1;
+				}
+			tmp.len=(uint32_t)len;
+			}
+		if(skip< (slot==NULL?tmp.len:slot->len))
+			{
+			const GziSlot* s=(slot==NULL?&tmp:slot);
+			k=s->len-skip;
+			if(k>n-done) k=n-done;
+			memcpy(&dest[done],&s->data[skip],k);
+			done+=k;
+			offset+=k;
+			}
+		if(slot!=NULL) releaseBlock(gz,slot);
+		else free(tmp.data);
+		++b;
+		}
+	return (int64_t)done;
+	}
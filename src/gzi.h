@@ -0,0 +1,35 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ * Motivation:
+ *	random access to a file compressed with bgzip, using its '.gzi' index.
+ *	The inflated blocks are kept in a cache shared by the threads, so
+ *	adjacent or repeated reads do not inflate the same block again.
+ */
+#ifndef GZI_H
+#define GZI_H
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct gzi_t gzi_t;
+
+/* 1 if the file starts with a BGZF block */
+int gzi_is_bgzf(const char* path);
+/* open a bgzip'd file and its index 'path.gzi' (built by scanning the blocks if missing),
+ * with a cache of 'cache_blocks' inflated blocks. returns NULL on error */
+gzi_t* gzi_open(const char* path,size_t cache_blocks);
+void gzi_close(gzi_t* gz);
+/* copy at most 'n' uncompressed bytes starting at 'offset' into 'dest', returns the number of bytes or -1 */
+int64_t gzi_read(gzi_t* gz,uint64_t offset,char* dest,size_t n);
+/* size of the uncompressed data */
+uint64_t gzi_size(const gzi_t* gz);
+/* memory of the index and of the full cache */
+size_t gzi_footprint(const gzi_t* gz);
+/* blocks found in the cache, and blocks inflated */
+void gzi_stats(gzi_t* gz,uint64_t* hits,uint64_t* misses);
+
+#endif
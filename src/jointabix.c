@@ -1,7 +1,7 @@
 /*
 Motivation:
 	Join a file containing some genomic positions and the
-	content of a bgz file indexed with tabix
+	content of one or more bgz files indexed with tabix
 Author:
 	Pierre Lindenbaum PhD
 WWW:
@@ -11,19 +11,125 @@ Contact:
 Reference:
 	http://plindenbaum.blogspot.com/2011/09/joining-genomic-annotations-files-with.html
 Compilation:
-	gcc -o jointabix -Wall -O2 -I${TABIXDIR} -L${TABIXDIR} jointabix.c  -ltabix -lz
+	gcc -o jointabix -Wall -O2 -I${TABIXDIR} -L${TABIXDIR} jointabix.c  -ltabix -lz -lpthread
 API:
 	http://samtools.sourceforge.net/tabix.shtml
 
 */
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <zlib.h>
 #include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include "bgzf.h"
 #include "tabix.h"
 
+/* number of input lines read before the tabix files are queried */
+#define BATCH_SIZE 1000
+
+/* how the hits of the sources are printed */
+#define LAYOUT_CROSS 0
+#define LAYOUT_ROW 1
+
+/* how the hits of a source are reduced for each input line */
+#define AGGREGATE_NONE 0
+#define AGGREGATE_FIRST 1
+#define AGGREGATE_COUNT 2
+#define AGGREGATE_DISTINCT 3
+
+/* first and last half-width of the window used by --nearest */
+#define NEAREST_WINDOW 1000
+#define NEAREST_MAX_WINDOW (1<<29)
+
+/* flat index, written next to the tabix file by --make-index */
+#define FLAT_SUFFIX ".jti"
+#define FLAT_MAGIC "JTIDX\001\0\0"
+/* see tabix's index.c */
+#define TAD_LIDX_SHIFT 14
+#define MAX_BIN 37450
+/* largest uncompressed bgzf block, see MAX_BLOCK_SIZE in tabix's bgzf.c */
+#define MAX_BGZF_BLOCK 0x10000
+
+/* all the structures of the flat index are 8-bytes aligned, integers are little-endian.
+ * Layout: FlatHeader, FlatRef[n_ref], FlatBin[n_bin], FlatChunk[n_chunk],
+ * uint64_t[n_intv] (linear index), the names (l_nm bytes), int32_t[n_ref] (tids sorted on name) */
+typedef struct {
+	char magic[8];
+	int32_t n_ref;
+	int32_t l_nm;
+	/* preset, sc, bc, ec, meta_char, line_skip */
+	int32_t conf[6];
+	int64_t n_bin;
+	int64_t n_chunk;
+	int64_t n_intv;
+	} FlatHeader;
+
+typedef struct {
+	/* offset of the name */
+	int64_t name;
+	/* index of the first bin, bins are sorted */
+	int64_t bin;
+	int64_t n_bin;
+	/* index of the first offset in the linear index */
+	int64_t intv;
+	int64_t n_intv;
+	} FlatRef;
+
+typedef struct {
+	uint32_t bin;
+	uint32_t n_chunk;
+	/* index of the first chunk */
+	int64_t chunk;
+	} FlatBin;
+
+typedef struct {
+	uint64_t beg;
+	uint64_t end;
+	} FlatChunk;
+
+/* a flat index mapped in memory */
+typedef struct {
+	void* map;
+	size_t map_len;
+	const FlatHeader* header;
+	const FlatRef* refs;
+	const FlatBin* bins;
+	const FlatChunk* chunks;
+	const uint64_t* intv;
+	const char* names;
+	const int32_t* sorted;
+	} FlatIndex;
+
+/* type of an input line */
+#define RECORD_DATA 0
+#define RECORD_COMMENT 1
+#define RECORD_BAD 2
+
+/* a normalized variant: position, REF and one ALT allele */
+typedef struct {
+	int pos;
+	unsigned int hash;
+	const char* ref;
+	int ref_len;
+	const char* alt;
+	int alt_len;
+	} Allele;
+
+/* one line of the input */
 typedef struct {
 	char* line;
 	size_t buffer;
@@ -31,190 +137,1771 @@ typedef struct {
 	char** tokens;
 	size_t tokens_buffer;
 	size_t n_tokens;
-	char delim; 
+	int type;
+	int chromStart;
+	int chromEnd;
+	/* the alleles of the input, for the key-match mode */
+	Allele* alleles;
+	size_t n_alleles;
+	size_t alleles_buffer;
+	} Record;
+
+/* one tabix file and the hits found for the current batch of records */
+typedef struct {
+	char* filename;
+	char* label;
+	/* either the tabix file, or the flat index and the bgzf file */
+	tabix_t *t;
+	ti_iter_t iter;
+	FlatIndex* flat;
+	BGZF* fp;
+	ti_conf_t flat_conf;
+	const ti_conf_t *conf;
+	/* the current query on the flat index */
+	int q_tid;
+	int q_beg;
+	int q_end;
+	uint16_t* q_bins;
+	FlatChunk* q_chunks;
+	size_t q_n_chunks;
+	size_t q_chunks_buffer;
+	size_t q_chunk;
+	int q_in_chunk;
+	char* q_line;
+	size_t q_line_buffer;
+	/* the rest of the current bgzf block, 'q_buf_tell' is the virtual offset of 'q_buf' */
+	char* q_buf;
+	int q_buf_len;
+	int q_buf_pos;
+	uint64_t q_buf_tell;
+	/* cache of the last chromosome and its tid */
+	char* last_chrom;
+	size_t last_chrom_buffer;
+	int last_tid;
+	/* the hits, as consecutive nul-terminated strings */
+	char* data;
+	size_t data_len;
+	size_t data_buffer;
+	/* offset of each hit in 'data' */
+	size_t* hits;
+	size_t n_hits;
+	size_t hits_buffer;
+	/* index in 'hits' of the first hit of each record (n_records+1 items) */
+	size_t* first_hit;
+	size_t first_hit_buffer;
+	} Source;
+
+typedef struct {
+	char delim;
 	gzFile in;
 	char ignore;
 	int chromCol;
 	int startCol;
 	int endCol;
 	int shift;
-	tabix_t *t;
+	int layout;
+	int nthreads;
+	/* minimum fraction of the input covered by a hit */
+	double minFraction;
+	/* the fraction must also be satisfied for the hit */
+	int reciprocal;
+	int aggregate;
+	/* 0-based column printed by AGGREGATE_DISTINCT */
+	int distinctCol;
+	int nearest;
+	/* 0-based REF and ALT columns of the input and of the tabix files, -1 if no key-match */
+	int refCol;
+	int altCol;
+	int tabixRefCol;
+	int tabixAltCol;
+	Source* sources;
+	size_t n_sources;
+	Record* records;
+	size_t n_records;
+	size_t records_buffer;
 	} JoinTabix;
 
+/* parameters of a thread querying a subset of the sources */
+typedef struct {
+	JoinTabix* app;
+	size_t first;
+	} Worker;
 
-static char* readline(JoinTabix* app)
+static void* safeRealloc(void* ptr,size_t size)
+	{
+	if((ptr=realloc(ptr,size))==NULL)
+		{
+		fprintf(stderr,"Cannot realloc %d bytes\n",(int)size);
+		exit(EXIT_FAILURE);
+		}
+	return ptr;
+	}
+
+static char* readline(JoinTabix* app,Record* rec)
 	{
 	int c;
-	app->len=0;
+	rec->len=0;
 	if(gzeof(app->in)) return NULL;
-	
-	
+
+
 	while((c=gzgetc(app->in))!=EOF && c!='\n')
 		{
-		if(app->len+2 >= app->buffer)
+		if(rec->len+2 >= rec->buffer)
+			{
+			rec->buffer+=BUFSIZ;
+			rec->line=(char*)safeRealloc(rec->line,sizeof(char)*rec->buffer);
+			}
+
+		rec->line[rec->len++]=c;
+		}
+	if(rec->line==NULL)
+		{
+		rec->buffer=BUFSIZ;
+		rec->line=(char*)safeRealloc(rec->line,sizeof(char)*rec->buffer);
+		}
+	rec->line[rec->len]=0;
+	return rec->line;
+	}
+
+static void pushToken(Record* rec,char* ptr)
+	{
+	if(rec->n_tokens+1 > rec->tokens_buffer)
+		{
+		rec->tokens_buffer+=50;
+		rec->tokens=(char**)safeRealloc(rec->tokens,sizeof(char*)*rec->tokens_buffer);
+		}
+
+	rec->tokens[rec->n_tokens++]=ptr;
+	}
+
+static void splitLine(JoinTabix* app,Record* rec)
+	{
+	size_t i;
+
+	rec->n_tokens=0;
+	pushToken(rec,rec->line);
+	for(i=0;i< rec->len;++i)
+		{
+		if(rec->line[i]!=app->delim) continue;
+		rec->line[i]=0;
+		pushToken(rec,&rec->line[i+1]);
+		}
+	}
+
+static void printTokens(FILE* out,JoinTabix* app,const Record* rec)
+	{
+	size_t i;
+
+	for(i=0;i< rec->n_tokens;++i)
+		{
+		if(i>0) fputc(app->delim,out);
+		fputs(rec->tokens[i],out);
+		}
+	}
+
+/* print a hit, replacing its tabs with 'tab' if tab!=0 */
+static void printHit(FILE* out,const char* s,char tab)
+	{
+	if(tab==0)
+		{
+		fputs(s,out);
+		return;
+		}
+	while(*s!=0)
+		{
+		fputc(*s=='\t'?tab:*s,out);
+		++s;
+		}
+	}
+
+static int parseIntGE0(const char* s)
+	{
+	char* p2;
+	int n;
+
+	errno=0;
+	n=(int)strtol(s,&p2,10);
+	if(*p2!=0 || errno!=0 || n<0)
+		{
+		return -1;
+		}
+	return n;
+	}
+
+
+static int parseInt(const char* s)
+	{
+	int n=parseIntGE0(s);
+	if(n<0)
+		{
+		fprintf(stderr,"Bad Integer \"%s\".\n",s);
+		return EXIT_FAILURE;
+		}
+	return n;
+	}
+
+static int parseInt1(const char* s)
+	{
+	int n=parseInt(s);
+	if(n<1)
+		{
+		fprintf(stderr,"Expected a number greater than 0 . Got \"%s\".\n",s);
+		return EXIT_FAILURE;
+		}
+	return n-1;/* convert to 0-based */
+	}
+
+static void pushHit(Source* src,const char* s,int len)
+	{
+	if(src->n_hits+1 > src->hits_buffer)
+		{
+		src->hits_buffer+=BUFSIZ;
+		src->hits=(size_t*)safeRealloc(src->hits,sizeof(size_t)*src->hits_buffer);
+		}
+	if(src->data_len+len+1 > src->data_buffer)
+		{
+		src->data_buffer=src->data_len+len+1+BUFSIZ;
+		src->data=(char*)safeRealloc(src->data,sizeof(char)*src->data_buffer);
+		}
+	src->hits[src->n_hits++]=src->data_len;
+	memcpy(&src->data[src->data_len],s,len);
+	src->data_len+=len;
+	src->data[src->data_len++]=0;
+	}
+
+/* append a TAB and the distance to the last hit */
+static void appendDistance(Source* src,int distance)
+	{
+	char tmp[30];
+	int n=sprintf(tmp,"\t%d",distance);
+	if(src->data_len+n > src->data_buffer)
+		{
+		src->data_buffer=src->data_len+n+BUFSIZ;
+		src->data=(char*)safeRealloc(src->data,sizeof(char)*src->data_buffer);
+		}
+	memcpy(&src->data[src->data_len-1],tmp,n+1);
+	src->data_len+=n;
+	}
+
+#define SOURCE_HIT(src,i) (&((src)->data[(src)->hits[(i)]]))
+#define SOURCE_COUNT(src,rec) ((src)->first_hit[(rec)+1]-(src)->first_hit[(rec)])
+
+/* 0-based interval of a line of a tabix file, as get_intv() in tabix's index.c */
+static int hitInterval(const ti_conf_t* conf,const char* s,int* beg,int* end)
+	{
+	int col=1;
+	int preset=conf->preset&0xffff;
+	*beg=-1;
+	*end=-1;
+	for(;;)
+		{
+		const char* p=s;
+		while(*p!=0 && *p!='\t') ++p;
+		if(col==conf->bc)
+			{
+			*beg=*end=(int)strtol(s,NULL,10);
+			if(!(conf->preset&TI_FLAG_UCSC)) --(*beg); else ++(*end);
+			}
+		else if(preset==TI_PRESET_GENERIC && col==conf->ec && *beg>=0)
+			{
+			*end=(int)strtol(s,NULL,10);
+			}
+		else if(preset==TI_PRESET_SAM && col==6 && *beg>=0)
+			{
+			/* the span of the CIGAR */
+			int l=0;
+			const char* q=s;
+			while(q< p)
+				{
+				char* t;
+				long x=strtol(q,&t,10);
+				int op=toupper((unsigned char)*t);
+				if(op=='M' || op=='D' || op=='N') l+=(int)x;
+				q=t+1;
+				}
+			*end=*beg+(l==0?1:l);
+			}
+		else if(preset==TI_PRESET_VCF && col==4 && *beg>=0)
+			{
+			if(p>s) *end=*beg+(int)(p-s);
+			}
+		else if(preset==TI_PRESET_VCF && col==8 && *beg>=0)
+			{
+			/* END= at the start of INFO or after a ';' */
+			const char* q;
+			for(q=s;q+4<=p;++q)
+				{
+				if(strncmp(q,"END=",4)==0 && (q==s || q[-1]==';'))
+					{
+					*end=(int)strtol(q+4,NULL,0);
+					break;
+					}
+				}
+			}
+		if(*p==0) break;
+		s=p+1;
+		++col;
+		}
+	if(*beg<0) return 0;
+	if(*end<=*beg) *end=*beg+1;
+	return 1;
+	}
+
+/* trim the bases shared by REF and ALT, then compute the hash of the allele */
+static void normalizeAllele(Allele* a)
+	{
+	int i;
+	unsigned int h=2166136261U;
+	while(a->ref_len>1 && a->alt_len>1 &&
+		toupper(a->ref[a->ref_len-1])==toupper(a->alt[a->alt_len-1]))
+		{
+		a->ref_len--;
+		a->alt_len--;
+		}
+	while(a->ref_len>1 && a->alt_len>1 && toupper(a->ref[0])==toupper(a->alt[0]))
+		{
+		a->ref++;
+		a->alt++;
+		a->ref_len--;
+		a->alt_len--;
+		a->pos++;
+		}
+	/* FNV-1a */
+	for(i=0;i< (int)sizeof(int);++i) h=(h^((a->pos>>(8*i))&0xff))*16777619U;
+	for(i=0;i< a->ref_len;++i) h=(h^toupper(a->ref[i]))*16777619U;
+	h=(h^'>')*16777619U;
+	for(i=0;i< a->alt_len;++i) h=(h^toupper(a->alt[i]))*16777619U;
+	a->hash=h;
+	}
+
+static int sameAllele(const Allele* a,const Allele* b)
+	{
+	return a->hash==b->hash &&
+		a->pos==b->pos &&
+		a->ref_len==b->ref_len &&
+		a->alt_len==b->alt_len &&
+		strncasecmp(a->ref,b->ref,a->ref_len)==0 &&
+		strncasecmp(a->alt,b->alt,a->alt_len)==0;
+	}
+
+/* 0-based column 'col' of a TAB-delimited line, NULL if missing */
+static const char* getColumn(const char* s,int col,int* len)
+	{
+	while(col>0)
+		{
+		s=strchr(s,'\t');
+		if(s==NULL) return NULL;
+		++s;
+		--col;
+		}
+	for(*len=0;s[*len]!=0 && s[*len]!='\t';++(*len)) {}
+	return s;
+	}
+
+/* returns 1 if one ALT allele of the hit matches one allele of the record */
+static int matchAlleles(const JoinTabix* app,const Record* rec,const char* s,int beg)
+	{
+	int ref_len,alt_len;
+	const char* ref=getColumn(s,app->tabixRefCol,&ref_len);
+	const char* alt=getColumn(s,app->tabixAltCol,&alt_len);
+	if(ref==NULL || alt==NULL) return 0;
+	while(alt_len>0)
+		{
+		Allele a;
+		size_t i;
+		int n=0;
+		while(n< alt_len && alt[n]!=',') ++n;
+		a.pos=beg;
+		a.ref=ref;
+		a.ref_len=ref_len;
+		a.alt=alt;
+		a.alt_len=n;
+		normalizeAllele(&a);
+		for(i=0;i< rec->n_alleles;++i)
+			{
+			if(sameAllele(&a,&rec->alleles[i])) return 1;
+			}
+		if(n==alt_len) break;
+		alt+=n+1;
+		alt_len-=n+1;
+		}
+	return 0;
+	}
+
+/* returns 1 if the overlap between the record and the hit is large enough. Without -F
+ * the query already returned the overlapping lines only */
+static int acceptOverlap(const JoinTabix* app,const Record* rec,int beg,int end)
+	{
+	int overlap;
+	if(app->minFraction<=0.0) return 1;
+	overlap=(rec->chromEnd<end?rec->chromEnd:end)-(rec->chromStart>beg?rec->chromStart:beg);
+	if(overlap<=0) return 0;
+	if(overlap< app->minFraction*(rec->chromEnd-rec->chromStart)) return 0;
+	if(app->reciprocal && overlap< app->minFraction*(end-beg)) return 0;
+	return 1;
+	}
+
+/* distance between the record and a hit, 1 for adjacent features */
+static int hitDistance(const Record* rec,int beg,int end)
+	{
+	if(end<=rec->chromStart) return rec->chromStart-end+1;
+	if(beg>=rec->chromEnd) return beg-rec->chromEnd+1;
+	return 0;
+	}
+
+/* store an accepted hit, or only the distinct column of this hit */
+static void storeHit(const JoinTabix* app,Source* src,size_t first,const char* s,int len,int distance)
+	{
+	size_t i;
+	int col=0;
+	switch(app->aggregate)
+		{
+		case AGGREGATE_COUNT: break;
+		case AGGREGATE_DISTINCT:
+			while(col< app->distinctCol)
+				{
+				while(len>0 && *s!='\t') { ++s; --len; }
+				if(len==0) return;
+				++s; --len;
+				++col;
+				}
+			for(len=0;s[len]!=0 && s[len]!='\t';++len) {}
+			for(i=first;i< src->n_hits;++i)
+				{
+				const char* v=SOURCE_HIT(src,i);
+				if(strncmp(v,s,len)==0 && v[len]==0) return;
+				}
+			pushHit(src,s,len);
+			break;
+		default:
+			pushHit(src,s,len);
+			if(distance>=0) appendDistance(src,distance);
+			break;
+		}
+	}
+
+/* bins overlapping [beg,end), see tabix's index.c */
+static int reg2bins(uint32_t beg, uint32_t end, uint16_t* list)
+	{
+	int i = 0, k;
+	if (beg >= end) return 0;
+	if (end >= 1u<<29) end = 1u<<29;
+	--end;
+	list[i++] = 0;
+	for (k =    1 + (beg>>26); k <=    1 + (end>>26); ++k) list[i++] = k;
+	for (k =    9 + (beg>>23); k <=    9 + (end>>23); ++k) list[i++] = k;
+	for (k =   73 + (beg>>20); k <=   73 + (end>>20); ++k) list[i++] = k;
+	for (k =  585 + (beg>>17); k <=  585 + (end>>17); ++k) list[i++] = k;
+	for (k = 4681 + (beg>>14); k <= 4681 + (end>>14); ++k) list[i++] = k;
+	return i;
+	}
+
+static int compareFlatBin(const void* a,const void* b)
+	{
+	uint32_t x=((const FlatBin*)a)->bin;
+	uint32_t y=((const FlatBin*)b)->bin;
+	return x<y?-1:(x>y?1:0);
+	}
+
+static int compareFlatChunk(const void* a,const void* b)
+	{
+	uint64_t x=((const FlatChunk*)a)->beg;
+	uint64_t y=((const FlatChunk*)b)->beg;
+	return x<y?-1:(x>y?1:0);
+	}
+
+/* read 'n' bytes of the tabix index */
+static void readIndex(BGZF* fp,void* ptr,int n,const char* fn)
+	{
+	if(bgzf_read(fp,ptr,n)!=n)
+		{
+		fprintf(stderr,"Cannot read index \"%s\".\n",fn);
+		exit(EXIT_FAILURE);
+		}
+	}
+
+/* convert the tabix index 'filename.tbi' to the flat index 'filename.jti' */
+static int makeFlatIndex(const char* filename)
+	{
+	char* fnidx=(char*)safeRealloc(NULL,strlen(filename)+10);
+	char* fnflat=(char*)safeRealloc(NULL,strlen(filename)+10);
+	char* fntmp=(char*)safeRealloc(NULL,strlen(filename)+20);
+	char magic[4];
+	FlatHeader header;
+	FlatRef* refs=NULL;
+	FlatBin* bins=NULL;
+	FlatChunk* chunks=NULL;
+	uint64_t* intv=NULL;
+	char* names=NULL;
+	int32_t* sorted=NULL;
+	size_t bins_buffer=0,chunks_buffer=0,intv_buffer=0;
+	int32_t i,j,k;
+	BGZF* fp=NULL;
+	FILE* out;
+	int ret=-1;
+
+	sprintf(fnidx,"%s.tbi",filename);
+	sprintf(fnflat,"%s%s",filename,FLAT_SUFFIX);
+	sprintf(fntmp,"%s.%d",fnflat,(int)getpid());
+	if((fp=bgzf_open(fnidx,"r"))==NULL)
+		{
+		fprintf(stderr,"Cannot open index \"%s\".\n",fnidx);
+		goto cleanup;
+		}
+	memset(&header,0,sizeof(FlatHeader));
+	memcpy(header.magic,FLAT_MAGIC,8);
+	readIndex(fp,magic,4,fnidx);
+	if(strncmp(magic,"TBI\1",4)!=0)
+		{
+		fprintf(stderr,"\"%s\" is not a tabix index.\n",fnidx);
+		goto cleanup;
+		}
+	readIndex(fp,&header.n_ref,4,fnidx);
+	readIndex(fp,header.conf,4*6,fnidx);
+	readIndex(fp,&header.l_nm,4,fnidx);
+	/* room for the padding of the name table */
+	names=(char*)safeRealloc(NULL,(header.l_nm+8)&~7);
+	readIndex(fp,names,header.l_nm,fnidx);
+	refs=(FlatRef*)safeRealloc(NULL,sizeof(FlatRef)*(header.n_ref+1));
+	sorted=(int32_t*)safeRealloc(NULL,sizeof(int32_t)*(header.n_ref+1));
+	for(i=0,k=0;i< header.n_ref;++i)
+		{
+		int32_t n_bin,n_intv;
+		FlatRef* ref=&refs[i];
+		ref->name=k;
+		k+=strlen(&names[k])+1;
+		readIndex(fp,&n_bin,4,fnidx);
+		ref->bin=header.n_bin;
+		ref->n_bin=n_bin;
+		for(j=0;j< n_bin;++j)
+			{
+			FlatBin* bin;
+			int32_t n_chunk;
+			if(header.n_bin+1 > bins_buffer)
+				{
+				bins_buffer+=BUFSIZ;
+				bins=(FlatBin*)safeRealloc(bins,sizeof(FlatBin)*bins_buffer);
+				}
+			bin=&bins[header.n_bin++];
+			readIndex(fp,&bin->bin,4,fnidx);
+			readIndex(fp,&n_chunk,4,fnidx);
+			bin->n_chunk=n_chunk;
+			bin->chunk=header.n_chunk;
+			if(header.n_chunk+n_chunk > chunks_buffer)
+				{
+				chunks_buffer=header.n_chunk+n_chunk+BUFSIZ;
+				chunks=(FlatChunk*)safeRealloc(chunks,sizeof(FlatChunk)*chunks_buffer);
+				}
+			readIndex(fp,&chunks[header.n_chunk],sizeof(FlatChunk)*n_chunk,fnidx);
+			header.n_chunk+=n_chunk;
+			}
+		qsort(&bins[ref->bin],n_bin,sizeof(FlatBin),compareFlatBin);
+		readIndex(fp,&n_intv,4,fnidx);
+		ref->intv=header.n_intv;
+		ref->n_intv=n_intv;
+		if(header.n_intv+n_intv > intv_buffer)
+			{
+			intv_buffer=header.n_intv+n_intv+BUFSIZ;
+			intv=(uint64_t*)safeRealloc(intv,sizeof(uint64_t)*intv_buffer);
+			}
+		readIndex(fp,&intv[header.n_intv],sizeof(uint64_t)*n_intv,fnidx);
+		header.n_intv+=n_intv;
+		sorted[i]=i;
+		}
+	bgzf_close(fp);
+	fp=NULL;
+	/* insertion sort of the tids on the names */
+	for(i=1;i< header.n_ref;++i)
+		{
+		for(j=i;j>0 && strcmp(&names[refs[sorted[j]].name],&names[refs[sorted[j-1]].name])<0;--j)
+			{
+			int32_t tmp=sorted[j];
+			sorted[j]=sorted[j-1];
+			sorted[j-1]=tmp;
+			}
+		}
+	/* the name table is padded to keep the sorted tids aligned */
+	while(header.l_nm%8!=0) names[header.l_nm++]=0;
+
+	if((out=fopen(fntmp,"wb"))==NULL)
+		{
+		fprintf(stderr,"Cannot write \"%s\" %s.\n",fntmp,strerror(errno));
+		goto cleanup;
+		}
+	fwrite(&header,sizeof(FlatHeader),1,out);
+	fwrite(refs,sizeof(FlatRef),header.n_ref,out);
+	fwrite(bins,sizeof(FlatBin),header.n_bin,out);
+	fwrite(chunks,sizeof(FlatChunk),header.n_chunk,out);
+	fwrite(intv,sizeof(uint64_t),header.n_intv,out);
+	fwrite(names,sizeof(char),header.l_nm,out);
+	fwrite(sorted,sizeof(int32_t),header.n_ref,out);
+	/* replaced atomically: other processes may have mapped the previous version */
+	if(fflush(out)!=0 || ferror(out) || fclose(out)!=0 || rename(fntmp,fnflat)!=0)
+		{
+		fprintf(stderr,"Cannot write \"%s\" %s.\n",fnflat,strerror(errno));
+		unlink(fntmp);
+		goto cleanup;
+		}
+	fprintf(stderr,"Wrote %s\n",fnflat);
+	ret=0;
+	cleanup:
+	if(fp!=NULL) bgzf_close(fp);
+	free(sorted);
+	free(names);
+	free(intv);
+	free(chunks);
+	free(bins);
+	free(refs);
+	free(fntmp);
+	free(fnflat);
+	free(fnidx);
+	return ret;
+	}
+
+/* map the flat index of 'filename' if it exists and is more recent than the tabix index */
+static FlatIndex* loadFlatIndex(const char* filename)
+	{
+	char* fnidx=(char*)safeRealloc(NULL,strlen(filename)+10);
+	char* fnflat=(char*)safeRealloc(NULL,strlen(filename)+10);
+	struct stat st_idx,st_flat;
+	FlatIndex* flat=NULL;
+	const FlatHeader* h;
+	size_t expect;
+	void* map;
+	int fd;
+	sprintf(fnidx,"%s.tbi",filename);
+	sprintf(fnflat,"%s%s",filename,FLAT_SUFFIX);
+	if(stat(fnflat,&st_flat)!=0)
+		{
+		goto done;
+		}
+	if(stat(fnidx,&st_idx)==0 && st_idx.st_mtime>st_flat.st_mtime)
+		{
+		fprintf(stderr,"Ignoring \"%s\": older than \"%s\".\n",fnflat,fnidx);
+		goto done;
+		}
+	if((fd=open(fnflat,O_RDONLY))<0) goto done;
+	map=mmap(NULL,st_flat.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(map==MAP_FAILED) goto done;
+	h=(const FlatHeader*)map;
+	if((size_t)st_flat.st_size< sizeof(FlatHeader) || memcmp(h->magic,FLAT_MAGIC,8)!=0)
+		{
+		fprintf(stderr,"\"%s\" is not a flat index.\n",fnflat);
+		munmap(map,st_flat.st_size);
+		goto done;
+		}
+	expect=sizeof(FlatHeader)+
+		sizeof(FlatRef)*h->n_ref+
+		sizeof(FlatBin)*h->n_bin+
+		sizeof(FlatChunk)*h->n_chunk+
+		sizeof(uint64_t)*h->n_intv+
+		h->l_nm+
+		sizeof(int32_t)*h->n_ref;
+	if(expect!=(size_t)st_flat.st_size)
+		{
+		fprintf(stderr,"\"%s\" is truncated.\n",fnflat);
+		munmap(map,st_flat.st_size);
+		goto done;
+		}
+	flat=(FlatIndex*)safeRealloc(NULL,sizeof(FlatIndex));
+	flat->map=map;
+	flat->map_len=st_flat.st_size;
+	flat->header=h;
+	flat->refs=(const FlatRef*)&h[1];
+	flat->bins=(const FlatBin*)&flat->refs[h->n_ref];
+	flat->chunks=(const FlatChunk*)&flat->bins[h->n_bin];
+	flat->intv=(const uint64_t*)&flat->chunks[h->n_chunk];
+	flat->names=(const char*)&flat->intv[h->n_intv];
+	flat->sorted=(const int32_t*)&flat->names[h->l_nm];
+	done:
+	free(fnidx);
+	free(fnflat);
+	return flat;
+	}
+
+static void destroyFlatIndex(FlatIndex* flat)
+	{
+	if(flat==NULL) return;
+	munmap(flat->map,flat->map_len);
+	free(flat);
+	}
+
+#define FLAT_NAME(flat,tid) (&((flat)->names[(flat)->refs[(tid)].name]))
+
+/* binary search of the chromosome in the flat index */
+static int flatTid(const FlatIndex* flat,const char* name)
+	{
+	int low=0,high=flat->header->n_ref-1;
+	while(low<=high)
+		{
+		int mid=(low+high)/2;
+		int cmp=strcmp(name,FLAT_NAME(flat,flat->sorted[mid]));
+		if(cmp==0) return flat->sorted[mid];
+		if(cmp<0) high=mid-1; else low=mid+1;
+		}
+	return -1;
+	}
+
+/* tid of a chromosome, the last chromosome is cached as the input is usually sorted */
+static int sourceTid(Source* src,const char* name)
+	{
+	size_t len;
+	if(src->last_chrom!=NULL && strcmp(src->last_chrom,name)==0) return src->last_tid;
+	len=strlen(name);
+	if(len+1 > src->last_chrom_buffer)
+		{
+		src->last_chrom_buffer=len+1;
+		src->last_chrom=(char*)safeRealloc(src->last_chrom,src->last_chrom_buffer);
+		}
+	memcpy(src->last_chrom,name,len+1);
+	src->last_tid=(src->flat!=NULL?flatTid(src->flat,name):ti_get_tid(src->t->idx,name));
+	return src->last_tid;
+	}
+
+/* collect the chunks of the flat index overlapping [beg,end), see ti_iter_query() in tabix */
+static void sourceQuery(Source* src,int tid,int beg,int end)
+	{
+	const FlatIndex* flat=src->flat;
+	const FlatRef* ref;
+	uint64_t min_off=0;
+	int i,n_bins;
+	if(flat==NULL)
+		{
+		src->iter=ti_queryi(src->t, tid, beg, end);
+		return;
+		}
+	src->q_tid=tid;
+	src->q_beg=beg;
+	src->q_end=end;
+	src->q_n_chunks=0;
+	src->q_chunk=0;
+	src->q_in_chunk=0;
+	if(tid<0 || tid>=flat->header->n_ref || beg>=end) return;
+	ref=&flat->refs[tid];
+	if(ref->n_intv>0)
+		{
+		int64_t k=beg>>TAD_LIDX_SHIFT;
+		min_off=flat->intv[ref->intv+(k>=ref->n_intv?ref->n_intv-1:k)];
+		}
+	if(src->q_bins==NULL)
+		{
+		src->q_bins=(uint16_t*)safeRealloc(NULL,sizeof(uint16_t)*MAX_BIN);
+		}
+	n_bins=reg2bins(beg,end,src->q_bins);
+	for(i=0;i< n_bins;++i)
+		{
+		FlatBin key;
+		const FlatBin* bin;
+		uint32_t j;
+		key.bin=src->q_bins[i];
+		bin=(const FlatBin*)bsearch(&key,&flat->bins[ref->bin],ref->n_bin,sizeof(FlatBin),compareFlatBin);
+		if(bin==NULL) continue;
+		if(src->q_n_chunks+bin->n_chunk > src->q_chunks_buffer)
+			{
+			src->q_chunks_buffer=src->q_n_chunks+bin->n_chunk+BUFSIZ;
+			src->q_chunks=(FlatChunk*)safeRealloc(src->q_chunks,sizeof(FlatChunk)*src->q_chunks_buffer);
+			}
+		for(j=0;j< bin->n_chunk;++j)
+			{
+			const FlatChunk* c=&flat->chunks[bin->chunk+j];
+			if(c->end > min_off) src->q_chunks[src->q_n_chunks++]=*c;
+			}
+		}
+	if(src->q_n_chunks==0) return;
+	/* sort and merge the chunks */
+	qsort(src->q_chunks,src->q_n_chunks,sizeof(FlatChunk),compareFlatChunk);
+	for(i=1,n_bins=0;i< (int)src->q_n_chunks;++i)
+		{
+		FlatChunk* last=&src->q_chunks[n_bins];
+		if(last->end >= src->q_chunks[i].beg)
+			{
+			if(last->end < src->q_chunks[i].end) last->end=src->q_chunks[i].end;
+			}
+		else
+			{
+			src->q_chunks[++n_bins]=src->q_chunks[i];
+			}
+		}
+	src->q_n_chunks=n_bins+1;
+	}
+
+/* fill 'q_buf' with the rest of the current bgzf block, so the virtual offset
+ * of each byte is known. Returns the number of bytes, 0 at the end of the file */
+static int fillBgzfBuffer(Source* src)
+	{
+	BGZF* fp=src->fp;
+	int n;
+	if(src->q_buf==NULL) src->q_buf=(char*)safeRealloc(NULL,MAX_BGZF_BLOCK);
+	src->q_buf_pos=0;
+	src->q_buf_len=0;
+	src->q_buf_tell=bgzf_tell(fp);
+	/* the first byte loads the block if needed */
+	if((n=bgzf_read(fp,src->q_buf,1))!=1) return n;
+	if(fp->block_offset < fp->block_length)
+		{
+		int r=bgzf_read(fp,src->q_buf+1,fp->block_length-fp->block_offset);
+		if(r<0) return r;
+		n+=r;
+		}
+	src->q_buf_len=n;
+	return n;
+	}
+
+/* virtual offset of the next byte of the bgzf file */
+static uint64_t sourceTell(Source* src)
+	{
+	if(src->q_buf_pos < src->q_buf_len) return src->q_buf_tell+src->q_buf_pos;
+	return (uint64_t)bgzf_tell(src->fp);
+	}
+
+/* seek the bgzf file, the buffer is kept if it contains 'offset' */
+static int sourceSeek(Source* src,uint64_t offset)
+	{
+	if(src->q_buf_len>0 &&
+	   (offset>>16)==(src->q_buf_tell>>16) &&
+	   offset>=src->q_buf_tell &&
+	   offset < src->q_buf_tell+src->q_buf_len)
+		{
+		src->q_buf_pos=(int)(offset-src->q_buf_tell);
+		return 0;
+		}
+	src->q_buf_pos=0;
+	src->q_buf_len=0;
+	return bgzf_seek(src->fp,offset,SEEK_SET)<0?-1:0;
+	}
+
+/* next line of the bgzf file, NULL at the end of the file */
+static const char* readBgzfLine(Source* src,int* len)
+	{
+	size_t n=0;
+	for(;;)
+		{
+		const char* start;
+		const char* eol;
+		size_t k;
+		if(src->q_buf_pos >= src->q_buf_len && fillBgzfBuffer(src)<=0) break;
+		start=src->q_buf+src->q_buf_pos;
+		eol=(const char*)memchr(start,'\n',src->q_buf_len-src->q_buf_pos);
+		k=(eol==NULL?(size_t)(src->q_buf_len-src->q_buf_pos):(size_t)(eol-start));
+		if(n+k+1 >= src->q_line_buffer)
+			{
+			src->q_line_buffer=n+k+BUFSIZ;
+			src->q_line=(char*)safeRealloc(src->q_line,src->q_line_buffer);
+			}
+		memcpy(&src->q_line[n],start,k);
+		n+=k;
+		src->q_buf_pos+=(int)k;
+		if(eol!=NULL)
+			{
+			src->q_buf_pos++;
+			src->q_line[n]=0;
+			*len=(int)n;
+			return src->q_line;
+			}
+		}
+	if(n==0) return NULL;
+	src->q_line[n]=0;
+	*len=(int)n;
+	return src->q_line;
+	}
+
+/* next line overlapping the query, see ti_iter_read() in tabix */
+static const char* sourceRead(Source* src,int* len)
+	{
+	if(src->flat==NULL) return ti_read(src->t, src->iter, len);
+	for(;;)
+		{
+		const char* s;
+		const char* chrom;
+		int beg,end,chrom_len;
+		if(!src->q_in_chunk)
+			{
+			if(src->q_chunk>=src->q_n_chunks) return NULL;
+			if(sourceSeek(src,src->q_chunks[src->q_chunk].beg)<0) return NULL;
+			src->q_in_chunk=1;
+			}
+		if(sourceTell(src) >= src->q_chunks[src->q_chunk].end ||
+		   (s=readBgzfLine(src,len))==NULL)
+			{
+			src->q_in_chunk=0;
+			src->q_chunk++;
+			continue;
+			}
+		if(s[0]==src->conf->meta_char) continue;
+		if((chrom=getColumn(s,src->conf->sc-1,&chrom_len))==NULL ||
+		   !hitInterval(src->conf,s,&beg,&end)) continue;
+		/* the records are sorted: we're done with the next chromosome or after the end */
+		if(strncmp(chrom,FLAT_NAME(src->flat,src->q_tid),chrom_len)!=0 ||
+		   FLAT_NAME(src->flat,src->q_tid)[chrom_len]!=0 ||
+		   beg >= src->q_end)
+			{
+			src->q_chunk=src->q_n_chunks;
+			src->q_in_chunk=0;
+			return NULL;
+			}
+		if(end > src->q_beg) return s;
+		}
+	}
+
+static void sourceEndQuery(Source* src)
+	{
+	if(src->flat==NULL) ti_iter_destroy(src->iter);
+	src->iter=NULL;
+	}
+
+/* open the flat index if available, else the tabix file */
+static int openSource(Source* src)
+	{
+	if((src->flat=loadFlatIndex(src->filename))!=NULL)
+		{
+		const FlatHeader* h=src->flat->header;
+		if((src->fp=bgzf_open(src->filename,"r"))==NULL)
+			{
+			fprintf(stderr, "Cannot open file \"%s\" %s.\n",src->filename,strerror(errno));
+			return -1;
+			}
+		src->flat_conf.preset=h->conf[0];
+		src->flat_conf.sc=h->conf[1];
+		src->flat_conf.bc=h->conf[2];
+		src->flat_conf.ec=h->conf[3];
+		src->flat_conf.meta_char=h->conf[4];
+		src->flat_conf.line_skip=h->conf[5];
+		src->conf=&src->flat_conf;
+		return 0;
+		}
+	if ((src->t = ti_open(src->filename, 0)) == 0)
+		{
+		fprintf(stderr, "Cannot open tabix file \"%s\" %s.\n",src->filename,strerror(errno));
+		return -1;
+		}
+	if (ti_lazy_index_load(src->t) < 0)
+		 {
+		 fprintf(stderr, "Cannot open index for file \"%s\".\n",src->filename);
+		 return -1;
+		 }
+	src->conf=ti_get_conf(src->t->idx);
+	return 0;
+	}
+
+/* reopen the bgzf file, its offset must not be shared with another process */
+static int reopenSource(Source* src)
+	{
+	BGZF** fp=(src->flat!=NULL?&src->fp:&src->t->fp);
+	bgzf_close(*fp);
+	if((*fp=bgzf_open(src->filename,"r"))==NULL)
+		{
+		fprintf(stderr,"Cannot open \"%s\".\n",src->filename);
+		return -1;
+		}
+	src->q_buf_pos=0;
+	src->q_buf_len=0;
+	return 0;
+	}
+
+static void closeSource(Source* src)
+	{
+	if(src->flat!=NULL)
+		{
+		bgzf_close(src->fp);
+		destroyFlatIndex(src->flat);
+		}
+	else if(src->t!=NULL)
+		{
+		ti_close(src->t);
+		}
+	free(src->data);
+	free(src->hits);
+	free(src->first_hit);
+	free(src->q_bins);
+	free(src->q_chunks);
+	free(src->q_line);
+	free(src->q_buf);
+	free(src->last_chrom);
+	}
+
+/* queries the hits overlapping the record, returns the number of accepted hits */
+static size_t scanOverlaps(const JoinTabix* app,Source* src,const Record* rec,int tid)
+	{
+	const char *s;
+	int len,beg,end;
+	size_t n=0;
+	size_t first=src->n_hits;
+	sourceQuery(src, tid, rec->chromStart, rec->chromEnd);
+	while ((s = sourceRead(src, &len)) != 0)
+		{
+		if(!hitInterval(src->conf,s,&beg,&end) || !acceptOverlap(app,rec,beg,end)) continue;
+		if(app->refCol>=0 && !matchAlleles(app,rec,s,beg)) continue;
+		storeHit(app,src,first,s,len,app->nearest?0:-1);
+		++n;
+		if(app->aggregate==AGGREGATE_FIRST) break;
+		}
+	sourceEndQuery(src);
+	return n;
+	}
+
+/* queries windows of increasing size around the record until a hit is found
+ * and keep the closest hits */
+static size_t scanNearest(const JoinTabix* app,Source* src,const Record* rec,int tid)
+	{
+	int window;
+	size_t first=src->n_hits;
+	size_t data_len=src->data_len;
+	for(window=NEAREST_WINDOW;window<=NEAREST_MAX_WINDOW;window*=2)
+		{
+		const char *s;
+		int len,beg,end;
+		int best=-1;
+		size_t n=0;
+		int qStart=rec->chromStart-window;
+		sourceQuery(src, tid, qStart<0?0:qStart, rec->chromEnd+window);
+		while ((s = sourceRead(src, &len)) != 0)
+			{
+			int distance;
+			if(!hitInterval(src->conf,s,&beg,&end)) continue;
+			if(app->refCol>=0 && !matchAlleles(app,rec,s,beg)) continue;
+			distance=hitDistance(rec,beg,end);
+			/* overlapping hits were rejected by scanOverlaps */
+			if(distance==0 || distance>window) continue;
+			if(best!=-1 && distance>best) continue;
+			if(best==-1 || distance<best)
+				{
+				src->n_hits=first;
+				src->data_len=data_len;
+				best=distance;
+				n=0;
+				}
+			if(app->aggregate==AGGREGATE_FIRST && n>0) continue;
+			storeHit(app,src,first,s,len,distance);
+			++n;
+			}
+		sourceEndQuery(src);
+		if(n>0) return n;
+		}
+	return 0;
+	}
+
+/* fills the hits of 'src' for the current batch of records */
+static void querySource(JoinTabix* app,Source* src)
+	{
+	size_t i;
+	src->n_hits=0;
+	src->data_len=0;
+	if(app->n_records+1 > src->first_hit_buffer)
+		{
+		src->first_hit_buffer=app->n_records+1;
+		src->first_hit=(size_t*)safeRealloc(src->first_hit,sizeof(size_t)*src->first_hit_buffer);
+		}
+	for(i=0;i< app->n_records;++i)
+		{
+		const Record* rec=&app->records[i];
+		int tid;
+		size_t n=0;
+		src->first_hit[i]=src->n_hits;
+		if(rec->type!=RECORD_DATA) continue;
+		if((tid=sourceTid(src, rec->tokens[app->chromCol]))>=0)
+			{
+			n=scanOverlaps(app,src,rec,tid);
+			if(n==0 && app->nearest) n=scanNearest(app,src,rec,tid);
+			}
+		/* a chromosome missing from the tabix file has no overlap either */
+		if(app->aggregate==AGGREGATE_COUNT)
+			{
+			char tmp[30];
+			pushHit(src,tmp,sprintf(tmp,"%d",(int)n));
+			}
+		else if(app->aggregate==AGGREGATE_DISTINCT && src->n_hits>src->first_hit[i])
 			{
-			app->buffer+=BUFSIZ;
-			if((app->line=(char*)realloc(app->line,sizeof(char)*app->buffer))==NULL)
+			/* merge the distinct values into one hit */
+			size_t j;
+			char* p=SOURCE_HIT(src,src->first_hit[i]);
+			for(j=src->first_hit[i]+1;j< src->n_hits;++j)
 				{
-				fprintf(stderr,"Cannot realloc %d bytes\n",app->buffer);
-				exit(EXIT_FAILURE);
+				p[strlen(p)]=',';
 				}
+			src->n_hits=src->first_hit[i]+1;
 			}
+		}
+	src->first_hit[app->n_records]=src->n_hits;
+	}
 
-		app->line[app->len++]=c;	
+static void* queryWorker(void* ptr)
+	{
+	Worker* w=(Worker*)ptr;
+	size_t i;
+	for(i=w->first;i< w->app->n_sources;i+=w->app->nthreads)
+		{
+		querySource(w->app,&w->app->sources[i]);
 		}
-	app->line[app->len]=0;
-	return app->line;
+	return NULL;
 	}
 
-static void pushToken(JoinTabix* app,char* ptr)
+/* query all the sources for the current batch, one thread per group of sources */
+static void queryBatch(JoinTabix* app)
 	{
-	if(app->n_tokens+1 > app->tokens_buffer)
+	size_t i;
+	size_t nthreads=(size_t)app->nthreads;
+	pthread_t* threads;
+	Worker* workers;
+	if(nthreads>app->n_sources) nthreads=app->n_sources;
+	if(nthreads<=1)
+		{
+		for(i=0;i< app->n_sources;++i) querySource(app,&app->sources[i]);
+		return;
+		}
+	threads=(pthread_t*)safeRealloc(NULL,sizeof(pthread_t)*nthreads);
+	workers=(Worker*)safeRealloc(NULL,sizeof(Worker)*nthreads);
+	for(i=0;i< nthreads;++i)
 		{
-		app->tokens_buffer+=50;
-		if((app->tokens=(char**)realloc(app->tokens,sizeof(char*)*app->tokens_buffer))==NULL)
+		workers[i].app=app;
+		workers[i].first=i;
+		if(pthread_create(&threads[i],NULL,queryWorker,&workers[i])!=0)
 			{
-			fprintf(stderr,"Cannot realloc %d bytes\n",sizeof(char*)*app->tokens_buffer);
+			fprintf(stderr,"Cannot create thread.\n");
 			exit(EXIT_FAILURE);
 			}
 		}
-	
-	app->tokens[app->n_tokens++]=ptr;	
+	for(i=0;i< nthreads;++i)
+		{
+		pthread_join(threads[i],NULL);
+		}
+	free(workers);
+	free(threads);
 	}
 
-static void splitLine(JoinTabix* app)
+static void printNotFound(JoinTabix* app,const Record* rec)
 	{
-	size_t i,j;
+	fputs("##boum\t",stdout);
+	printTokens(stdout,app,rec);
+	fputc('\n',stdout);
+	}
+
+static void printBadRecord(JoinTabix* app,const Record* rec)
+	{
+	fprintf(stderr,"Found column missing or bad position or unknown chromosome in : ");
+	printTokens(stderr,app,rec);
+	fputc('\n',stderr);
+	}
 
-	app->n_tokens=0;
-	pushToken(app,app->line);
-	for(i=0, j=1;i< app->len;++i)
+/* returns 1 if the chromosome of 'rec' is known by at least one source */
+static int isKnownChrom(JoinTabix* app,const Record* rec)
+	{
+	size_t i;
+	for(i=0;i< app->n_sources;++i)
 		{
-		if(app->line[i]!=app->delim) continue;
-		app->line[i]=0;
-		pushToken(app,&app->line[i+1]);
+		if(sourceTid(&app->sources[i], rec->tokens[app->chromCol])>=0) return 1;
 		}
+	return 0;
 	}
 
-static void printTokens(FILE* out,JoinTabix* app)
+/* one output line per combination of hits; sources without hit print '.' */
+static void printCross(JoinTabix* app,size_t r,size_t total)
 	{
+	const Record* rec=&app->records[r];
+	size_t* curr;
 	size_t i;
-
-	for(i=0;i< app->n_tokens;++i)
+	if(total==0)
 		{
-		if(i>0) fputc(app->delim,out);
-		fputs(app->tokens[i],out);
+		if(!isKnownChrom(app,rec)) printBadRecord(app,rec);
+		printNotFound(app,rec);
+		return;
+		}
+	curr=(size_t*)calloc(app->n_sources,sizeof(size_t));
+	if(curr==NULL)
+		{
+		fprintf(stderr,"Out of memory\n");
+		exit(EXIT_FAILURE);
+		}
+	for(;;)
+		{
+		printTokens(stdout,app,rec);
+		for(i=0;i< app->n_sources;++i)
+			{
+			const Source* src=&app->sources[i];
+			fputc(app->delim, stdout);
+			if(SOURCE_COUNT(src,r)==0)
+				{
+				fputc('.',stdout);
+				}
+			else
+				{
+				fputs(SOURCE_HIT(src,src->first_hit[r]+curr[i]), stdout);
+				}
+			}
+		fputc('\n', stdout);
+		/* next combination */
+		for(i=app->n_sources;i>0;--i)
+			{
+			const Source* src=&app->sources[i-1];
+			if(curr[i-1]+1 < SOURCE_COUNT(src,r))
+				{
+				curr[i-1]++;
+				break;
+				}
+			curr[i-1]=0;
+			}
+		if(i==0) break;
 		}
+	free(curr);
 	}
-static int parseIntGE0(const char* s)
-	{
-	char* p2;
-	int n;
 
-	errno=0;
-	n=(int)strtol(s,&p2,10);
-	if(*p2!=0 || errno!=0 || n<0)
+/* one output line per record, the hits of a source are grouped in one column */
+static void printRow(JoinTabix* app,size_t r)
+	{
+	const Record* rec=&app->records[r];
+	size_t i,j;
+	if(!isKnownChrom(app,rec)) printBadRecord(app,rec);
+	printTokens(stdout,app,rec);
+	for(i=0;i< app->n_sources;++i)
 		{
-		return -1;
+		const Source* src=&app->sources[i];
+		fputc(app->delim, stdout);
+		if(SOURCE_COUNT(src,r)==0)
+			{
+			fputc('.',stdout);
+			continue;
+			}
+		for(j=src->first_hit[r];j< src->first_hit[r+1];++j)
+			{
+			if(j>src->first_hit[r]) fputc(';',stdout);
+			printHit(stdout,SOURCE_HIT(src,j),'|');
+			}
 		}
-	return n;
+	fputc('\n', stdout);
 	}
-	
-	
-static int parseInt(const char* s)
+
+static void printBatch(JoinTabix* app)
 	{
-	int n=parseIntGE0(s);
-	if(n<0)
+	size_t r,i;
+	for(r=0;r< app->n_records;++r)
 		{
-		fprintf(stderr,"Bad Integer \"%s\".\n",s);
-		return EXIT_FAILURE;
+		const Record* rec=&app->records[r];
+		size_t total=0;
+		if(rec->type==RECORD_COMMENT)
+			{
+			fputs(rec->line,stdout);
+			/* the header line of the input gets the labels of the sources */
+			if(app->layout==LAYOUT_ROW && rec->line[1]!=app->ignore)
+				{
+				for(i=0;i< app->n_sources;++i)
+					{
+					fputc(app->delim,stdout);
+					fputs(app->sources[i].label,stdout);
+					}
+				}
+			fputc('\n',stdout);
+			continue;
+			}
+		if(rec->type==RECORD_BAD)
+			{
+			printBadRecord(app,rec);
+			printNotFound(app,rec);
+			continue;
+			}
+		for(i=0;i< app->n_sources;++i)
+			{
+			total+=SOURCE_COUNT(&app->sources[i],r);
+			}
+		if(app->layout==LAYOUT_ROW)
+			{
+			printRow(app,r);
+			}
+		else
+			{
+			printCross(app,r,total);
+			}
 		}
-	return n;
 	}
 
-static int parseInt1(const char* s)
+/* read the next line into a new record. returns 0 at end of input */
+static int readRecord(JoinTabix* app)
 	{
-	int n=parseInt(s);
-	if(n<1)
+	Record* rec;
+	if(app->n_records+1 > app->records_buffer)
 		{
-		fprintf(stderr,"Expected a number greater than 0 . Got \"%s\".\n",s);
-		return EXIT_FAILURE;
+		app->records=(Record*)safeRealloc(app->records,sizeof(Record)*(app->records_buffer+1));
+		memset(&app->records[app->records_buffer],0,sizeof(Record));
+		app->records_buffer++;
 		}
-	return n-1;/* convert to 0-based */
+	rec=&app->records[app->n_records];
+	if(readline(app,rec)==NULL) return 0;
+	rec->n_tokens=0;
+	if(rec->line[0]==0) return 1;
+	app->n_records++;
+
+	if(rec->line[0]==app->ignore)
+		{
+		rec->type=RECORD_COMMENT;
+		return 1;
+		}
+	splitLine(app,rec);
+	rec->type=RECORD_DATA;
+	if(app->chromCol>=rec->n_tokens ||
+	   app->startCol>=rec->n_tokens ||
+	   app->endCol>=rec->n_tokens ||
+	   (rec->chromStart=parseIntGE0(rec->tokens[app->startCol])) <0 ||
+	   (rec->chromEnd=parseIntGE0(rec->tokens[app->endCol])) <0
+	   )
+		{
+		rec->type=RECORD_BAD;
+		return 1;
+		}
+	if(rec->chromStart==rec->chromEnd) ++rec->chromEnd;
+	rec->chromStart+= app->shift;
+	rec->chromEnd+= app->shift;
+	rec->n_alleles=0;
+	if(app->refCol>=0)
+		{
+		const char* alt;
+		if(app->refCol>=rec->n_tokens || app->altCol>=rec->n_tokens)
+			{
+			rec->type=RECORD_BAD;
+			return 1;
+			}
+		/* one allele per ALT */
+		alt=rec->tokens[app->altCol];
+		for(;;)
+			{
+			Allele* a;
+			const char* comma=strchr(alt,',');
+			if(rec->n_alleles+1 > rec->alleles_buffer)
+				{
+				rec->alleles_buffer+=5;
+				rec->alleles=(Allele*)safeRealloc(rec->alleles,sizeof(Allele)*rec->alleles_buffer);
+				}
+			a=&rec->alleles[rec->n_alleles++];
+			a->pos=rec->chromStart;
+			a->ref=rec->tokens[app->refCol];
+			a->ref_len=strlen(a->ref);
+			a->alt=alt;
+			a->alt_len=(comma==NULL?strlen(alt):comma-alt);
+			normalizeAllele(a);
+			if(comma==NULL) break;
+			alt=comma+1;
+			}
+		}
+	return 1;
 	}
 
+/* parse two 1-based columns separated with a comma */
+static int parseColumnPair(char* s,int* col1,int* col2)
+	{
+	char* comma=strchr(s,',');
+	if(comma==NULL)
+		{
+		fprintf(stderr,"Expected two columns <REF>,<ALT>. Got \"%s\".\n",s);
+		return -1;
+		}
+	*comma=0;
+	*col1=parseInt1(s);
+	*col2=parseInt1(comma+1);
+	return 0;
+	}
 
 static int join(JoinTabix* app)
  	{
- 	while(readline(app)!=NULL)
+ 	for(;;)
  		{
- 		int tid=0;
- 		int found=0;
- 		int chromStart=0;
- 		int chromEnd=0;
- 		if(app->line[0]==0) continue;
- 		
- 		if(app->line[0]==app->ignore)
+ 		int more=1;
+ 		app->n_records=0;
+ 		while(app->n_records< BATCH_SIZE && (more=readRecord(app))!=0)
  			{
- 			fputs(app->line,stdout);
- 			fputc('\n',stdout);
- 			continue;
+ 			/* empty */
  			}
- 		splitLine(app);
-
- 		
- 		if(app->chromCol>=app->n_tokens ||
- 		   app->startCol>=app->n_tokens ||
- 		   app->endCol>=app->n_tokens ||
- 		   (tid=ti_get_tid(app->t->idx, app->tokens[app->chromCol])) <0 ||
- 		   (chromStart=parseIntGE0(app->tokens[app->startCol])) <0 ||
- 		   (chromEnd=parseIntGE0(app->tokens[app->endCol])) <0
- 		   )
+ 		if(app->n_records>0)
  			{
- 			fprintf(stderr,"Found column missing or bad position or unknown chromosome in : ");
- 			printTokens(stderr,app);
- 			fputc('\n',stderr);
+ 			queryBatch(app);
+ 			printBatch(app);
  			}
- 		else
- 			{
- 			const char *s;
- 			int len;
- 			if(chromStart==chromEnd) ++chromEnd;
- 			chromStart+= app->shift;
- 			chromEnd+= app->shift;
- 			ti_iter_t iter = ti_queryi(app->t, tid, chromStart, chromEnd);
-			while ((s = ti_read(app->t, iter, &len)) != 0)
+ 		if(!more) break;
+ 		}
+ 	return 0;
+ 	}
+
+/* set by SIGINT/SIGTERM to stop the server */
+static volatile sig_atomic_t server_stop=0;
+
+static void stopServer(int sig)
+	{
+	server_stop=1;
+	}
+
+/* open a unix domain socket, bound and listening if 'server' */
+static int openUnixSocket(const char* path,int server)
+	{
+	struct sockaddr_un addr;
+	int fd;
+	if(strlen(path)>=sizeof(addr.sun_path))
+		{
+		fprintf(stderr,"Socket path too long \"%s\".\n",path);
+		return -1;
+		}
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strcpy(addr.sun_path,path);
+	if((fd=socket(AF_UNIX,SOCK_STREAM,0))<0)
+		{
+		fprintf(stderr,"Cannot create socket %s.\n",strerror(errno));
+		return -1;
+		}
+	if(server)
+		{
+		if(bind(fd,(struct sockaddr*)&addr,sizeof(addr))!=0 || listen(fd,SOMAXCONN)!=0)
+			{
+			fprintf(stderr,"Cannot listen to \"%s\" %s.\n",path,strerror(errno));
+			close(fd);
+			return -1;
+			}
+		}
+	else if(connect(fd,(struct sockaddr*)&addr,sizeof(addr))!=0)
+		{
+		fprintf(stderr,"Cannot connect to \"%s\" %s.\n",path,strerror(errno));
+		close(fd);
+		return -1;
+		}
+	return fd;
+	}
+
+/* the server keeps the tabix indexes loaded and forks a process joining
+ * the lines sent by each client, the output is written back to the client */
+static int serve(JoinTabix* app,const char* path)
+	{
+	struct sigaction sa;
+	int server_fd=openUnixSocket(path,1);
+	if(server_fd<0) return EXIT_FAILURE;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler=stopServer;
+	sigaction(SIGINT,&sa,NULL);
+	sigaction(SIGTERM,&sa,NULL);
+	/* children are reaped automatically */
+	signal(SIGCHLD,SIG_IGN);
+	fprintf(stderr,"Listening on %s\n",path);
+	while(!server_stop)
+		{
+		pid_t pid;
+		int fd=accept(server_fd,NULL,NULL);
+		if(fd<0)
+			{
+			if(errno==EINTR) continue;
+			fprintf(stderr,"accept failed %s.\n",strerror(errno));
+			break;
+			}
+		fflush(stdout);
+		fflush(stderr);
+		if((pid=fork())<0)
+			{
+			fprintf(stderr,"Cannot fork %s.\n",strerror(errno));
+			close(fd);
+			continue;
+			}
+		if(pid==0)
+			{
+			size_t i;
+			close(server_fd);
+			/* the file offset of the tabix files would be shared with the other children */
+			for(i=0;i< app->n_sources;++i)
+				{
+				if(reopenSource(&app->sources[i])!=0) _exit(EXIT_FAILURE);
+				}
+			if(dup2(fd,STDOUT_FILENO)<0 || (app->in=gzdopen(fd,"r"))==NULL)
 				{
-				printTokens(stdout,app);
-				fputc(app->delim, stdout);
-				fputs(s, stdout);
-				fputc('\n', stdout);
-				++found;
+				fprintf(stderr,"Cannot read the client.\n");
+				_exit(EXIT_FAILURE);
 				}
-			ti_iter_destroy(iter);
+			join(app);
+			fflush(stdout);
+			_exit(EXIT_SUCCESS);
 			}
-		if(found==0)
+		close(fd);
+		}
+	close(server_fd);
+	unlink(path);
+	return EXIT_SUCCESS;
+	}
+
+/* copy the input to the server in a child process while the output of the server is printed */
+static int runClient(const char* path,int argc,char** argv,int optind)
+	{
+	char buff[BUFSIZ];
+	int status=0;
+	ssize_t n;
+	pid_t pid;
+	int fd=openUnixSocket(path,0);
+	if(fd<0) return EXIT_FAILURE;
+	fflush(stdout);
+	if((pid=fork())<0)
+		{
+		fprintf(stderr,"Cannot fork %s.\n",strerror(errno));
+		return EXIT_FAILURE;
+		}
+	if(pid==0)
+		{
+		do
+			{
+			gzFile in;
+			int len;
+			if(optind==argc)
+				{
+				in=gzdopen(fileno(stdin),"r");
+				}
+			else
+				{
+				errno=0;
+				in=gzopen(argv[optind],"r");
+				}
+			if(in==NULL)
+				{
+				fprintf(stderr,"Cannot read %s (%s).\n",(optind==argc?"stdin":argv[optind]),strerror(errno));
+				_exit(EXIT_FAILURE);
+				}
+			while((len=gzread(in,buff,BUFSIZ))>0)
+				{
+				char* p=buff;
+				while(len>0)
+					{
+					if((n=write(fd,p,len))<0)
+						{
+						fprintf(stderr,"Cannot write to server %s.\n",strerror(errno));
+						_exit(EXIT_FAILURE);
+						}
+					p+=n;
+					len-=n;
+					}
+				}
+			gzclose(in);
+			} while(++optind<argc);
+		shutdown(fd,SHUT_WR);
+		_exit(EXIT_SUCCESS);
+		}
+	while((n=read(fd,buff,BUFSIZ))>0)
+		{
+		fwrite(buff,sizeof(char),n,stdout);
+		}
+	close(fd);
+	waitpid(pid,&status,0);
+	fflush(stdout);
+	return (n<0 || !WIFEXITED(status) || WEXITSTATUS(status)!=0)?EXIT_FAILURE:EXIT_SUCCESS;
+	}
+
+/* parameters of a benchmark thread */
+typedef struct {
+	const char* path;
+	/* the input, and the offset of each line */
+	const char* data;
+	const size_t* lines;
+	size_t n_lines;
+	size_t batch;
+	size_t first;
+	size_t n_requests;
+	/* latencies in milliseconds */
+	double* latencies;
+	int failed;
+	} Bench;
+
+/* send one request, discard the response. returns the number of milliseconds or -1 */
+static double benchRequest(Bench* b,size_t line)
+	{
+	char buff[BUFSIZ];
+	struct timeval start,end;
+	size_t i,len=0;
+	const char* p=NULL;
+	int fd;
+	/* the lines are sent from 'line', cycling through the input */
+	size_t written=0,sent=0;
+	gettimeofday(&start,NULL);
+	if((fd=openUnixSocket(b->path,0))<0) return -1;
+	for(;;)
+		{
+		struct pollfd pfd;
+		pfd.fd=fd;
+		pfd.events=POLLIN|(sent< b->batch?POLLOUT:0);
+		if(poll(&pfd,1,-1)<0)
 			{
-			fputs("##boum\t",stdout);
- 			printTokens(stdout,app);
- 			fputc('\n',stdout);
+			if(errno==EINTR) continue;
+			break;
 			}
- 		}
- 	return 0;
- 	}
+		if(pfd.revents & POLLOUT)
+			{
+			ssize_t n;
+			if(len==written)
+				{
+				i=(line+sent)%b->n_lines;
+				p=&b->data[b->lines[i]];
+				len=strlen(p);
+				written=0;
+				}
+			if((n=write(fd,p+written,len-written))<0) break;
+			written+=n;
+			if(written==len && ++sent==b->batch) shutdown(fd,SHUT_WR);
+			}
+		if(pfd.revents & (POLLIN|POLLHUP))
+			{
+			ssize_t n=read(fd,buff,BUFSIZ);
+			if(n<=0) break;
+			}
+		}
+	close(fd);
+	if(sent!=b->batch) return -1;
+	gettimeofday(&end,NULL);
+	return (end.tv_sec-start.tv_sec)*1000.0+(end.tv_usec-start.tv_usec)/1000.0;
+	}
+
+static void* benchWorker(void* ptr)
+	{
+	Bench* b=(Bench*)ptr;
+	size_t i;
+	for(i=0;i< b->n_requests;++i)
+		{
+		if((b->latencies[i]=benchRequest(b,(b->first+i)*b->batch))<0) b->failed++;
+		}
+	return NULL;
+	}
+
+static int compareDouble(const void* a,const void* b)
+	{
+	double x=*(const double*)a;
+	double y=*(const double*)b;
+	return x<y?-1:(x>y?1:0);
+	}
+
+/* load test: 'n_requests' requests of 'batch' lines sent by 'nthreads' clients,
+ * the lines are read from the input. Prints the latencies. */
+static int runBenchmark(const char* path,int argc,char** argv,int optind,size_t n_requests,size_t batch,int nthreads)
+	{
+	char* data=NULL;
+	size_t data_len=0,data_buffer=0;
+	size_t* lines=NULL;
+	size_t n_lines=0;
+	size_t i,j,n_ok=0;
+	int failed=0;
+	double* latencies;
+	double elapsed;
+	struct timeval start,end;
+	pthread_t* threads;
+	Bench* benchs;
+	/* read the input lines */
+	do
+		{
+		int c;
+		gzFile in=(optind==argc?gzdopen(fileno(stdin),"r"):gzopen(argv[optind],"r"));
+		if(in==NULL)
+			{
+			fprintf(stderr,"Cannot read %s.\n",(optind==argc?"stdin":argv[optind]));
+			return EXIT_FAILURE;
+			}
+		while((c=gzgetc(in))!=EOF)
+			{
+			if(data_len+2 >= data_buffer)
+				{
+				data_buffer+=BUFSIZ;
+				data=(char*)safeRealloc(data,sizeof(char)*data_buffer);
+				}
+			if(data_len==0 || data[data_len-1]==0)
+				{
+				lines=(size_t*)safeRealloc(lines,sizeof(size_t)*(n_lines+1));
+				lines[n_lines++]=data_len;
+				}
+			data[data_len++]=c;
+			/* keep the newline, then end the string */
+			if(c=='\n') data[data_len++]=0;
+			}
+		gzclose(in);
+		} while(++optind<argc);
+	if(n_lines==0)
+		{
+		fprintf(stderr,"No input for the benchmark.\n");
+		return EXIT_FAILURE;
+		}
+	if(data[data_len-1]!=0)
+		{
+		data[data_len++]='\n';
+		data[data_len++]=0;
+		}
+	if(nthreads<1) nthreads=1;
+	latencies=(double*)safeRealloc(NULL,sizeof(double)*n_requests);
+	threads=(pthread_t*)safeRealloc(NULL,sizeof(pthread_t)*nthreads);
+	benchs=(Bench*)safeRealloc(NULL,sizeof(Bench)*nthreads);
+	gettimeofday(&start,NULL);
+	for(i=0,j=0;i< (size_t)nthreads;++i)
+		{
+		Bench* b=&benchs[i];
+		b->path=path;
+		b->data=data;
+		b->lines=lines;
+		b->n_lines=n_lines;
+		b->batch=batch;
+		b->first=j;
+		b->n_requests=n_requests/nthreads+(i< n_requests%nthreads?1:0);
+		b->latencies=&latencies[j];
+		b->failed=0;
+		j+=b->n_requests;
+		if(pthread_create(&threads[i],NULL,benchWorker,b)!=0)
+			{
+			fprintf(stderr,"Cannot create thread.\n");
+			return EXIT_FAILURE;
+			}
+		}
+	for(i=0;i< (size_t)nthreads;++i)
+		{
+		pthread_join(threads[i],NULL);
+		failed+=benchs[i].failed;
+		}
+	gettimeofday(&end,NULL);
+	elapsed=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)/1.0E6;
+	/* ignore the failed requests */
+	for(i=0;i< n_requests;++i)
+		{
+		if(latencies[i]>=0) latencies[n_ok++]=latencies[i];
+		}
+	qsort(latencies,n_ok,sizeof(double),compareDouble);
+	fprintf(stdout,"requests\t%d\n",(int)n_requests);
+	fprintf(stdout,"failed\t%d\n",failed);
+	fprintf(stdout,"lines.per.request\t%d\n",(int)batch);
+	fprintf(stdout,"clients\t%d\n",nthreads);
+	fprintf(stdout,"requests.per.second\t%.1f\n",(elapsed>0?n_ok/elapsed:0.0));
+	if(n_ok>0)
+		{
+		fprintf(stdout,"p50.ms\t%.3f\n",latencies[n_ok*50/100]);
+		fprintf(stdout,"p99.ms\t%.3f\n",latencies[n_ok*99/100]);
+		fprintf(stdout,"max.ms\t%.3f\n",latencies[n_ok-1]);
+		}
+	free(benchs);
+	free(threads);
+	free(latencies);
+	free(lines);
+	free(data);
+	return failed==0?EXIT_SUCCESS:EXIT_FAILURE;
+	}
 
+static const char* basename_of(const char* s)
+	{
+	const char* slash=strrchr(s,'/');
+	return slash==NULL?s:slash+1;
+	}
 
 int main(int argc, char *argv[])
   {
-  char* tabixfile=NULL;
   JoinTabix param;
   int optind=1;
+  size_t i;
+  char* serverPath=NULL;
+  char* clientPath=NULL;
+  size_t benchRequests=0;
+  size_t benchBatch=1;
+  int makeIndex=0;
   memset((void*)&param,0,sizeof(JoinTabix));
   param.delim='\t';
   param.chromCol=0;
   param.startCol=1;
   param.endCol=1;
   param.ignore='#';
+  param.layout=LAYOUT_CROSS;
+  param.nthreads=1;
+  param.refCol=-1;
+  param.altCol=-1;
+  /* VCF */
+  param.tabixRefCol=3;
+  param.tabixAltCol=4;
   /* loop over the arguments */
   while(optind<argc)
 	    {
@@ -228,14 +1915,126 @@ int main(int argc, char *argv[])
 		    fprintf(stdout, "  -s <int> start column (%d).\n",param.startCol+1);
 		    fprintf(stdout, "  -e <int> end column (%d).\n",param.endCol+1);
 		    fprintf(stdout, "  -i <char> ignore lines starting with (\'%c\').\n",param.ignore);
-		    fprintf(stdout, "  -t <filename> tabix file (required).\n");
+		    fprintf(stdout, "  -f <filename> tabix file (required). Can be used more than once.\n");
+		    fprintf(stdout, "  -L <string> label of the previous tabix file (default: file name).\n");
+		    fprintf(stdout, "  -m <cross|row> layout. cross: one line per combination of hits. row: one line per input, one column per tabix file (cross).\n");
+		    fprintf(stdout, "  -@ <int> number of threads querying the tabix files (%d).\n",param.nthreads);
+		    fprintf(stdout, "  -F <float> minimum fraction of the input covered by a hit (0.0-1.0).\n");
+		    fprintf(stdout, "  -r the fraction (-F) must also be satisfied for the hit (reciprocal).\n");
+		    fprintf(stdout, "  --first print only the first hit of each tabix file.\n");
+		    fprintf(stdout, "  --count print the number of hits of each tabix file.\n");
+		    fprintf(stdout, "  --distinct-column <int> print the distinct values of this column of the hits.\n");
+		    fprintf(stdout, "  --nearest if nothing overlaps, print the closest hits. The distance is appended to the hits.\n");
+		    fprintf(stdout, "  -a <int,int> REF and ALT columns of the input: only keep the hits with the same position and alleles.\n");
+		    fprintf(stdout, "  -A <int,int> REF and ALT columns of the tabix files (%d,%d).\n",param.tabixRefCol+1,param.tabixAltCol+1);
+		    fprintf(stdout, "  -S <path> server: keep the tabix files open and join the lines sent to this unix socket.\n");
+		    fprintf(stdout, "  -C <path> client: send the input to the server listening on this unix socket and print the result.\n");
+		    fprintf(stdout, "  --bench <int> with -C, send <int> requests (-@ clients in parallel) and print the latencies.\n");
+		    fprintf(stdout, "  --bench-lines <int> number of input lines per request for --bench (%d).\n",(int)benchBatch);
+		    fprintf(stdout, "  --make-index write the flat index <file>" FLAT_SUFFIX " of each tabix file and exit. When present and newer than the tabix index, it is memory-mapped instead of loading the tabix index.\n");
 		    fprintf(stdout, "  +1 add 1 to the genomic coodinates.\n");
 		    fprintf(stdout, "  -1 remove 1 to the genomic coodinates.\n");
 		    return EXIT_SUCCESS;
 		    }
 	    else if(strcmp(argv[optind],"-f")==0 && optind+1< argc)
 	    	{
-	    	tabixfile=argv[++optind];
+	    	Source* src;
+	    	param.sources=(Source*)safeRealloc(param.sources,sizeof(Source)*(param.n_sources+1));
+	    	src=&param.sources[param.n_sources++];
+	    	memset((void*)src,0,sizeof(Source));
+	    	src->filename=argv[++optind];
+	    	src->label=(char*)basename_of(src->filename);
+	    	}
+	    else if(strcmp(argv[optind],"-L")==0 && optind+1< argc)
+	    	{
+	    	if(param.n_sources==0)
+	    		{
+	    		fprintf(stderr,"Option -L must follow a tabix file (-f).\n");
+	    		return EXIT_FAILURE;
+	    		}
+	    	param.sources[param.n_sources-1].label=argv[++optind];
+	    	}
+	    else if(strcmp(argv[optind],"-m")==0 && optind+1< argc)
+	    	{
+	    	++optind;
+	    	if(strcmp(argv[optind],"cross")==0)
+	    		{
+	    		param.layout=LAYOUT_CROSS;
+	    		}
+	    	else if(strcmp(argv[optind],"row")==0)
+	    		{
+	    		param.layout=LAYOUT_ROW;
+	    		}
+	    	else
+	    		{
+	    		fprintf(stderr,"Unknown layout \"%s\".\n",argv[optind]);
+	    		return EXIT_FAILURE;
+	    		}
+	    	}
+	    else if(strcmp(argv[optind],"-@")==0 && optind+1< argc)
+	    	{
+	    	param.nthreads=parseInt(argv[++optind]);
+	    	if(param.nthreads<1) param.nthreads=1;
+	    	}
+	    else if(strcmp(argv[optind],"-F")==0 && optind+1< argc)
+	    	{
+	    	char* p2;
+	    	errno=0;
+	    	param.minFraction=strtod(argv[++optind],&p2);
+	    	if(*p2!=0 || errno!=0 || param.minFraction<0.0 || param.minFraction>1.0)
+	    		{
+	    		fprintf(stderr,"Bad fraction \"%s\".\n",argv[optind]);
+	    		return EXIT_FAILURE;
+	    		}
+	    	}
+	    else if(strcmp(argv[optind],"-r")==0)
+	    	{
+	    	param.reciprocal=1;
+	    	}
+	    else if(strcmp(argv[optind],"--first")==0)
+	    	{
+	    	param.aggregate=AGGREGATE_FIRST;
+	    	}
+	    else if(strcmp(argv[optind],"--count")==0)
+	    	{
+	    	param.aggregate=AGGREGATE_COUNT;
+	    	}
+	    else if(strcmp(argv[optind],"--distinct-column")==0 && optind+1< argc)
+	    	{
+	    	param.aggregate=AGGREGATE_DISTINCT;
+	    	param.distinctCol=parseInt1(argv[++optind]);
+	    	}
+	    else if(strcmp(argv[optind],"--nearest")==0)
+	    	{
+	    	param.nearest=1;
+	    	}
+	    else if(strcmp(argv[optind],"-a")==0 && optind+1< argc)
+	    	{
+	    	if(parseColumnPair(argv[++optind],&param.refCol,&param.altCol)!=0) return EXIT_FAILURE;
+	    	}
+	    else if(strcmp(argv[optind],"-A")==0 && optind+1< argc)
+	    	{
+	    	if(parseColumnPair(argv[++optind],&param.tabixRefCol,&param.tabixAltCol)!=0) return EXIT_FAILURE;
+	    	}
+	    else if(strcmp(argv[optind],"--make-index")==0)
+	    	{
+	    	makeIndex=1;
+	    	}
+	    else if(strcmp(argv[optind],"-S")==0 && optind+1< argc)
+	    	{
+	    	serverPath=argv[++optind];
+	    	}
+	    else if(strcmp(argv[optind],"-C")==0 && optind+1< argc)
+	    	{
+	    	clientPath=argv[++optind];
+	    	}
+	    else if(strcmp(argv[optind],"--bench")==0 && optind+1< argc)
+	    	{
+	    	benchRequests=parseInt(argv[++optind]);
+	    	}
+	    else if(strcmp(argv[optind],"--bench-lines")==0 && optind+1< argc)
+	    	{
+	    	benchBatch=parseInt1(argv[++optind])+1;
 	    	}
 	    else if(strcmp(argv[optind],"-1")==0)
 	    	{
@@ -291,12 +2090,22 @@ int main(int argc, char *argv[])
 		    }
 	    ++optind;
 	    }
-  if(tabixfile==NULL)
+  /* the client doesn't need the tabix files, the server does the join */
+  if(clientPath!=NULL)
+	{
+	if(benchRequests>0)
+		{
+		return runBenchmark(clientPath,argc,argv,optind,benchRequests,benchBatch,param.nthreads);
+		}
+	return runClient(clientPath,argc,argv,optind);
+	}
+
+  if(param.n_sources==0)
 	{
 	fprintf(stderr,"Error: undefined tabix file.\n");
 	return EXIT_FAILURE;
 	}
-	    
+
   if(param.chromCol==param.startCol)
 	{
 	fprintf(stderr,"Error: col(chrom)==col(start).\n");
@@ -309,18 +2118,30 @@ int main(int argc, char *argv[])
 	return EXIT_FAILURE;
 	}
 
-  if ((param.t = ti_open(tabixfile, 0)) == 0)
+  for(i=0;i< param.n_sources;++i)
 	{
-	fprintf(stderr, "Cannot open tabix file \"%s\" %s.\n",tabixfile,strerror(errno));
-	return EXIT_FAILURE;
+	Source* src=&param.sources[i];
+	if(makeIndex)
+		{
+		if(makeFlatIndex(src->filename)!=0) return EXIT_FAILURE;
+		continue;
+		}
+	if(openSource(src)!=0) return EXIT_FAILURE;
+	}
+  if(makeIndex)
+	{
+	free(param.sources);
+	return EXIT_SUCCESS;
 	}
-  if (ti_lazy_index_load(param.t) < 0)
-  	 {
-         fprintf(stderr, "Cannot open index for file \"%s\".\n",tabixfile);
-	 return EXIT_FAILURE;
-         }
 
-  if(optind==argc)
+  if(serverPath!=NULL)
+      {
+      int ret=serve(&param,serverPath);
+      for(i=0;i< param.n_sources;++i) closeSource(&param.sources[i]);
+      free(param.sources);
+      return ret;
+      }
+  else if(optind==argc)
       {
       param.in=gzdopen(fileno(stdin),"r");
       if(param.in==NULL)
@@ -342,11 +2163,20 @@ int main(int argc, char *argv[])
         	return EXIT_FAILURE;
       		}
       	join(&param);
-      	gzclose(param.in); 
+      	gzclose(param.in);
 	}
   /* we're done */
-  ti_close(param.t);
-  free(param.line);
-  free(param.tokens);
+  for(i=0;i< param.n_sources;++i)
+	{
+	closeSource(&param.sources[i]);
+	}
+  free(param.sources);
+  for(i=0;i< param.records_buffer;++i)
+	{
+	free(param.records[i].line);
+	free(param.records[i].tokens);
+	free(param.records[i].alleles);
+	}
+  free(param.records);
   return EXIT_SUCCESS;
   }
@@ -24,9 +24,12 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include "bam.h"
 #include "faidx.h"
 #include "bam2bcf.h"
+#include "twobit.h"
+#include "ttview.h"
 
 char bam_aux_getCEi(bam1_t *b, int i);
 char bam_aux_getCSi(bam1_t *b, int i);
@@ -35,6 +38,16 @@ char bam_aux_getCQi(bam1_t *b, int i);
 #define TV_MIN_ALNROW 2
 #define TV_MAX_GOTO  40
 #define TV_LOW_MAPQ  10
+/* -f: number of lines sorted and drawn together */
+#define TV_BATCH_SIZE 10000
+/* -f: views closer than TV_GROUP_GAP are drawn from one fetch, up to a window of TV_GROUP_SPAN */
+#define TV_GROUP_GAP 1000
+#define TV_GROUP_SPAN 100000
+/* -P: the cache of the partners is cleared when it holds TV_PARTNER_CACHE alignments */
+#define TV_PARTNER_CACHE 65536
+/* -P: first or second read of a pair, the mate of a read is the other one */
+#define TV_SEGMENT(flag) ((flag)&(BAM_FREAD1|BAM_FREAD2))
+#define TV_MATE_SEGMENT(flag) (TV_SEGMENT(flag)==0?0:TV_SEGMENT(flag)^(BAM_FREAD1|BAM_FREAD2))
 
 #define TV_COLOR_MAPQ   0
 #define TV_COLOR_BASEQ  1
@@ -45,117 +58,762 @@ char bam_aux_getCQi(bam1_t *b, int i);
 #define TV_BASE_NUCL 0
 #define TV_BASE_COLOR_SPACE 1
 
-/* I put the characters in a structure. If one day I want to add colors... */
-typedef struct cpixel_t
+/* the consensus row: none, the most frequent base, or the genotype likelihoods of bcf_call_glfgen */
+#define TV_CONSENSUS_NONE 0
+#define TV_CONSENSUS_COUNT 1
+#define TV_CONSENSUS_GL 2
+
+/* the output: plain text, text with the ANSI colors, HTML, or one JSON object per view */
+#define TV_OUTPUT_TEXT 0
+#define TV_OUTPUT_ANSI 1
+#define TV_OUTPUT_HTML 2
+#define TV_OUTPUT_JSON 3
+
+/* -D: the rows of the summary, and the sparkline of the depth */
+#define TV_SUMMARY_ROWS 3
+#define TV_SPARKLINE " .:-=+*#@"
+
+/* attribute of a cell: the color pair of samtools tview (0 for none, 1-4 quality, 5-9 base) and underline */
+#define TV_ATTR_COLOR 0x0F
+#define TV_ATTR_UNDERLINE 0x10
+
+/* a growing string. When it cannot grow, the text is dropped and 'failed' is set */
+typedef struct
 	{
-	char c;
-	}CPixel;
+	char* s;
+	size_t len, size;
+	int failed;
+	} TvString;
 
+/* a read shown in the view, for the JSON output */
 typedef struct
 	{
-	/* number of columns */
-	int mcol;
+	/* only used to tell the reads of a level apart while they are drawn */
+	const bam1_t* b;
+	/* name and cigar, offsets in 'read_names' */
+	size_t name, cigar;
+	int flag, pos, mapq, row, first_col, last_col;
+	/* the mate */
+	int mtid, mpos;
+	/* the file of the read */
+	int panel;
+	/* -S: the SA and MC tags, offsets in 'read_names', empty if the read has no such tag */
+	size_t sa, mc;
+	} TvRead;
+
+/* -D: the summary of a column, computed from the pileup */
+typedef struct
+	{
+	/* number of bases, 0 if the column is not covered, -1 for the column of an insertion */
+	int depth;
+	/* the most frequent base other than the reference (0-3, -1 for none) and its count */
+	int alt, n_alt;
+	/* sum of the base qualities */
+	int sum_qual;
+	} TvColumn;
+
+/* -P: an alignment of the SA tag of a read, or its mate, looked up in the BAM file */
+typedef struct
+	{
+	/* the key: file, read name (offset in 'partner_names'), chromosome, position and TV_SEGMENT
+	 * of its flag, a read and its mate starting at the same position are different keys */
+	int panel, tid, pos, segment;
+	size_t name;
+	/* -1 while it is looked up, 0 if the file has no such alignment, else 1 with its flag, mapq and cigar */
+	int found, flag, mapq;
+	size_t cigar;
+	} TvPartner;
+
+/* -P: the partners of a file looked up by one fetch */
+typedef struct
+	{
+	struct ttview_t* tv;
+	int panel, beg, end;
+	} TvLookup;
+
+/* lines of text. Each row has 'mcol' columns and ends with a '\n' so a whole
+ * region is written with one fwrite. The buffers are kept between the regions */
+typedef struct
+	{
+	/* the characters, row after row */
+	char* chars;
+	/* the attribute (TV_ATTR_*) of each cell of 'chars' */
+	unsigned char* attrs;
+	/* allocated size of 'chars' and 'attrs' */
+	size_t size;
 	/* number of lines created so far */
 	int nLines;
-	/* the array(y,x) */
-	CPixel** screen;
+	/* the lines could not be created, the cells out of the screen are not drawn */
+	int failed;
+	} TvScreen;
 
+/* a BAM file. With several files, the reads of each file are drawn in their own
+ * panel under the ruler, the reference and the consensus of all the reads */
+typedef struct
+	{
+	const char* path;
+	bamFile fp;
+	bam_header_t *header;
+	/* the index can be shared by the contexts of several threads, only its owner releases it */
 	bam_index_t *idx;
+	int own_idx;
+	/* the chromosome and the window to fetch, 'tid' is -1 if the file has no such chromosome.
+	 * 'view_tid' is the chromosome in the first file, the copies are merged with it */
+	int tid, view_tid, beg, end;
+	int no_skip;
+	/* with several files, the index of the file is written in the 'bin' of the copies, -1 otherwise */
+	int tag;
+	/* the reads fetched for the window */
+	bam1_t** reads;
+	/* end of each read on the reference */
+	int* read_ends;
+	int n_reads, m_reads;
+	/* longest span of a read on the reference */
+	int max_span;
+	/* -m: maximum number of rows of reads, 0 for no limit. The reads kept while fetching
+	 * the window, with their priority, a read over the limit has a 'read_ends' of -1 */
+	int max_rows;
+	int* active;
+	uint32_t* active_prio;
+	int n_active, m_active;
+	/* next read pushed in the pileup */
+	int next_read;
+	/* several files: the rows of the panel, the end of the last read of each row,
+	 * and the line of the first row in the view */
+	TvScreen screen;
+	int* row_ends;
+	int m_rows;
+	int first_row;
+	/* fetches the reads while the other files are read */
+	pthread_t thread;
+	int in_thread;
+	/* a read of the window could not be kept */
+	int oom;
+	} TvPanel;
+
+struct ttview_t
+	{
+	/* number of columns */
+	int mcol;
+	TvScreen screen;
+	/* TV_OUTPUT_* */
+	int output;
+	/* the reads of the view (JSON output), and the last one drawn on each level */
+	TvRead* view_reads;
+	int n_view_reads, m_view_reads;
+	int* level_reads;
+	int m_levels;
+	TvString read_names;
+
+	/* the BAM files */
+	TvPanel* panels;
+	int n_panels;
+	/* several files: the row in its panel of the read on each level of the pileup */
+	int* panel_rows;
+	int m_panel_rows;
 	bam_lplbuf_t *lplbuf;
+	/* the header of the first file, the regions are parsed with it */
 	bam_header_t *header;
-	bamFile fp;
 	int curr_tid, left_pos;
 	faidx_t *fai;
+	/* reference packed with fa2bit, used instead of 'fai' */
+	twobit_t *tb;
 	bcf_callaux_t *bca;
 
-	int ccol, last_pos, row_shift, base_for, color_for, is_dot, l_ref, ins, no_skip, show_name;
+	int ccol, last_pos, row_shift, base_for, color_for, is_dot, l_ref, ins, no_skip, show_name, consensus;
+	/* the reference of the current view, points into 'ref_buf' */
 	char *ref;
-} ttview_t;
+
+	/* the reference fetched once for a window holding one or more views */
+	char* ref_buf;
+	int ref_beg, l_ref_buf;
+	/* TV_CONSENSUS_GL: the calls of the loaded window [win_beg,win_end), 0 if not computed yet */
+	uint32_t* calls;
+	int win_beg, win_end, m_calls;
+	/* ttview_render: the formatted view */
+	TvString out;
+	/* -S: soft clips and SA/MC partners of the reads, -P: the partners are looked up in the BAM files.
+	 * -P needs 'split', 'split_option' is the state of -S restored without -P */
+	int split, lookup, split_option;
+	/* -P: the partners already looked up, with an open addressing hash table of their index (-1 if empty) */
+	TvPartner* partners;
+	int n_partners, m_partners;
+	int32_t* partner_slots;
+	size_t n_partner_slots;
+	TvString partner_names;
+	/* the keys of the partners to look up, sorted on their position */
+	TvPartner* pending;
+	int n_pending, m_pending;
+	/* the line of a read with partners */
+	TvString line;
+	/* -D: the summary rows, and the summary of each column of the view */
+	int summary;
+	TvColumn* columns;
+	int m_columns;
+	/* an allocation failed while the view was drawn, ttv_render returns -1 */
+	int oom;
+	};
+
+/* a line of the -f list */
+typedef struct
+	{
+	char* line;
+	int tid, pos;
+	/* rank in the list */
+	int index;
+	/* the rendered view */
+	char* text;
+	size_t len;
+	/* 'text' can be printed */
+	int ready;
+	} TvRegion;
+
+/* a batch of -f lines drawn by several threads */
+typedef struct
+	{
+	/* the lines, in the order of the list */
+	TvRegion* regions;
+	int n_regions;
+	/* the lines sorted on their position, and the first line of each group */
+	TvRegion** sorted;
+	int* groups;
+	int n_groups;
+	/* next group to draw */
+	int next_group;
+	pthread_mutex_t lock;
+	/* signaled when a group is drawn */
+	pthread_cond_t drawn;
+	} TvBatch;
+
+/* a thread and its own context */
+typedef struct
+	{
+	ttview_t* tv;
+	TvBatch* batch;
+	pthread_t thread;
+	} TvWorker;
 
 #define WHERE fprintf(stderr,"[DEBUG] %d\n",__LINE__)
 
 
-static CPixel* getchxy(ttview_t* t,int y,int x)
+/* creates the empty lines of 'mcol' columns up to 'nLines' */
+static void ttv_lines(TvScreen* s,int mcol,int nLines)
 	{
-	int i=0;
-	assert(y>=0);
-	if(y<0 || x<0 || x>= t->mcol ) return NULL;
-	while(t->nLines<=y)
+	size_t stride=(size_t)mcol+1;
+	if(nLines*stride > s->size)
 		{
-		t->screen=(CPixel**)realloc(t->screen,sizeof(CPixel*)*(t->nLines+1));
-		if(t->screen==NULL)
-			{
-			fputs("Out of memory\n",stderr);
-			exit(EXIT_FAILURE);
-			}
-		t->screen[t->nLines]=malloc(t->mcol*sizeof(CPixel));
-		if(t->screen[t->nLines]==NULL)
-			{
-			fputs("Out of memory\n",stderr);
-			exit(EXIT_FAILURE);
-			}
-		for(i=0;i< t->mcol;++i)
+		size_t n=(s->size==0?32*stride:s->size);
+		char* chars;
+		unsigned char* attrs;
+		while(n< nLines*stride) n*=2;
+		if((chars=(char*)realloc(s->chars,n))!=NULL) s->chars=chars;
+		if((attrs=(unsigned char*)realloc(s->attrs,n))!=NULL) s->attrs=attrs;
+		if(chars==NULL || attrs==NULL)
 			{
-			t->screen[t->nLines][i].c=' ';
+			s->failed=1;
+			return;
 			}
-		t->nLines++;
+		s->size=n;
+		}
+	while(s->nLines< nLines)
+		{
+		char* row=&s->chars[s->nLines*stride];
+		memset(row,' ',mcol);
+		row[mcol]='\n';
+		memset(&s->attrs[s->nLines*stride],0,stride);
+		s->nLines++;
 		}
+	}
 
-	
-	return &(t->screen[y][x]);
+/* index of the cell (y,x) in the planes, or -1 if out of the screen */
+static long cellxy(TvScreen* s,int mcol,int y,int x)
+	{
+	assert(y>=0);
+	if(y<0 || x<0 || x>= mcol ) return -1;
+	if(y>=s->nLines) ttv_lines(s,mcol,y+1);
+	if(y>=s->nLines) return -1;
+	return (long)y*(mcol+1)+x;
 	}
 
-static void putchxy(ttview_t* t,int y,int x,char c)
+static void putcellxya(TvScreen* s,int mcol,int y,int x,char c,int attr)
 	{
-	CPixel* pixel=NULL;
-	pixel=getchxy(t,y,x);
-	if(pixel==NULL)
+	long i=cellxy(s,mcol,y,x);
+	if(i<0)
 		{
 		return;
 		}
-	pixel->c=c;
+	s->chars[i]=c;
+	s->attrs[i]=(unsigned char)attr;
+	}
+
+static void putchxya(ttview_t* t,int y,int x,char c,int attr)
+	{
+	putcellxya(&t->screen,t->mcol,y,x,c,attr);
+	}
+
+static void putchxy(ttview_t* t,int y,int x,char c)
+	{
+	putchxya(t,y,x,c,0);
 	}
 
 static void printfyx(ttview_t* t,int y,int x,char* fmt,...)
 	{
-	va_list ap;    
+	va_list ap;
 	int i=0;
-	char* buffer=NULL;
+	char buffer[100];
+	long cell;
 
-	buffer=malloc(t->mcol+1);
+	va_start(ap,fmt);
+	vsnprintf(buffer,sizeof(buffer),fmt,ap);
+	va_end(ap);
+	if((cell=cellxy(&t->screen,t->mcol,y,x))<0) return;
+	while(x+i< t->mcol && buffer[i]!=0)
+		{
+		t->screen.chars[cell+i]=buffer[i];
+		t->screen.attrs[cell+i]=0;
+		++i;
+		}
+	}
 
-	if(buffer==NULL)
+static void tvs_write(TvString* str,const char* s,size_t n)
+	{
+	if(str->len+n+1 > str->size)
 		{
-		fputs("Out of memory\n",stderr);
-		exit(EXIT_FAILURE);
+		size_t size=(str->size==0?BUFSIZ:str->size);
+		char* p;
+		while(size< str->len+n+1) size*=2;
+		if((p=(char*)realloc(str->s,size))==NULL)
+			{
+			str->failed=1;
+			return;
+			}
+		str->s=p;
+		str->size=size;
 		}
-	memset(buffer,'\0',sizeof(char)*(t->mcol+1));
+	memcpy(&str->s[str->len],s,n);
+	str->len+=n;
+	str->s[str->len]=0;
+	}
 
+static void tvs_puts(TvString* str,const char* s)
+	{
+	tvs_write(str,s,strlen(s));
+	}
+
+static void tvs_printf(TvString* str,const char* fmt,...)
+	{
+	va_list ap;
+	char buffer[100];
+	int n;
 	va_start(ap,fmt);
-	vsnprintf(buffer,t->mcol,fmt,ap);
+	n=vsnprintf(buffer,sizeof(buffer),fmt,ap);
 	va_end(ap);
-	while(x+i< t->mcol && buffer[i]!=0)
+	tvs_write(str,buffer,n< (int)sizeof(buffer)?n:(int)sizeof(buffer)-1);
+	}
+
+/* 's' escaped for HTML ('json'=0) or for a JSON string */
+static void tvs_escape(TvString* str,const char* s,size_t n,int json)
+	{
+	size_t i;
+	for(i=0;i< n;++i)
 		{
-		putchxy(t,y,x+i,buffer[i]);
-		++i;
+		switch(s[i])
+			{
+			case '<': tvs_puts(str,json?"<":"&lt;"); break;
+			case '>': tvs_puts(str,json?">":"&gt;"); break;
+			case '&': tvs_puts(str,json?"&":"&amp;"); break;
+			case '"': tvs_puts(str,json?"\\\"":"&quot;"); break;
+			case '\\': tvs_puts(str,json?"\\\\":"\\"); break;
+			default:
+				if((unsigned char)s[i]< 32) tvs_printf(str,json?"\\u%04x":"&#%d;",s[i]);
+				else tvs_write(str,&s[i],1);
+				break;
+			}
+		}
+	}
+
+/* remembers the read drawn at the current column (JSON output) */
+static void ttv_track_read(ttview_t* tv,const bam_pileup1_t* p,int row,int panel)
+	{
+	int k;
+	if(p->level>=tv->m_levels)
+		{
+		int m=p->level+64;
+		int* level_reads=(int*)realloc(tv->level_reads,m*sizeof(int));
+		if(level_reads==NULL)
+			{
+			tv->oom=1;
+			return;
+			}
+		tv->level_reads=level_reads;
+		while(tv->m_levels< m) tv->level_reads[tv->m_levels++]=-1;
+		}
+	k=tv->level_reads[p->level];
+	if(k<0 || tv->view_reads[k].b!=p->b || p->is_head)
+		{
+		TvRead* r;
+		uint32_t* cigar=bam1_cigar(p->b);
+		uint32_t i;
+		if(tv->n_view_reads==tv->m_view_reads)
+			{
+			int m=(tv->m_view_reads==0?64:tv->m_view_reads*2);
+			TvRead* view_reads=(TvRead*)realloc(tv->view_reads,m*sizeof(TvRead));
+			if(view_reads==NULL)
+				{
+				tv->oom=1;
+				return;
+				}
+			tv->view_reads=view_reads;
+			tv->m_view_reads=m;
+			}
+		k=tv->n_view_reads++;
+		r=&tv->view_reads[k];
+		r->b=p->b;
+		r->flag=p->b->core.flag;
+		r->pos=p->b->core.pos;
+		r->mapq=p->b->core.qual;
+		r->mtid=p->b->core.mtid;
+		r->mpos=p->b->core.mpos;
+		r->row=row;
+		r->panel=panel;
+		r->first_col=tv->ccol;
+		r->name=tv->read_names.len;
+		tvs_puts(&tv->read_names,bam1_qname(p->b));
+		tvs_write(&tv->read_names,"",1);
+		r->cigar=tv->read_names.len;
+		for(i=0;i< p->b->core.n_cigar;++i)
+			{
+			tvs_printf(&tv->read_names,"%u%c",cigar[i]>>BAM_CIGAR_SHIFT,"MIDNSHP=X"[cigar[i]&BAM_CIGAR_MASK]);
+			}
+		if(p->b->core.n_cigar==0) tvs_puts(&tv->read_names,"*");
+		tvs_write(&tv->read_names,"",1);
+		r->sa=r->mc=tv->read_names.len-1;
+		if(tv->split)
+			{
+			uint8_t* aux;
+			if((aux=bam_aux_get(p->b,"SA"))!=NULL && *aux=='Z')
+				{
+				r->sa=tv->read_names.len;
+				tvs_puts(&tv->read_names,bam_aux2Z(aux));
+				tvs_write(&tv->read_names,"",1);
+				}
+			if((aux=bam_aux_get(p->b,"MC"))!=NULL && *aux=='Z')
+				{
+				r->mc=tv->read_names.len;
+				tvs_puts(&tv->read_names,bam_aux2Z(aux));
+				tvs_write(&tv->read_names,"",1);
+				}
+			}
+		tv->level_reads[p->level]=k;
 		}
-	free(buffer);
+	tv->view_reads[k].last_col=tv->ccol;
 	}
 
-static void dump(ttview_t* t)
+/* -D: the summary of each column, null for the columns of the insertions */
+static void ttv_json_summary(ttview_t* tv,TvString* out)
 	{
-	int y;
 	int x;
-	for(y=0;y< t->nLines;++y)
+	tvs_puts(out,",\"depth\":[");
+	for(x=0;x< tv->mcol;++x)
+		{
+		if(x>0) tvs_write(out,",",1);
+		if(tv->columns[x].depth<0) tvs_puts(out,"null");
+		else tvs_printf(out,"%d",tv->columns[x].depth);
+		}
+	/* the most frequent base other than the reference, a space if there is none */
+	tvs_puts(out,"],\"alt\":\"");
+	for(x=0;x< tv->mcol;++x)
+		{
+		const TvColumn* col=&tv->columns[x];
+		tvs_write(out,(col->depth>0 && col->alt>=0?&"ACGT"[col->alt]:" "),1);
+		}
+	tvs_puts(out,"\",\"af\":[");
+	for(x=0;x< tv->mcol;++x)
+		{
+		const TvColumn* col=&tv->columns[x];
+		if(x>0) tvs_write(out,",",1);
+		if(col->depth<=0 || col->alt<0) tvs_puts(out,"null");
+		else tvs_printf(out,"%.3f",(double)col->n_alt/col->depth);
+		}
+	tvs_puts(out,"],\"baseq\":[");
+	for(x=0;x< tv->mcol;++x)
+		{
+		const TvColumn* col=&tv->columns[x];
+		if(x>0) tvs_write(out,",",1);
+		if(col->depth<=0) tvs_puts(out,"null");
+		else tvs_printf(out,"%.1f",(double)col->sum_qual/col->depth);
+		}
+	tvs_puts(out,"]");
+	}
+
+/* writes the view in 'out' with the format of tv->output, 'title' is the line of -f or the region of -g */
+static void ttv_format(ttview_t* tv,const char* title,TvString* out)
+	{
+	size_t stride=(size_t)tv->mcol+1,title_len=0;
+	int y,x;
+	if(title!=NULL)
+		{
+		title_len=strlen(title);
+		while(title_len>0 && isspace((unsigned char)title[title_len-1])) --title_len;
+		}
+	switch(tv->output)
+		{
+		case TV_OUTPUT_HTML:
+			if(title!=NULL)
+				{
+				tvs_puts(out,"<h3>");
+				tvs_escape(out,title,title_len,0);
+				tvs_puts(out,"</h3>\n");
+				}
+			tvs_puts(out,"<pre class=\"ttview\">");
+			for(y=0;y< tv->screen.nLines;++y)
+				{
+				const char* row=&tv->screen.chars[y*stride];
+				const unsigned char* attrs=&tv->screen.attrs[y*stride];
+				for(x=0;x< tv->mcol;)
+					{
+					int a=attrs[x],end=x;
+					while(end< tv->mcol && attrs[end]==a) ++end;
+					if(a!=0) tvs_printf(out,"<span class=\"tv%d%s\">",a&TV_ATTR_COLOR,(a&TV_ATTR_UNDERLINE?" tvu":""));
+					tvs_escape(out,&row[x],end-x,0);
+					if(a!=0) tvs_puts(out,"</span>");
+					x=end;
+					}
+				tvs_write(out,"\n",1);
+				}
+			tvs_puts(out,"</pre>\n");
+			break;
+		case TV_OUTPUT_JSON:
+			tvs_puts(out,"{\"region\":\"");
+			if(title!=NULL) tvs_escape(out,title,title_len,1);
+			tvs_puts(out,"\",\"chrom\":\"");
+			tvs_escape(out,tv->header->target_name[tv->curr_tid],strlen(tv->header->target_name[tv->curr_tid]),1);
+			tvs_printf(out,"\",\"start\":%d,\"columns\":%d,",tv->left_pos+1,tv->mcol);
+			if(tv->n_panels>1)
+				{
+				/* the files, in the order of the panels */
+				for(y=0;y< tv->n_panels;++y)
+					{
+					tvs_puts(out,y==0?"\"panels\":[\"":",\"");
+					tvs_escape(out,tv->panels[y].path,strlen(tv->panels[y].path),1);
+					tvs_puts(out,"\"");
+					}
+				tvs_puts(out,"],");
+				}
+			tvs_puts(out,"\"lines\":[");
+			for(y=0;y< tv->screen.nLines;++y)
+				{
+				tvs_puts(out,y==0?"\"":",\"");
+				tvs_escape(out,&tv->screen.chars[y*stride],tv->mcol,1);
+				tvs_puts(out,"\"");
+				}
+			/* the attributes of a line in base 32, one digit per column */
+			tvs_puts(out,"],\"attributes\":[");
+			for(y=0;y< tv->screen.nLines;++y)
+				{
+				tvs_puts(out,y==0?"\"":",\"");
+				for(x=0;x< tv->mcol;++x)
+					{
+					tvs_write(out,&"0123456789abcdefghijklmnopqrstuv"[tv->screen.attrs[y*stride+x]&31],1);
+					}
+				tvs_puts(out,"\"");
+				}
+			tvs_puts(out,"]");
+			if(tv->summary) ttv_json_summary(tv,out);
+			tvs_puts(out,",\"reads\":[");
+			for(y=0;y< tv->n_view_reads;++y)
+				{
+				const TvRead* r=&tv->view_reads[y];
+				tvs_puts(out,y==0?"{\"name\":\"":",{\"name\":\"");
+				tvs_escape(out,&tv->read_names.s[r->name],strlen(&tv->read_names.s[r->name]),1);
+				tvs_printf(out,"\",\"flag\":%d,\"pos\":%d,\"mapq\":%d,\"cigar\":\"",r->flag,r->pos+1,r->mapq);
+				tvs_puts(out,&tv->read_names.s[r->cigar]);
+				tvs_printf(out,"\",\"row\":%d,\"first\":%d,\"last\":%d",r->row,r->first_col,r->last_col);
+				if(tv->n_panels>1) tvs_printf(out,",\"panel\":%d",r->panel);
+				if(tv->split)
+					{
+					tvs_puts(out,",\"sa\":\"");
+					tvs_escape(out,&tv->read_names.s[r->sa],strlen(&tv->read_names.s[r->sa]),1);
+					tvs_puts(out,"\",\"mc\":\"");
+					tvs_escape(out,&tv->read_names.s[r->mc],strlen(&tv->read_names.s[r->mc]),1);
+					tvs_puts(out,"\"");
+					}
+				tvs_puts(out,"}");
+				}
+			tvs_puts(out,"]}\n");
+			break;
+		case TV_OUTPUT_ANSI:
+			if(title!=NULL) { tvs_puts(out,"\n\n> "); tvs_puts(out,title); tvs_puts(out,"\n"); }
+			for(y=0;y< tv->screen.nLines;++y)
+				{
+				const char* row=&tv->screen.chars[y*stride];
+				const unsigned char* attrs=&tv->screen.attrs[y*stride];
+				int curr=0;
+				for(x=0;x< tv->mcol;)
+					{
+					int a=attrs[x],end=x;
+					while(end< tv->mcol && attrs[end]==a) ++end;
+					if(a!=curr)
+						{
+						tvs_puts(out,"\033[0");
+						if(a&TV_ATTR_UNDERLINE) tvs_puts(out,";4");
+						if(a&TV_ATTR_COLOR) tvs_printf(out,";%d",30+"\0\4\2\3\7\2\6\3\1\4"[a&TV_ATTR_COLOR]);
+						tvs_puts(out,"m");
+						curr=a;
+						}
+					tvs_write(out,&row[x],end-x);
+					x=end;
+					}
+				if(curr!=0) tvs_puts(out,"\033[0m");
+				tvs_write(out,"\n",1);
+				}
+			if(title!=NULL) tvs_write(out,"\n",1);
+			break;
+		default:
+			if(title!=NULL) { tvs_puts(out,"\n\n> "); tvs_puts(out,title); tvs_puts(out,"\n"); }
+			tvs_write(out,tv->screen.chars,tv->screen.nLines*stride);
+			if(title!=NULL) tvs_write(out,"\n",1);
+			break;
+		}
+	}
+
+/* the view of a single region: like the text, the ANSI view has no title */
+static void ttv_format_view(ttview_t* t,const char* title,TvString* out)
+	{
+	ttv_format(t,(t->output==TV_OUTPUT_TEXT || t->output==TV_OUTPUT_ANSI?NULL:title),out);
+	}
+
+static void dump(ttview_t* t,const char* title)
+	{
+	if(t->output==TV_OUTPUT_TEXT)
+		{
+		fwrite(t->screen.chars,(size_t)t->mcol+1,t->screen.nLines,stdout);
+		}
+	else
+		{
+		TvString str={NULL,0,0,0};
+		ttv_format_view(t,title,&str);
+		if(str.failed)
+			{
+			fputs("Out of memory\n",stderr);
+			exit(EXIT_FAILURE);
+			}
+		fwrite(str.s,1,str.len,stdout);
+		free(str.s);
+		}
+	}
+
+/* the head and the tail of the HTML document */
+static void ttv_html_head()
+	{
+	fputs("<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"/><title>ttview</title><style>\n"
+		"pre.ttview {background-color:black;color:white;}\n"
+		".tv1,.tv9 {color:#5c5cff;} .tv2,.tv5 {color:#00cd00;} .tv3,.tv7 {color:#cdcd00;}\n"
+		".tv4 {color:white;} .tv6 {color:#00cdcd;} .tv8 {color:#ff3030;} .tvu {text-decoration:underline;}\n"
+		"</style></head><body>\n",stdout);
+	}
+
+static void ttv_html_tail()
+	{
+	fputs("</body></html>\n",stdout);
+	}
+
+/* several files: a read starting at 'pos' takes the first free row of the panel of its file */
+static void ttv_panel_rows(ttview_t* tv,uint32_t pos,int n,const bam_pileup1_t *pl)
+	{
+	int i,row;
+	for(i=0;i< n;++i)
 		{
-		for(x=0;x< t->mcol;++x)
+		const bam_pileup1_t *p=pl+i;
+		TvPanel* panel;
+		if(!p->is_head) continue;
+		panel=&tv->panels[p->b->core.bin];
+		for(row=0;row< panel->m_rows && panel->row_ends[row]>(int)pos;++row);
+		if(row==panel->m_rows)
+			{
+			int m=panel->m_rows+64;
+			int* row_ends=(int*)realloc(panel->row_ends,m*sizeof(int));
+			if(row_ends==NULL)
+				{
+				tv->oom=1;
+				return;
+				}
+			panel->row_ends=row_ends;
+			while(panel->m_rows< m) panel->row_ends[panel->m_rows++]=0;
+			}
+		panel->row_ends[row]=(int)bam_calend(&p->b->core,bam1_cigar(p->b));
+		if(p->level>=tv->m_panel_rows)
 			{
-			fputc(t->screen[y][x].c,stdout);
+			int m=p->level+64;
+			int* panel_rows=(int*)realloc(tv->panel_rows,m*sizeof(int));
+			if(panel_rows==NULL)
+				{
+				tv->oom=1;
+				return;
+				}
+			tv->panel_rows=panel_rows;
+			tv->m_panel_rows=m;
 			}
-		fputc('\n',stdout);
+		tv->panel_rows[p->level]=row;
+		}
+	}
+
+/* a base of a soft clip, in lowercase, only on a free cell */
+static void ttv_put_clip(TvScreen* s,int mcol,int y,int x,char c,int attr)
+	{
+	long i=cellxy(s,mcol,y,x);
+	if(i<0 || s->chars[i]!=' ') return;
+	s->chars[i]=tolower(c);
+	s->attrs[i]=(unsigned char)attr;
+	}
+
+/* -S: the soft clips of a read, beside its first and its last aligned base */
+static void ttv_draw_clips(ttview_t* tv,TvScreen* screen,int row,const bam_pileup1_t* p,int attr)
+	{
+	const uint32_t* cigar=bam1_cigar(p->b);
+	const uint8_t* seq=bam1_seq(p->b);
+	int n=p->b->core.n_cigar,first,last,len,i;
+	if(n==0) return;
+	first=((cigar[0]&BAM_CIGAR_MASK)==BAM_CHARD_CLIP && n>1?1:0);
+	last=((cigar[n-1]&BAM_CIGAR_MASK)==BAM_CHARD_CLIP && n>1?n-2:n-1);
+	if((cigar[first]&BAM_CIGAR_MASK)==BAM_CSOFT_CLIP && p->qpos==(len=cigar[first]>>BAM_CIGAR_SHIFT))
+		{
+		for(i=1;i<=len;++i) ttv_put_clip(screen,tv->mcol,row,tv->ccol-i,bam_nt16_rev_table[bam1_seqi(seq,len-i)],attr);
+		}
+	if(last!=first && (cigar[last]&BAM_CIGAR_MASK)==BAM_CSOFT_CLIP && p->qpos==p->b->core.l_qseq-(len=cigar[last]>>BAM_CIGAR_SHIFT)-1)
+		{
+		for(i=1;i<=len;++i) ttv_put_clip(screen,tv->mcol,row,tv->ccol+i,bam_nt16_rev_table[bam1_seqi(seq,p->qpos+i)],attr);
 		}
 	}
 
+/* -D: depth, most frequent base other than the reference 'ref' (0-4) and base qualities of the column */
+static void ttv_summarize(ttview_t* tv,int n,const bam_pileup1_t *pl,int ref)
+	{
+	TvColumn* col=&tv->columns[tv->ccol];
+	int i,count[4]={0,0,0,0};
+	col->depth=0;
+	col->sum_qual=0;
+	col->alt=-1;
+	col->n_alt=0;
+	for(i=0;i< n;++i)
+		{
+		const bam_pileup1_t *p=pl+i;
+		int b;
+		if(p->is_del || p->is_refskip) continue;
+		col->depth++;
+		col->sum_qual+=bam1_qual(p->b)[p->qpos];
+		b=bam_nt16_nt4_table[bam1_seqi(bam1_seq(p->b),p->qpos)];
+		if(b< 4) count[b]++;
+		}
+	for(i=0;i< 4;++i)
+		{
+		if(i!=ref && count[i]>col->n_alt)
+			{
+			col->alt=i;
+			col->n_alt=count[i];
+			}
+		}
+	}
 
 static int ttv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *pl, void *data)
 	{
@@ -163,6 +821,8 @@ static int ttv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *p
 	ttview_t *tv = (ttview_t*)data;
 	int i, j, c, rb, max_ins = 0;
 	uint32_t call = 0;
+	if (tv->n_panels > 1) ttv_panel_rows(tv, pos, n, pl);
+	if (tv->oom) return 0; // the view is not drawn
 	if (pos < tv->left_pos || tv->ccol > tv->mcol) return 0; // out of screen
 	// print reference
 	rb = (tv->ref && pos - tv->left_pos < tv->l_ref)? tv->ref[pos - tv->left_pos] : 'N';
@@ -172,29 +832,48 @@ static int ttv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *p
 		putchxy(tv,1, tv->ccol++, c);
 	}
 	if (pos%10 == 0 && tv->mcol - tv->ccol >= 10) printfyx(tv,0, tv->ccol, "%-d", pos+1);
-	{ // call consensus
-		bcf_callret1_t bcr;
-		int qsum[4], a1, a2, tmp;
-		double p[3], prior = 30;
-		bcf_call_glfgen(n, pl, bam_nt16_table[rb], tv->bca, &bcr);
-		for (i = 0; i < 4; ++i) qsum[i] = bcr.qsum[i]<<2 | i;
-		for (i = 1; i < 4; ++i) // insertion sort
-			for (j = i; j > 0 && qsum[j] > qsum[j-1]; --j)
-				tmp = qsum[j], qsum[j] = qsum[j-1], qsum[j-1] = tmp;
-		a1 = qsum[0]&3; a2 = qsum[1]&3;
-		p[0] = bcr.p[a1*5+a1]; p[1] = bcr.p[a1*5+a2] + prior; p[2] = bcr.p[a2*5+a2];
-		if ("ACGT"[a1] != toupper(rb)) p[0] += prior + 3;
-		if ("ACGT"[a2] != toupper(rb)) p[2] += prior + 3;
-		if (p[0] < p[1] && p[0] < p[2]) call = (1<<a1)<<16 | (int)((p[1]<p[2]?p[1]:p[2]) - p[0] + .499);
-		else if (p[2] < p[1] && p[2] < p[0]) call = (1<<a2)<<16 | (int)((p[0]<p[1]?p[0]:p[1]) - p[2] + .499);
-		else call = (1<<a1|1<<a2)<<16 | (int)((p[0]<p[2]?p[0]:p[2]) - p[1] + .499);
+	if (tv->consensus == TV_CONSENSUS_GL) {
+		// the views of a window share the calls of their common positions. Past the end of the view
+		// the reads starting after the view are missing, such a call is not kept
+		uint32_t *cached = (pos >= tv->win_beg && pos < tv->win_end && pos < tv->left_pos + tv->mcol)? &tv->calls[pos - tv->win_beg] : NULL;
+		if (cached != NULL && *cached != 0) call = *cached;
+		else { // call consensus
+			bcf_callret1_t bcr;
+			int qsum[4], a1, a2, tmp;
+			double p[3], prior = 30;
+			bcf_call_glfgen(n, pl, bam_nt16_table[rb], tv->bca, &bcr);
+			for (i = 0; i < 4; ++i) qsum[i] = bcr.qsum[i]<<2 | i;
+			for (i = 1; i < 4; ++i) // insertion sort
+				for (j = i; j > 0 && qsum[j] > qsum[j-1]; --j)
+					tmp = qsum[j], qsum[j] = qsum[j-1], qsum[j-1] = tmp;
+			a1 = qsum[0]&3; a2 = qsum[1]&3;
+			p[0] = bcr.p[a1*5+a1]; p[1] = bcr.p[a1*5+a2] + prior; p[2] = bcr.p[a2*5+a2];
+			if ("ACGT"[a1] != toupper(rb)) p[0] += prior + 3;
+			if ("ACGT"[a2] != toupper(rb)) p[2] += prior + 3;
+			if (p[0] < p[1] && p[0] < p[2]) call = (1<<a1)<<16 | (int)((p[1]<p[2]?p[1]:p[2]) - p[0] + .499);
+			else if (p[2] < p[1] && p[2] < p[0]) call = (1<<a2)<<16 | (int)((p[0]<p[1]?p[0]:p[1]) - p[2] + .499);
+			else call = (1<<a1|1<<a2)<<16 | (int)((p[0]<p[2]?p[0]:p[2]) - p[1] + .499);
+			if (cached != NULL) *cached = call;
+		}
+		c = ",ACMGRSVTWYHKDBN"[call>>16&0xf];
+		i = (call&0xffff)/10+1;
+		if (i > 4) i = 4;
+		if (c == toupper(rb)) c = '.';
+		putchxya(tv,2, tv->ccol, c, TV_ATTR_UNDERLINE | i);
+	} else if (tv->consensus == TV_CONSENSUS_COUNT) {
+		// majority vote, the reference wins the ties
+		int count[5] = {0, 0, 0, 0, 0}, best = bam_nt16_nt4_table[bam_nt16_table[rb]];
+		for (i = 0; i < n; ++i) {
+			if (!pl[i].is_del) ++count[bam_nt16_nt4_table[bam1_seqi(bam1_seq(pl[i].b), pl[i].qpos)]];
+		}
+		for (i = 0; i < 4; ++i) {
+			if (best > 3 || count[i] > count[best]) best = i;
+		}
+		c = count[best] == 0 ? ',' : "ACGT"[best];
+		if (c == toupper(rb)) c = '.';
+		putchxya(tv,2, tv->ccol, c, TV_ATTR_UNDERLINE);
 	}
-	
-	c = ",ACMGRSVTWYHKDBN"[call>>16&0xf];
-	i = (call&0xffff)/10+1;
-	if (i > 4) i = 4;
-	if (c == toupper(rb)) c = '.';
-	putchxy(tv,2, tv->ccol, c);
+	if (tv->summary && tv->ccol < tv->mcol) ttv_summarize(tv, n, pl, bam_nt16_nt4_table[bam_nt16_table[rb]]);
 	if(tv->ins) {
 		// calculate maximum insert
 		for (i = 0; i < n; ++i) {
@@ -206,7 +885,18 @@ static int ttv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *p
 	for (j = 0; j <= max_ins; ++j) {
 		for (i = 0; i < n; ++i) {
 			const bam_pileup1_t *p = pl + i;
-			int row = TV_MIN_ALNROW + p->level - tv->row_shift;
+			int row = TV_MIN_ALNROW + p->level - tv->row_shift, visible, panel = 0;
+			TvScreen *screen = &tv->screen;
+			if (tv->n_panels == 1) {
+				visible = row > TV_MIN_ALNROW
+					&& (tv->panels[0].max_rows <= 0 || row <= TV_MIN_ALNROW + tv->panels[0].max_rows);
+			} else { // the row of the read in the panel of its file
+				panel = p->b->core.bin;
+				row = tv->panel_rows[p->level] - tv->row_shift;
+				screen = &tv->panels[panel].screen;
+				visible = row >= 0
+					&& (tv->panels[panel].max_rows <= 0 || row < tv->panels[panel].max_rows);
+			}
 			if (j == 0) {
 				if (!p->is_del) {
 					if (tv->base_for == TV_BASE_COLOR_SPACE && 
@@ -241,13 +931,12 @@ static int ttv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *p
 					}
 				}
 			}
-			if (row > TV_MIN_ALNROW
-				/* && row < tv->mrow */
-				)
+			if (visible)
 				{
-				int x;
-				
+				int x = 0, attr = 0;
 				
+				if (((p->b->core.flag&BAM_FPAIRED) && !(p->b->core.flag&BAM_FPROPER_PAIR))
+					|| (p->b->core.flag & BAM_FSECONDARY)) attr |= TV_ATTR_UNDERLINE;
 				if (tv->color_for == TV_COLOR_BASEQ)
 					{
 					x = bam1_qual(p->b)[p->qpos]/10 + 1;
@@ -284,14 +973,16 @@ static int ttv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *p
 					if (x > 4) x = 4;
 					}
 				
-				putchxy(tv,row, tv->ccol, bam1_strand(p->b)? tolower(c) : toupper(c));
+				putcellxya(screen, tv->mcol, row, tv->ccol, bam1_strand(p->b)? tolower(c) : toupper(c), attr | x);
+				if (tv->split && j == 0 && !p->is_del) ttv_draw_clips(tv, screen, row, p, attr | x);
+				if ((tv->output == TV_OUTPUT_JSON || tv->split) && tv->ccol < tv->mcol) ttv_track_read(tv, p, row, panel);
 				
 			}
 		}
 		c = j? '*' : rb;
 		if (c == '*') {
 			
-			
+			if (tv->summary && j > 0 && tv->ccol < tv->mcol) tv->columns[tv->ccol].depth = -1;
 			putchxy(tv,1, tv->ccol++, c);
 			
 		} else putchxy(tv,1, tv->ccol++, c);
@@ -300,22 +991,62 @@ static int ttv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *p
 	return 0;
 }
 
-static ttview_t *ttv_init(const char *fn, const char *fn_fa)
+static void ttv_destroy(ttview_t *tv);
+
+/* opens a context on the BAM files 'fns'. If 'share' is not NULL, the indexes are shared with the panels of another context.
+ * Returns NULL on error, the code (TTVIEW_ERR_*) is written in 'status' */
+static ttview_t *ttv_init(const char* const* fns, int n_fns, const char *fn_fa, const TvPanel* share, int* status)
 	{
+	int i;
 	ttview_t *tv = (ttview_t*)calloc(1, sizeof(ttview_t));
+	*status = TTVIEW_ERR_MEMORY;
 	if(tv==NULL) return NULL;
-	tv->screen=NULL;
-	tv->nLines=0;
+	tv->panels = (TvPanel*)calloc(n_fns, sizeof(TvPanel));
+	if(tv->panels==NULL)
+		{
+		free(tv);
+		return NULL;
+		}
+	tv->n_panels = n_fns;
 	tv->is_dot = 1;
-	tv->fp = bam_open(fn, "r");
-	bgzf_set_cache_size(tv->fp, 8 * 1024 *1024);
-	assert(tv->fp);
-	tv->header = bam_header_read(tv->fp);
-	tv->idx = bam_index_load(fn);
-	if (tv->idx == 0) exit(1);
+	for(i=0;i< n_fns;++i)
+		{
+		TvPanel* panel = &tv->panels[i];
+		panel->path = fns[i];
+		panel->fp = bam_open(fns[i], "r");
+		if (panel->fp == NULL || (panel->header = bam_header_read(panel->fp)) == NULL)
+			{
+			*status = TTVIEW_ERR_OPEN;
+			ttv_destroy(tv);
+			return NULL;
+			}
+		bgzf_set_cache_size(panel->fp, 8 * 1024 *1024);
+		panel->own_idx = (share == NULL);
+		panel->idx = (share == NULL ? bam_index_load(fns[i]) : share[i].idx);
+		if (panel->idx == 0)
+			{
+			*status = TTVIEW_ERR_INDEX;
+			ttv_destroy(tv);
+			return NULL;
+			}
+		panel->tag = (n_fns > 1 ? i : -1);
+		}
+	tv->header = tv->panels[0].header;
+	if (fn_fa && strlen(fn_fa)>5 && strcmp(fn_fa+strlen(fn_fa)-5,".2bit")==0) tv->tb = twobit_open(fn_fa);
+	else if (fn_fa) tv->fai = fai_load(fn_fa);
+	if (fn_fa && tv->tb == NULL && tv->fai == NULL)
+		{
+		*status = TTVIEW_ERR_OPEN;
+		ttv_destroy(tv);
+		return NULL;
+		}
 	tv->lplbuf = bam_lplbuf_init(ttv_pl_func, tv);
-	if (fn_fa) tv->fai = fai_load(fn_fa);
 	tv->bca = bcf_call_init(0.83, 13);
+	if (tv->lplbuf == NULL || tv->bca == NULL)
+		{
+		ttv_destroy(tv);
+		return NULL;
+		}
 	tv->ins = 1;
 
 	
@@ -323,88 +1054,991 @@ static ttview_t *ttv_init(const char *fn, const char *fn_fa)
 
 	
 	tv->color_for = TV_COLOR_MAPQ;
+	tv->consensus = TV_CONSENSUS_GL;
 	
+	*status = TTVIEW_OK;
 	return tv;
 	}
+/* the buffer is not released: the next region reuses it */
 static void ttv_clear(ttview_t *tv)
 	{
-	int i=0;
-	for(i=0;i< tv->nLines;++i)
-		{
-		free(tv->screen[i]);
-		}
-	
-	free(tv->screen);
-	tv->screen=NULL;
-	tv->nLines=0;
+	tv->screen.nLines=0;
 	}
 static void ttv_destroy(ttview_t *tv)
 	{
-	ttv_clear(tv);
-	bam_lplbuf_destroy(tv->lplbuf);
-	bcf_call_destroy(tv->bca);
-	bam_index_destroy(tv->idx);
+	int i,k;
+	free(tv->screen.chars);
+	free(tv->screen.attrs);
+	free(tv->view_reads);
+	free(tv->level_reads);
+	free(tv->read_names.s);
+	free(tv->panel_rows);
+	free(tv->out.s);
+	free(tv->line.s);
+	free(tv->partners);
+	free(tv->partner_slots);
+	free(tv->partner_names.s);
+	free(tv->pending);
+	free(tv->columns);
+	if (tv->lplbuf) bam_lplbuf_destroy(tv->lplbuf);
+	if (tv->bca) bcf_call_destroy(tv->bca);
 	if (tv->fai) fai_destroy(tv->fai);
-	free(tv->ref);
-	bam_header_destroy(tv->header);
-	bam_close(tv->fp);
-	free(tv);
-	}
-
-static int ttv_fetch_func(const bam1_t *b, void *data)
-{
-	ttview_t *tv = (ttview_t*)data;
-	if (tv->no_skip) {
-		uint32_t *cigar = bam1_cigar(b); // this is cheating...
-		int i;
-		for (i = 0; i <b->core.n_cigar; ++i) {
-			if ((cigar[i]&0xf) == BAM_CREF_SKIP)
-				cigar[i] = cigar[i]>>4<<4 | BAM_CDEL;
+	if (tv->tb) twobit_close(tv->tb);
+	free(tv->ref_buf);
+	free(tv->calls);
+	for(k=0;k< tv->n_panels;++k)
+		{
+		TvPanel* panel=&tv->panels[k];
+		if (panel->own_idx && panel->idx) bam_index_destroy(panel->idx);
+		free(panel->active);
+		free(panel->active_prio);
+		for(i=0;i< panel->m_reads;++i) bam_destroy1(panel->reads[i]);
+		free(panel->reads);
+		free(panel->read_ends);
+		free(panel->screen.chars);
+		free(panel->screen.attrs);
+		free(panel->row_ends);
+		if (panel->header) bam_header_destroy(panel->header);
+		if (panel->fp) bam_close(panel->fp);
 		}
+	free(tv->panels);
+	free(tv);
 	}
-	bam_lplbuf_push(b, tv->lplbuf);
-	return 0;
-}
 
-static int ttv_draw_aln(ttview_t *tv, int tid, int pos)
+/* -m of the file 'k'. Without other file, the reads of the level 0 are hidden by the consensus row: one more read is kept */
+static int ttv_set_max_rows(ttview_t *tv, int k, int max_rows)
 	{
-	
-	// reset
-	ttv_clear(tv);
-	tv->curr_tid = tid;
-	tv->left_pos = pos;
-	tv->last_pos = tv->left_pos - 1;
-	tv->ccol = 0;
-	// print ref and consensus
-	if (tv->fai) {
-		char *str;
-		if (tv->ref) free(tv->ref);
-		str = (char*)calloc(strlen(tv->header->target_name[tv->curr_tid]) + 30, 1);
-		sprintf(str, "%s:%d-%d", tv->header->target_name[tv->curr_tid], tv->left_pos + 1, tv->left_pos + tv->mcol);
-		tv->ref = fai_fetch(tv->fai, str, &tv->l_ref);
-		free(str);
+	TvPanel* panel=&tv->panels[k];
+	int m=max_rows+(tv->n_panels==1?1:0);
+	int* active;
+	uint32_t* active_prio;
+	panel->max_rows=0;
+	panel->m_active=0;
+	if(max_rows<=0) return 0;
+	if((active=(int*)realloc(panel->active,m*sizeof(int)))!=NULL) panel->active=active;
+	if((active_prio=(uint32_t*)realloc(panel->active_prio,m*sizeof(uint32_t)))!=NULL) panel->active_prio=active_prio;
+	/* without memory, the file keeps no limit */
+	if(active==NULL || active_prio==NULL) return -1;
+	panel->max_rows=max_rows;
+	panel->m_active=m;
+	return 0;
 	}
-	// draw aln
-	bam_lplbuf_reset(tv->lplbuf);
-	bam_fetch(tv->fp, tv->idx, tv->curr_tid, tv->left_pos, tv->left_pos + tv->mcol, tv, ttv_fetch_func);
-	bam_lplbuf_push(0, tv->lplbuf);
 
-	while (tv->ccol < tv->mcol)
+/* the display options of a context used by another thread */
+static int ttv_copy_options(ttview_t *dest, const ttview_t *src)
+	{
+	int k;
+	dest->mcol=src->mcol;
+	dest->base_for=src->base_for;
+	dest->color_for=src->color_for;
+	dest->is_dot=src->is_dot;
+	dest->ins=src->ins;
+	dest->no_skip=src->no_skip;
+	dest->show_name=src->show_name;
+	dest->consensus=src->consensus;
+	dest->output=src->output;
+	dest->split=src->split;
+	dest->lookup=src->lookup;
+	dest->split_option=src->split_option;
+	dest->summary=src->summary;
+	for(k=0;k< dest->n_panels;++k)
 		{
-		int pos = tv->last_pos + 1;
-		if (pos%10 == 0 && tv->mcol - tv->ccol >= 10) printfyx(tv,0, tv->ccol, "%-d", pos+1);
-		putchxy(tv,1, tv->ccol++, (tv->ref && pos < tv->l_ref)? tv->ref[pos - tv->left_pos] : 'N');
-		++tv->last_pos;
+		if(ttv_set_max_rows(dest,k,src->panels[k].max_rows)!=0) return -1;
 		}
 	return 0;
 	}
 
-
+/* keeps a copy of the read, the views of the window are drawn from these copies */
+static int ttv_fetch_func(const bam1_t *b, void *data)
+	{
+	TvPanel *panel = (TvPanel*)data;
+	bam1_t* copy;
+	int slot=-1;
+	uint32_t prio=0;
+	if(panel->oom) return 0;
+	if(panel->max_rows>0 && !(b->core.flag&BAM_FUNMAP))
+		{
+		/* downsampling: each column keeps the 'max_rows' reads with the highest priority, a hash
+		 * of the read name, so the same reads (and their mates) are kept from one run to another */
+		int i;
+		const char* name=bam1_qname(b);
+		prio=2166136261U;
+		while(*name!=0) prio=(prio^(unsigned char)*name++)*16777619U;
+		for(i=0;i< panel->n_active;)
+			{
+			if(panel->read_ends[panel->active[i]]<=b->core.pos)
+				{
+				--panel->n_active;
+				panel->active[i]=panel->active[panel->n_active];
+				panel->active_prio[i]=panel->active_prio[panel->n_active];
+				}
+			else ++i;
+			}
+		if(panel->n_active< panel->m_active)
+			{
+			slot=panel->n_active++;
+			}
+		else
+			{
+			for(slot=0,i=1;i< panel->n_active;++i)
+				{
+				if(panel->active_prio[i]< panel->active_prio[slot]) slot=i;
+				}
+			if(panel->active_prio[slot]>=prio) return 0;
+			/* the read with the lowest priority is dropped */
+			panel->read_ends[panel->active[slot]]=-1;
+			}
+		}
+	if(panel->n_reads==panel->m_reads)
+		{
+		int m=(panel->m_reads==0?256:panel->m_reads*2);
+		bam1_t** reads=(bam1_t**)realloc(panel->reads,m*sizeof(bam1_t*));
+		int* read_ends;
+		if(reads!=NULL) panel->reads=reads;
+		if((read_ends=(int*)realloc(panel->read_ends,m*sizeof(int)))!=NULL) panel->read_ends=read_ends;
+		if(reads!=NULL && read_ends!=NULL)
+			{
+			while(panel->m_reads< m && (panel->reads[panel->m_reads]=bam_init1())!=NULL) panel->m_reads++;
+			}
+		if(panel->n_reads==panel->m_reads)
+			{
+			panel->oom=1;
+			panel->n_active=0;
+			return 0;
+			}
+		}
+	copy=bam_copy1(panel->reads[panel->n_reads],b);
+	if (panel->no_skip) {
+		uint32_t *cigar = bam1_cigar(copy); // this is cheating...
+		int i;
+		for (i = 0; i <copy->core.n_cigar; ++i) {
+			if ((cigar[i]&0xf) == BAM_CREF_SKIP)
+				cigar[i] = cigar[i]>>4<<4 | BAM_CDEL;
+		}
+	}
+	if (panel->tag >= 0) {
+		// the pileup wants one numbering of the chromosomes, the mates keep the one of the file
+		copy->core.bin = panel->tag;
+		copy->core.tid = panel->view_tid;
+	}
+	panel->read_ends[panel->n_reads]=(copy->core.n_cigar? (int)bam_calend(&copy->core,bam1_cigar(copy)) : copy->core.pos+1);
+	if(slot>=0)
+		{
+		panel->active[slot]=panel->n_reads;
+		panel->active_prio[slot]=prio;
+		}
+	if(panel->read_ends[panel->n_reads]-copy->core.pos > panel->max_span) panel->max_span=panel->read_ends[panel->n_reads]-copy->core.pos;
+	panel->n_reads++;
+	return 0;
+	}
+
+/* fetches the reads of a file for the window of ttv_load */
+static void* ttv_fetch_panel(void* arg)
+	{
+	TvPanel* panel=(TvPanel*)arg;
+	panel->oom = 0;
+	panel->n_reads = 0;
+	panel->n_active = 0;
+	panel->max_span = 0;
+	if (panel->tid >= 0) bam_fetch(panel->fp, panel->idx, panel->tid, panel->beg, panel->end, panel, ttv_fetch_func);
+	return NULL;
+	}
+
+/* fetches the reads and the reference of the window [beg,end), returns -1 if the memory is missing */
+static int ttv_load(ttview_t *tv, int tid, int beg, int end)
+	{
+	int k, ret = 0;
+	tv->curr_tid = tid;
+	for (k = 0; k < tv->n_panels; ++k) {
+		TvPanel* panel = &tv->panels[k];
+		// the files may not list the chromosomes in the same order
+		panel->tid = (k == 0 ? tid : bam_get_tid(panel->header, tv->header->target_name[tid]));
+		panel->view_tid = tid;
+		panel->beg = beg;
+		panel->end = end;
+		panel->no_skip = tv->no_skip;
+	}
+	// several files are read at the same time, and while the reference is fetched.
+	// Without a thread, the file is read after the reference
+	for (k = 0; k < tv->n_panels; ++k) {
+		TvPanel* panel = &tv->panels[k];
+		panel->in_thread = (tv->n_panels > 1 && pthread_create(&panel->thread, NULL, ttv_fetch_panel, panel) == 0);
+	}
+	free(tv->ref_buf);
+	tv->ref_buf = NULL;
+	tv->l_ref_buf = 0;
+	tv->ref_beg = beg;
+	tv->win_beg = beg;
+	tv->win_end = beg;
+	if (tv->consensus == TV_CONSENSUS_GL && end > beg) {
+		if (end - beg > tv->m_calls) {
+			free(tv->calls);
+			tv->m_calls = end - beg;
+			tv->calls = (uint32_t*)malloc(tv->m_calls * sizeof(uint32_t));
+			if (tv->calls == NULL) tv->m_calls = 0;
+		}
+		// without memory, the calls are not cached
+		if (tv->calls != NULL) {
+			memset(tv->calls, 0, (end - beg) * sizeof(uint32_t));
+			tv->win_end = end;
+		} else ret = -1;
+	}
+	if (tv->fai) {
+		char *str;
+		str = (char*)calloc(strlen(tv->header->target_name[tv->curr_tid]) + 30, 1);
+		if (str != NULL) {
+			sprintf(str, "%s:%d-%d", tv->header->target_name[tv->curr_tid], beg + 1, end);
+			tv->ref_buf = fai_fetch(tv->fai, str, &tv->l_ref_buf);
+			free(str);
+		} else ret = -1;
+	} else if (tv->tb) {
+		int tid = twobit_tid(tv->tb, tv->header->target_name[tv->curr_tid]);
+		tv->ref_buf = (char*)malloc(end - beg + 1);
+		if (tv->ref_buf == NULL) ret = -1;
+		tv->l_ref_buf = (tv->ref_buf == NULL || tid < 0)? 0 : (int)twobit_fetch(tv->tb, tid, beg, end, tv->ref_buf);
+		if (tv->l_ref_buf > 0) tv->ref_buf[tv->l_ref_buf] = 0;
+	}
+	if (tv->l_ref_buf <= 0) {
+		free(tv->ref_buf);
+		tv->ref_buf = NULL;
+		tv->l_ref_buf = 0;
+	}
+	for (k = 0; k < tv->n_panels; ++k) {
+		if (tv->panels[k].in_thread) pthread_join(tv->panels[k].thread, NULL);
+		else ttv_fetch_panel(&tv->panels[k]);
+		if (tv->panels[k].oom) ret = -1;
+	}
+	return ret;
+	}
+
+/* several files: the panels are stacked under the consensus row, each one after a line with the path of its file */
+static void ttv_stack_panels(ttview_t *tv)
+	{
+	size_t stride=(size_t)tv->mcol+1;
+	int i,k;
+	ttv_lines(&tv->screen,tv->mcol,TV_MIN_ALNROW+1);
+	for(k=0;k< tv->n_panels;++k)
+		{
+		TvPanel* panel=&tv->panels[k];
+		int y=tv->screen.nLines;
+		printfyx(tv,y,0,"%s",panel->path);
+		panel->first_row=y+1;
+		ttv_lines(&tv->screen,tv->mcol,panel->first_row+panel->screen.nLines);
+		if(tv->screen.failed) return;
+		memcpy(&tv->screen.chars[panel->first_row*stride],panel->screen.chars,panel->screen.nLines*stride);
+		memcpy(&tv->screen.attrs[panel->first_row*stride],panel->screen.attrs,panel->screen.nLines*stride);
+		}
+	for(i=0;i< tv->n_view_reads;++i) tv->view_reads[i].row+=tv->panels[tv->view_reads[i].panel].first_row;
+	}
+
+/* -P: hash of the key of a partner */
+static size_t ttv_partner_hash(int panel,const char* name,int tid,int pos,int segment)
+	{
+	/* FNV-1a */
+	size_t h=2166136261U;
+	while(*name!=0) h=(h^(unsigned char)(*name++))*16777619U;
+	h=(h^(size_t)panel)*16777619U;
+	h=(h^(size_t)tid)*16777619U;
+	h=(h^(size_t)segment)*16777619U;
+	return (h^(size_t)pos)*16777619U;
+	}
+
+/* -P: index of a partner in the cache, or -1 */
+static int ttv_find_partner(const ttview_t* tv,int panel,const char* name,int tid,int pos,int segment)
+	{
+	size_t i;
+	if(tv->n_partner_slots==0) return -1;
+	i=ttv_partner_hash(panel,name,tid,pos,segment)&(tv->n_partner_slots-1);
+	while(tv->partner_slots[i]!=-1)
+		{
+		const TvPartner* q=&tv->partners[tv->partner_slots[i]];
+		if(q->pos==pos && q->tid==tid && q->segment==segment && q->panel==panel && strcmp(&tv->partner_names.s[q->name],name)==0) return tv->partner_slots[i];
+		i=(i+1)&(tv->n_partner_slots-1);
+		}
+	return -1;
+	}
+
+/* -P: adds a partner to the cache, it has to be looked up. Returns -1 if the memory is missing */
+static int ttv_add_partner(ttview_t* tv,int panel,const char* name,int tid,int pos,int segment)
+	{
+	TvPartner* q;
+	size_t i;
+	if(tv->n_partners==tv->m_partners)
+		{
+		int m=(tv->m_partners==0?256:tv->m_partners*2);
+		if((q=(TvPartner*)realloc(tv->partners,m*sizeof(TvPartner)))==NULL)
+			{
+			tv->oom=1;
+			return -1;
+			}
+		tv->partners=q;
+		tv->m_partners=m;
+		}
+	if(tid>=0 && tv->n_pending==tv->m_pending)
+		{
+		int m=(tv->m_pending==0?256:tv->m_pending*2);
+		if((q=(TvPartner*)realloc(tv->pending,m*sizeof(TvPartner)))==NULL)
+			{
+			tv->oom=1;
+			return -1;
+			}
+		tv->pending=q;
+		tv->m_pending=m;
+		}
+	/* power of 2, at least twice the number of partners */
+	if(2*(size_t)(tv->n_partners+1) > tv->n_partner_slots)
+		{
+		int k;
+		size_t n=(tv->n_partner_slots==0?512:tv->n_partner_slots*2);
+		int32_t* slots=(int32_t*)realloc(tv->partner_slots,n*sizeof(int32_t));
+		if(slots==NULL)
+			{
+			tv->oom=1;
+			return -1;
+			}
+		tv->partner_slots=slots;
+		tv->n_partner_slots=n;
+		for(i=0;i< tv->n_partner_slots;++i) tv->partner_slots[i]=-1;
+		for(k=0;k< tv->n_partners;++k)
+			{
+			q=&tv->partners[k];
+			i=ttv_partner_hash(q->panel,&tv->partner_names.s[q->name],q->tid,q->pos,q->segment)&(tv->n_partner_slots-1);
+			while(tv->partner_slots[i]!=-1) i=(i+1)&(tv->n_partner_slots-1);
+			tv->partner_slots[i]=k;
+			}
+		}
+	q=&tv->partners[tv->n_partners];
+	q->name=tv->partner_names.len;
+	tvs_puts(&tv->partner_names,name);
+	tvs_write(&tv->partner_names,"",1);
+	if(tv->partner_names.failed) return -1;
+	q->panel=panel;
+	q->tid=tid;
+	q->pos=pos;
+	q->segment=segment;
+	q->found=(tid<0?0:-1);
+	q->flag=q->mapq=0;
+	q->cigar=0;
+	i=ttv_partner_hash(panel,name,tid,pos,segment)&(tv->n_partner_slots-1);
+	while(tv->partner_slots[i]!=-1) i=(i+1)&(tv->n_partner_slots-1);
+	tv->partner_slots[i]=tv->n_partners;
+	if(q->found<0) tv->pending[tv->n_pending++]=*q;
+	return tv->n_partners++;
+	}
+
+/* -P: the partner of a read, added to the cache if it is not there */
+static int ttv_partner(ttview_t* tv,int panel,const char* name,int tid,int pos,int segment)
+	{
+	int k=ttv_find_partner(tv,panel,name,tid,pos,segment);
+	return k>=0?k:ttv_add_partner(tv,panel,name,tid,pos,segment);
+	}
+
+/* next alignment of a SA tag "chrom,pos,strand,CIGAR,mapq,NM;", returns the rest of the tag or NULL */
+static const char* ttv_next_sa(const char* sa,char* chrom,size_t size,int* pos,char* strand,char* cigar,size_t cigar_size,int* mapq)
+	{
+	const char* p=strchr(sa,',');
+	char* q;
+	if(p==NULL || (size_t)(p-sa)>=size) return NULL;
+	memcpy(chrom,sa,p-sa);
+	chrom[p-sa]=0;
+	*pos=(int)strtol(p+1,&q,10)-1;
+	if(*q!=',' || q[1]==0) return NULL;
+	*strand=q[1];
+	p=q+2;
+	if(*p!=',' || (q=strchr(p+1,','))==NULL || (size_t)(q-p-1)>=cigar_size) return NULL;
+	memcpy(cigar,p+1,q-p-1);
+	cigar[q-p-1]=0;
+	*mapq=(int)strtol(q+1,NULL,10);
+	p=strchr(q+1,';');
+	return p==NULL?q+strlen(q):p+1;
+	}
+
+static int cmp_partner_pos(const void* a,const void* b)
+	{
+	const TvPartner* p1=(const TvPartner*)a;
+	const TvPartner* p2=(const TvPartner*)b;
+	if(p1->panel!=p2->panel) return p1->panel - p2->panel;
+	if(p1->tid!=p2->tid) return p1->tid< p2->tid?-1:1;
+	if(p1->pos!=p2->pos) return p1->pos< p2->pos?-1:1;
+	return 0;
+	}
+
+/* -P: a read of a lookup fetch, it fills the partner it is waiting for */
+static int ttv_partner_func(const bam1_t *b, void *data)
+	{
+	TvLookup* lookup=(TvLookup*)data;
+	ttview_t* tv=lookup->tv;
+	TvPartner* q;
+	uint32_t* cigar=bam1_cigar(b);
+	uint32_t i;
+	int k;
+	if(b->core.pos< lookup->beg || b->core.pos> lookup->end) return 0;
+	k=ttv_find_partner(tv,lookup->panel,bam1_qname(b),b->core.tid,b->core.pos,TV_SEGMENT(b->core.flag));
+	if(k<0 || tv->partners[k].found>=0) return 0;
+	q=&tv->partners[k];
+	q->found=1;
+	q->flag=b->core.flag;
+	q->mapq=b->core.qual;
+	q->cigar=tv->partner_names.len;
+	for(i=0;i< b->core.n_cigar;++i)
+		{
+		tvs_printf(&tv->partner_names,"%u%c",cigar[i]>>BAM_CIGAR_SHIFT,"MIDNSHP=X"[cigar[i]&BAM_CIGAR_MASK]);
+		}
+	if(b->core.n_cigar==0) tvs_puts(&tv->partner_names,"*");
+	tvs_write(&tv->partner_names,"",1);
+	return 0;
+	}
+
+/* -P: looks up the partners of the reads of the view missing in the cache. The partners are sorted,
+ * the close ones are looked up with one fetch, like the -f regions */
+static void ttv_lookup_partners(ttview_t* tv)
+	{
+	int i,j;
+	char chrom[1024],strand,cigar[1024];
+	tv->n_pending=0;
+	if(tv->n_partners>=TV_PARTNER_CACHE)
+		{
+		size_t k;
+		tv->n_partners=0;
+		tv->partner_names.len=0;
+		for(k=0;k< tv->n_partner_slots;++k) tv->partner_slots[k]=-1;
+		}
+	for(i=0;i< tv->n_view_reads;++i)
+		{
+		const TvRead* r=&tv->view_reads[i];
+		const bam_header_t* header=tv->panels[r->panel].header;
+		const char* name=&tv->read_names.s[r->name];
+		const char* sa=&tv->read_names.s[r->sa];
+		int pos,mapq;
+		while(*sa!=0 && (sa=ttv_next_sa(sa,chrom,sizeof(chrom),&pos,&strand,cigar,sizeof(cigar),&mapq))!=NULL)
+			{
+			ttv_partner(tv,r->panel,name,bam_get_tid(header,chrom),pos,TV_SEGMENT(r->flag));
+			}
+		if((r->flag&BAM_FPAIRED) && !(r->flag&BAM_FMUNMAP))
+			{
+			ttv_partner(tv,r->panel,name,r->mtid,r->mpos,TV_MATE_SEGMENT(r->flag));
+			}
+		}
+	qsort(tv->pending,tv->n_pending,sizeof(TvPartner),cmp_partner_pos);
+	for(i=0;i< tv->n_pending;i=j)
+		{
+		const TvPartner* q=&tv->pending[i];
+		TvPanel* panel=&tv->panels[q->panel];
+		TvLookup lookup;
+		lookup.tv=tv;
+		lookup.panel=q->panel;
+		lookup.beg=lookup.end=q->pos;
+		for(j=i+1;j< tv->n_pending;++j)
+			{
+			const TvPartner* next=&tv->pending[j];
+			if(next->panel!=q->panel || next->tid!=q->tid) break;
+			if(next->pos > lookup.end+TV_GROUP_GAP || next->pos-lookup.beg > TV_GROUP_SPAN) break;
+			lookup.end=next->pos;
+			}
+		bam_fetch(panel->fp,panel->idx,q->tid,lookup.beg,lookup.end+1,&lookup,ttv_partner_func);
+		}
+	/* the partners that were not found */
+	for(i=0;i< tv->n_pending;++i)
+		{
+		const TvPartner* q=&tv->pending[i];
+		int k=ttv_find_partner(tv,q->panel,&tv->partner_names.s[q->name],q->tid,q->pos,q->segment);
+		if(tv->partners[k].found<0) tv->partners[k].found=0;
+		}
+	}
+
+/* -P: what the file says about a partner: its flag, mapq and cigar, or '?' */
+static void ttv_print_partner(ttview_t* tv,int panel,const char* name,int tid,int pos,int segment)
+	{
+	int k=ttv_find_partner(tv,panel,name,tid,pos,segment);
+	if(k<0 || tv->partners[k].found<=0)
+		{
+		tvs_puts(&tv->line," ?");
+		}
+	else
+		{
+		const TvPartner* q=&tv->partners[k];
+		tvs_printf(&tv->line," [%d %s q%d]",q->flag,&tv->partner_names.s[q->cigar],q->mapq);
+		}
+	}
+
+/* a clipped cigar */
+static int ttv_is_clipped(const char* cigar)
+	{
+	return strchr(cigar,'S')!=NULL || strchr(cigar,'H')!=NULL;
+	}
+
+/* -S: after the rows, a line for each read of the view with a supplementary alignment (SA)
+ * or a clipped mate (MC): its row, its name, the alignments of its SA tag and its mate */
+static void ttv_annotate(ttview_t* tv)
+	{
+	int i;
+	char chrom[1024],strand,cigar[1024];
+	if(tv->lookup) ttv_lookup_partners(tv);
+	for(i=0;i< tv->n_view_reads;++i)
+		{
+		const TvRead* r=&tv->view_reads[i];
+		const bam_header_t* header=tv->panels[r->panel].header;
+		const char* name=&tv->read_names.s[r->name];
+		const char* sa=&tv->read_names.s[r->sa];
+		const char* mc=&tv->read_names.s[r->mc];
+		int pos,mapq,y;
+		long cell;
+		if(*sa==0 && !ttv_is_clipped(mc)) continue;
+		tv->line.len=0;
+		tvs_printf(&tv->line,"@%d ",r->row);
+		tvs_puts(&tv->line,name);
+		while(*sa!=0 && (sa=ttv_next_sa(sa,chrom,sizeof(chrom),&pos,&strand,cigar,sizeof(cigar),&mapq))!=NULL)
+			{
+			tvs_puts(&tv->line," SA ");
+			tvs_puts(&tv->line,chrom);
+			tvs_printf(&tv->line,":%d%c ",pos+1,strand);
+			tvs_puts(&tv->line,cigar);
+			tvs_printf(&tv->line," q%d",mapq);
+			if(tv->lookup) ttv_print_partner(tv,r->panel,name,bam_get_tid(header,chrom),pos,TV_SEGMENT(r->flag));
+			}
+		if((r->flag&BAM_FPAIRED) && !(r->flag&BAM_FMUNMAP) && r->mtid>=0 && r->mtid< header->n_targets)
+			{
+			tvs_puts(&tv->line," mate ");
+			tvs_puts(&tv->line,header->target_name[r->mtid]);
+			tvs_printf(&tv->line,":%d%c",r->mpos+1,(r->flag&BAM_FMREVERSE?'-':'+'));
+			if(*mc!=0)
+				{
+				tvs_puts(&tv->line," ");
+				tvs_puts(&tv->line,mc);
+				}
+			if(tv->lookup) ttv_print_partner(tv,r->panel,name,r->mtid,r->mpos,TV_MATE_SEGMENT(r->flag));
+			}
+		y=tv->screen.nLines;
+		if(tv->line.failed || (cell=cellxy(&tv->screen,tv->mcol,y,0))<0) continue;
+		memcpy(&tv->screen.chars[cell],tv->line.s,(tv->line.len< (size_t)tv->mcol?tv->line.len:(size_t)tv->mcol));
+		}
+	}
+
+/* -D: three rows under the consensus: the depth as a sparkline scaled on the deepest column,
+ * the allele fraction (tenths) of the most frequent base other than the reference, with the
+ * color of this base, and the mean base quality (tens), with the color of the quality */
+static void ttv_summary_rows(ttview_t* tv)
+	{
+	size_t stride=(size_t)tv->mcol+1;
+	int x,i,max_depth=0,y=TV_MIN_ALNROW+1;
+	ttv_lines(&tv->screen,tv->mcol,y);
+	ttv_lines(&tv->screen,tv->mcol,tv->screen.nLines+TV_SUMMARY_ROWS);
+	if(tv->screen.failed) return;
+	memmove(&tv->screen.chars[(y+TV_SUMMARY_ROWS)*stride],&tv->screen.chars[y*stride],(tv->screen.nLines-TV_SUMMARY_ROWS-y)*stride);
+	memmove(&tv->screen.attrs[(y+TV_SUMMARY_ROWS)*stride],&tv->screen.attrs[y*stride],(tv->screen.nLines-TV_SUMMARY_ROWS-y)*stride);
+	for(i=0;i< TV_SUMMARY_ROWS;++i)
+		{
+		memset(&tv->screen.chars[(y+i)*stride],' ',tv->mcol);
+		memset(&tv->screen.attrs[(y+i)*stride],0,stride);
+		}
+	for(x=0;x< tv->mcol;++x)
+		{
+		if(tv->columns[x].depth>max_depth) max_depth=tv->columns[x].depth;
+		}
+	for(x=0;x< tv->mcol;++x)
+		{
+		const TvColumn* col=&tv->columns[x];
+		int q;
+		if(col->depth<=0) continue;
+		putchxy(tv,y,x,TV_SPARKLINE[1+(col->depth-1)*8/max_depth]);
+		if(col->alt>=0)
+			{
+			i=col->n_alt*10/col->depth;
+			putchxya(tv,y+1,x,'0'+(i>9?9:i),col->alt+5);
+			}
+		q=col->sum_qual/col->depth/10;
+		putchxya(tv,y+2,x,'0'+(q>9?9:q),(q+1>4?4:q+1));
+		}
+	if(tv->n_panels==1)
+		{
+		for(i=0;i< tv->n_view_reads;++i) tv->view_reads[i].row+=TV_SUMMARY_ROWS;
+		}
+	}
+
+/* an allocation failed while the view was drawn */
+static int ttv_failed(const ttview_t *tv)
+	{
+	int k;
+	if(tv->oom || tv->screen.failed || tv->read_names.failed || tv->partner_names.failed || tv->line.failed) return 1;
+	for(k=0;k< tv->n_panels;++k)
+		{
+		if(tv->panels[k].screen.failed) return 1;
+		}
+	return 0;
+	}
+
+/* draws the view starting at 'pos' from the window loaded by ttv_load, returns -1 if the memory is missing */
+static int ttv_render(ttview_t *tv, int pos)
+	{
+	int k, end=pos + tv->mcol;
+	// reset
+	ttv_clear(tv);
+	tv->n_view_reads = 0;
+	tv->read_names.len = 0;
+	tv->oom = 0;
+	tv->screen.failed = tv->read_names.failed = tv->partner_names.failed = tv->line.failed = 0;
+	for (k = 0; k < tv->n_panels; ++k) tv->panels[k].screen.failed = 0;
+	for (k = 0; k < tv->m_levels; ++k) tv->level_reads[k] = -1;
+	if (tv->summary) {
+		if (tv->mcol > tv->m_columns) {
+			TvColumn* columns = (TvColumn*)realloc(tv->columns, tv->mcol * sizeof(TvColumn));
+			if (columns == NULL) return -1;
+			tv->columns = columns;
+			tv->m_columns = tv->mcol;
+		}
+		memset(tv->columns, 0, tv->mcol * sizeof(TvColumn));
+		for (k = 0; k < tv->mcol; ++k) tv->columns[k].alt = -1;
+	}
+	tv->left_pos = pos;
+	tv->last_pos = tv->left_pos - 1;
+	tv->ccol = 0;
+	// the reference
+	tv->ref = NULL;
+	tv->l_ref = 0;
+	if (tv->ref_buf && pos >= tv->ref_beg && pos - tv->ref_beg < tv->l_ref_buf) {
+		tv->ref = tv->ref_buf + (pos - tv->ref_beg);
+		tv->l_ref = tv->l_ref_buf - (pos - tv->ref_beg);
+		if (tv->l_ref > tv->mcol) tv->l_ref = tv->mcol;
+	}
+	// draw aln: the reads are sorted on their start, the first candidate starts at pos-max_span
+	for (k = 0; k < tv->n_panels; ++k) {
+		TvPanel* panel = &tv->panels[k];
+		int lo = 0, hi = panel->n_reads;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (panel->reads[mid]->core.pos < pos - panel->max_span) lo = mid + 1;
+			else hi = mid;
+		}
+		panel->next_read = lo;
+		panel->screen.nLines = 0;
+		if (panel->m_rows > 0) memset(panel->row_ends, 0, panel->m_rows * sizeof(int));
+	}
+	bam_lplbuf_reset(tv->lplbuf);
+	// the reads of the files are merged on their start
+	for (;;) {
+		TvPanel* next = NULL;
+		for (k = 0; k < tv->n_panels; ++k) {
+			TvPanel* panel = &tv->panels[k];
+			if (panel->next_read < panel->n_reads && panel->reads[panel->next_read]->core.pos < end
+				&& (next == NULL || panel->reads[panel->next_read]->core.pos < next->reads[next->next_read]->core.pos)) next = panel;
+		}
+		if (next == NULL) break;
+		if (next->read_ends[next->next_read] > pos) bam_lplbuf_push(next->reads[next->next_read], tv->lplbuf);
+		next->next_read++;
+	}
+	bam_lplbuf_push(0, tv->lplbuf);
+
+	while (tv->ccol < tv->mcol)
+		{
+		int pos = tv->last_pos + 1;
+		if (pos%10 == 0 && tv->mcol - tv->ccol >= 10) printfyx(tv,0, tv->ccol, "%-d", pos+1);
+		putchxy(tv,1, tv->ccol++, (tv->ref && pos < tv->l_ref)? tv->ref[pos - tv->left_pos] : 'N');
+		++tv->last_pos;
+		}
+	// the names of the reads are needed by the annotations
+	if (ttv_failed(tv)) return -1;
+	if (tv->summary) ttv_summary_rows(tv);
+	if (tv->n_panels > 1) ttv_stack_panels(tv);
+	if (tv->split) ttv_annotate(tv);
+	return ttv_failed(tv)? -1 : 0;
+	}
+
+static int ttv_draw_aln(ttview_t *tv, int tid, int pos)
+	{
+	if (ttv_load(tv, tid, pos, pos + tv->mcol) != 0) return -1;
+	return ttv_render(tv, pos);
+	}
+
+static int cmp_region_pos(const void* a,const void* b)
+	{
+	const TvRegion* r1=*(TvRegion* const*)a;
+	const TvRegion* r2=*(TvRegion* const*)b;
+	if(r1->tid!=r2->tid) return r1->tid< r2->tid?-1:1;
+	if(r1->pos!=r2->pos) return r1->pos< r2->pos?-1:1;
+	return r1->index - r2->index;
+	}
+
+/* the view of a -f line */
+static void ttv_print_region(ttview_t *tv, TvRegion* r)
+	{
+	TvString str={NULL,0,0,0};
+	ttv_format(tv,r->line,&str);
+	if(str.failed)
+		{
+		fputs("Out of memory\n",stderr);
+		exit(EXIT_FAILURE);
+		}
+	r->text=str.s;
+	r->len=str.len;
+	}
+
+/* sorts the lines and splits them into groups of close views */
+static void ttv_group_regions(TvBatch* batch, int mcol)
+	{
+	int i=0,j;
+	for(i=0;i< batch->n_regions;++i) batch->sorted[i]=&batch->regions[i];
+	qsort(batch->sorted,batch->n_regions,sizeof(TvRegion*),cmp_region_pos);
+	batch->n_groups=0;
+	batch->next_group=0;
+	i=0;
+	while(i< batch->n_regions)
+		{
+		int beg=batch->sorted[i]->pos, end=beg+mcol;
+		for(j=i+1;j< batch->n_regions && batch->sorted[j]->tid==batch->sorted[i]->tid;++j)
+			{
+			if(batch->sorted[j]->pos > end+TV_GROUP_GAP) break;
+			if(batch->sorted[j]->pos+mcol-beg > TV_GROUP_SPAN) break;
+			if(batch->sorted[j]->pos+mcol > end) end=batch->sorted[j]->pos+mcol;
+			}
+		batch->groups[batch->n_groups++]=i;
+		i=j;
+		}
+	batch->groups[batch->n_groups]=batch->n_regions;
+	}
+
+/* draws the groups of the batch with one fetch per group, until there is no group left */
+static void ttv_draw_groups(ttview_t *tv, TvBatch* batch)
+	{
+	for(;;)
+		{
+		int g,i,first,last,end;
+		pthread_mutex_lock(&batch->lock);
+		g=batch->next_group++;
+		pthread_mutex_unlock(&batch->lock);
+		if(g>=batch->n_groups) break;
+		first=batch->groups[g];
+		last=batch->groups[g+1];
+		for(end=0,i=first;i< last;++i)
+			{
+			if(batch->sorted[i]->pos+tv->mcol > end) end=batch->sorted[i]->pos+tv->mcol;
+			}
+		if(ttv_load(tv,batch->sorted[first]->tid,batch->sorted[first]->pos,end)!=0)
+			{
+			fputs("Out of memory\n",stderr);
+			exit(EXIT_FAILURE);
+			}
+		for(i=first;i< last;++i)
+			{
+			if(ttv_render(tv,batch->sorted[i]->pos)!=0)
+				{
+				fputs("Out of memory\n",stderr);
+				exit(EXIT_FAILURE);
+				}
+			ttv_print_region(tv,batch->sorted[i]);
+			}
+		pthread_mutex_lock(&batch->lock);
+		for(i=first;i< last;++i) batch->sorted[i]->ready=1;
+		pthread_cond_broadcast(&batch->drawn);
+		pthread_mutex_unlock(&batch->lock);
+		}
+	}
+
+static void* ttv_worker(void* arg)
+	{
+	TvWorker* w=(TvWorker*)arg;
+	ttv_draw_groups(w->tv,w->batch);
+	return NULL;
+	}
+
+/* draws a batch of -f lines: the views are sorted, the close ones are drawn
+ * from a single fetch, then the views are printed in the order of the list.
+ * With several workers, each one draws whole groups with its own context while
+ * this thread prints the views as soon as they are ready, in the order of the list */
+static void ttv_draw_regions(ttview_t *tv, TvBatch* batch, TvWorker* workers, int n_workers)
+	{
+	int i,err;
+	ttv_group_regions(batch,tv->mcol);
+	if(n_workers==0)
+		{
+		ttv_draw_groups(tv,batch);
+		}
+	else
+		{
+		for(i=0;i< n_workers;++i)
+			{
+			workers[i].batch=batch;
+			/* pthread_create returns the error, errno is not set */
+			if((err=pthread_create(&workers[i].thread,NULL,ttv_worker,&workers[i]))!=0)
+				{
+				fprintf(stderr,"Cannot create thread: %s\n",strerror(err));
+				exit(EXIT_FAILURE);
+				}
+			}
+		}
+	for(i=0;i< batch->n_regions;++i)
+		{
+		TvRegion* r=&batch->regions[i];
+		pthread_mutex_lock(&batch->lock);
+		while(!r->ready) pthread_cond_wait(&batch->drawn,&batch->lock);
+		pthread_mutex_unlock(&batch->lock);
+		fwrite(r->text,1,r->len,stdout);
+		free(r->text);
+		free(r->line);
+		}
+	for(i=0;i< n_workers;++i)
+		{
+		pthread_join(workers[i].thread,NULL);
+		}
+	batch->n_regions=0;
+	}
+
+/* -m: a limit, or a comma separated list with one limit per file, the last one applies to the remaining files.
+ * Returns -1 if the memory is missing */
+static int ttv_parse_max_rows(ttview_t *tv, const char* s)
+	{
+	int k,max_rows=0,ret=0;
+	for(k=0;k< tv->n_panels;++k)
+		{
+		if(s!=NULL && *s!=0)
+			{
+			char* p;
+			max_rows=(int)strtol(s,&p,10);
+			if(max_rows<0) max_rows=0;
+			s=(*p==','?p+1:NULL);
+			}
+		if(ttv_set_max_rows(tv,k,max_rows)!=0) ret=-1;
+		}
+	return ret;
+	}
+
+/* a file with the suffix .bam, not the reference */
+static int ttv_is_bam(const char* fn)
+	{
+	size_t len=strlen(fn);
+	return len>4 && strcmp(fn+len-4,".bam")==0;
+	}
+
+/* the values of -c, -o and -A, -1 if unknown */
+static int ttv_parse_consensus(const char* s)
+	{
+	if(strcmp(s,"none")==0) return TV_CONSENSUS_NONE;
+	if(strcmp(s,"count")==0) return TV_CONSENSUS_COUNT;
+	if(strcmp(s,"gl")==0) return TV_CONSENSUS_GL;
+	return -1;
+	}
+
+static int ttv_parse_output(const char* s)
+	{
+	if(strcmp(s,"text")==0) return TV_OUTPUT_TEXT;
+	if(strcmp(s,"ansi")==0) return TV_OUTPUT_ANSI;
+	if(strcmp(s,"html")==0) return TV_OUTPUT_HTML;
+	if(strcmp(s,"json")==0) return TV_OUTPUT_JSON;
+	return -1;
+	}
+
+static int ttv_parse_color(const char* s)
+	{
+	if(strcmp(s,"mapq")==0) return TV_COLOR_MAPQ;
+	if(strcmp(s,"baseq")==0) return TV_COLOR_BASEQ;
+	if(strcmp(s,"nucl")==0) return TV_COLOR_NUCL;
+	if(strcmp(s,"col")==0) return TV_COLOR_COL;
+	if(strcmp(s,"colq")==0) return TV_COLOR_COLQ;
+	return -1;
+	}
+
+ttview_t* ttview_open(const char* const* bams,int n_bams,const char* ref,int* status)
+	{
+	int ret=TTVIEW_ERR_OPEN;
+	ttview_t* tv=NULL;
+	if(bams!=NULL && n_bams>0) tv=ttv_init(bams,n_bams,ref,NULL,&ret);
+	if(status!=NULL) *status=ret;
+	return tv;
+	}
+
+void ttview_close(ttview_t* tv)
+	{
+	if(tv!=NULL) ttv_destroy(tv);
+	}
+
+int ttview_set(ttview_t* tv,const char* option,const char* value)
+	{
+	int v;
+	if(option==NULL) return TTVIEW_ERR_OPTION;
+	if(strcmp(option,"-d")==0) tv->is_dot=!tv->is_dot;
+	else if(strcmp(option,"-i")==0) tv->ins=!tv->ins;
+	else if(strcmp(option,"-r")==0) tv->show_name=!tv->show_name;
+	else if(strcmp(option,"-s")==0) tv->no_skip=!tv->no_skip;
+	else if(strcmp(option,"-N")==0) tv->base_for=TV_BASE_NUCL;
+	else if(strcmp(option,"-C")==0) tv->base_for=TV_BASE_COLOR_SPACE;
+	else if(strcmp(option,"-S")==0)
+		{
+		tv->split_option=!tv->split_option;
+		tv->split=(tv->split_option || tv->lookup);
+		}
+	else if(strcmp(option,"-D")==0) tv->summary=!tv->summary;
+	else if(strcmp(option,"-P")==0)
+		{
+		tv->lookup=!tv->lookup;
+		tv->split=(tv->split_option || tv->lookup);
+		}
+	else if(value==NULL) return TTVIEW_ERR_OPTION;
+	else if(strcmp(option,"-X")==0)
+		{
+		v=atoi(value);
+		tv->mcol=(v<=10?10:v);
+		}
+	else if(strcmp(option,"-c")==0)
+		{
+		if((v=ttv_parse_consensus(value))<0) return TTVIEW_ERR_OPTION;
+		tv->consensus=v;
+		}
+	else if(strcmp(option,"-o")==0)
+		{
+		if((v=ttv_parse_output(value))<0) return TTVIEW_ERR_OPTION;
+		tv->output=v;
+		}
+	else if(strcmp(option,"-A")==0)
+		{
+		if((v=ttv_parse_color(value))<0) return TTVIEW_ERR_OPTION;
+		tv->color_for=v;
+		}
+	else if(strcmp(option,"-m")==0)
+		{
+		if(ttv_parse_max_rows(tv,value)!=0) return TTVIEW_ERR_MEMORY;
+		}
+	else return TTVIEW_ERR_OPTION;
+	return TTVIEW_OK;
+	}
+
+int ttview_render(ttview_t* tv,const char* region,char* buffer,size_t size,size_t* len)
+	{
+	int tid=-1,beg,end;
+	if(region==NULL) return TTVIEW_ERR_REGION;
+	bam_parse_region(tv->header,region,&tid,&beg,&end);
+	if(tid<0 || tid>=tv->header->n_targets) return TTVIEW_ERR_REGION;
+	if(ttv_draw_aln(tv,tid,beg)!=0) return TTVIEW_ERR_MEMORY;
+	tv->out.len=0;
+	tv->out.failed=0;
+	ttv_format_view(tv,region,&tv->out);
+	if(tv->out.failed) return TTVIEW_ERR_MEMORY;
+	if(len!=NULL) *len=tv->out.len;
+	if(buffer==NULL || tv->out.len>=size) return TTVIEW_ERR_BUFFER;
+	memcpy(buffer,tv->out.s,tv->out.len);
+	buffer[tv->out.len]=0;
+	return TTVIEW_OK;
+	}
+
+const char* ttview_strerror(int status)
+	{
+	switch(status)
+		{
+		case TTVIEW_OK: return "no error";
+		case TTVIEW_ERR_OPEN: return "cannot open the file";
+		case TTVIEW_ERR_INDEX: return "cannot load the index of the BAM file";
+		case TTVIEW_ERR_REGION: return "bad region";
+		case TTVIEW_ERR_BUFFER: return "the buffer is too small";
+		case TTVIEW_ERR_OPTION: return "bad option";
+		case TTVIEW_ERR_MEMORY: return "out of memory";
+		default: return "unknown error";
+		}
+	}
+
 static void usage()
 	{
 	 fprintf(stdout,"Pierre Lindenbaum PHD. 2011.\nOrginal code: from the samtools package http://samtools.sourceforge.net . \n");
 	fprintf(stdout, "Last compilation:%s %s\n",__DATE__,__TIME__);
-	fprintf(stdout, "Usage: ttview (options) <aln.bam> [ref.fasta]\n");
+	fprintf(stdout, "Usage: ttview (options) <aln.bam> [aln2.bam ...] [ref.fasta|ref.2bit]\n");
+	fprintf(stdout, "  several BAM files are drawn as panels under a common reference and consensus.\n");
 	fprintf(stdout, "Options:\n");
 	fprintf(stdout, "  -g <region>\n");
 	fprintf(stdout, "  -f <filename> reads a list regions ( '-' for stdin)\n");
@@ -416,6 +2050,15 @@ static void usage()
 	fprintf(stdout, "  -i insertions\n");
 	fprintf(stdout, "  -X <int> number of columns\n");
 	fprintf(stdout, "  -T <positive int> shift all positions by <T>.\n");
+	fprintf(stdout, "  -c <none|count|gl> consensus row: none, the most frequent base, or the genotype likelihoods (gl).\n");
+	fprintf(stdout, "  -o <text|ansi|html|json> output: text, text with colors, an HTML page, one JSON object per region (text).\n");
+	fprintf(stdout, "  -A <mapq|baseq|nucl|col|colq> what the colors show (mapq).\n");
+	fprintf(stdout, "  -m <int[,int...]> maximum number of rows of reads, the deeper columns are downsampled (0: no limit).\n");
+	fprintf(stdout, "     With several files, one limit per file, the last one applies to the remaining files.\n");
+	fprintf(stdout, "  -S split reads: soft clips in lowercase, a line for each read with a SA tag or a clipped mate (MC).\n");
+	fprintf(stdout, "  -P with -S, looks up the SA alignments and the mates in the BAM file.\n");
+	fprintf(stdout, "  -D summary rows of the reads drawn: depth, allele fraction of the top non-reference base (tenths), mean base quality (tens).\n");
+	fprintf(stdout, "  -@ <int> with -f, number of threads drawing the regions (1).\n");
 	}
 
 int bam_ttview_main(int argc, char *argv[])
@@ -425,8 +2068,16 @@ int bam_ttview_main(int argc, char *argv[])
 	char* region=NULL;
 	char* filename=NULL;
 	int shift=0;
-	int base_for=TV_BASE_NUCL, is_dot=1, ins=1, no_skip=0, show_name=0;
-	int columns=80;
+	/* the options change the defaults of ttv_init: the switches are toggled, -1 or 0 if a value is not set */
+	int base_for=-1, is_dot=0, ins=0, no_skip=0, show_name=0, split=0, lookup=0, summary=0;
+	int columns=0;
+	int nthreads=1;
+	int consensus=-1;
+	int output=-1;
+	int color_for=-1;
+	const char* max_rows=NULL;
+	const char* fn_fa=NULL;
+	int n_bams, status;
 	while(optind < argc)
 		{
 		if(strcmp(argv[optind],"-h")==0)
@@ -452,6 +2103,39 @@ int bam_ttview_main(int argc, char *argv[])
 		        {
 		        filename=argv[++optind];
 		        }
+		else if(strcmp(argv[optind],"-c")==0 && optind+1<argc)
+		        {
+		        if((consensus=ttv_parse_consensus(argv[++optind]))<0)
+		        	{
+		        	fprintf(stderr,"%s: unknown consensus '%s'\n",argv[0],argv[optind]);
+		        	exit(EXIT_FAILURE);
+		        	}
+		        }
+		else if(strcmp(argv[optind],"-o")==0 && optind+1<argc)
+		        {
+		        if((output=ttv_parse_output(argv[++optind]))<0)
+		        	{
+		        	fprintf(stderr,"%s: unknown output '%s'\n",argv[0],argv[optind]);
+		        	exit(EXIT_FAILURE);
+		        	}
+		        }
+		else if(strcmp(argv[optind],"-A")==0 && optind+1<argc)
+		        {
+		        if((color_for=ttv_parse_color(argv[++optind]))<0)
+		        	{
+		        	fprintf(stderr,"%s: unknown color '%s'\n",argv[0],argv[optind]);
+		        	exit(EXIT_FAILURE);
+		        	}
+		        }
+		else if(strcmp(argv[optind],"-m")==0 && optind+1<argc)
+		        {
+		        max_rows=argv[++optind];
+		        }
+		else if(strcmp(argv[optind],"-@")==0 && optind+1<argc)
+		        {
+		        nthreads=atoi(argv[++optind]);
+		        if(nthreads<1) nthreads=1;
+		        }
 		else if(strcmp(argv[optind],"-d")==0 )
 		        {
 		        is_dot=!is_dot;
@@ -475,6 +2159,18 @@ int bam_ttview_main(int argc, char *argv[])
 		else if(strcmp(argv[optind],"-s")==0 )
 			{
 			no_skip=!no_skip;
+			}
+		else if(strcmp(argv[optind],"-S")==0 )
+			{
+			split=!split;
+			}
+		else if(strcmp(argv[optind],"-D")==0 )
+			{
+			summary=!summary;
+			}
+		else if(strcmp(argv[optind],"-P")==0 )
+			{
+			lookup=!lookup;
 			}    
 		else if(strcmp(argv[optind],"--")==0)
 		        {
@@ -492,20 +2188,44 @@ int bam_ttview_main(int argc, char *argv[])
 		        }
 		++optind;
 		}
-	if(!(optind+2==argc || optind+1==argc))
+	/* the BAM files, then the reference if the last file is not a BAM */
+	n_bams=argc-optind;
+	if(n_bams>1 && !ttv_is_bam(argv[argc-1]))
+		{
+		fn_fa=argv[argc-1];
+		--n_bams;
+		}
+	if(n_bams<1)
 		{
 		usage();
 		exit(EXIT_FAILURE);
 		}
 	
-	tv = ttv_init(argv[optind], (argc != optind+2)? 0 : argv[optind+1]);
-	if(tv==NULL) return -1;
-	tv->base_for=base_for;
-	tv->is_dot=is_dot;
-	tv->ins=ins;
-	tv->no_skip=no_skip;
-	tv->show_name=show_name;
-	tv->mcol=columns;
+	tv = ttv_init((const char* const*)&argv[optind], n_bams, fn_fa, NULL, &status);
+	if(tv==NULL)
+		{
+		fprintf(stderr,"%s: %s\n",argv[0],ttview_strerror(status));
+		exit(EXIT_FAILURE);
+		}
+	if(base_for>=0) tv->base_for=base_for;
+	if(is_dot) ttview_set(tv,"-d",NULL);
+	if(ins) ttview_set(tv,"-i",NULL);
+	if(no_skip) ttview_set(tv,"-s",NULL);
+	if(show_name) ttview_set(tv,"-r",NULL);
+	if(split) ttview_set(tv,"-S",NULL);
+	if(lookup) ttview_set(tv,"-P",NULL);
+	if(summary) ttview_set(tv,"-D",NULL);
+	if(consensus>=0) tv->consensus=consensus;
+	if(output>=0) tv->output=output;
+	if(color_for>=0) tv->color_for=color_for;
+	if(columns>0) tv->mcol=columns;
+	output=tv->output;
+	if(ttv_parse_max_rows(tv,max_rows)!=0)
+		{
+		fputs("Out of memory\n",stderr);
+		exit(EXIT_FAILURE);
+		}
+	if(output==TV_OUTPUT_HTML) ttv_html_head();
 	if(region!=NULL)
 		{
 		int tid = -1, beg,end;
@@ -517,8 +2237,12 @@ int bam_ttview_main(int argc, char *argv[])
 			}
 		else
 			{
-			ttv_draw_aln(tv, tid,  (beg-shift<0?0:beg-shift));
-			dump(tv);
+			if(ttv_draw_aln(tv, tid,  (beg-shift<0?0:beg-shift))!=0)
+				{
+				fputs("Out of memory\n",stderr);
+				exit(EXIT_FAILURE);
+				}
+			dump(tv,region);
 			}
 		}
 	else if(filename!=NULL)
@@ -526,6 +2250,9 @@ int bam_ttview_main(int argc, char *argv[])
 		int tid = -1, beg,end;
 		char line[BUFSIZ];
 		FILE* in=stdin;
+		TvBatch batch;
+		TvWorker* workers=NULL;
+		int i,n_workers=(nthreads>1?nthreads:0);
 		if(strcmp(filename,"-")!=0)
 			{
 			in=fopen(filename,"r");
@@ -535,24 +2262,72 @@ int bam_ttview_main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 				}
 			}
+		memset(&batch,0,sizeof(TvBatch));
+		batch.regions=(TvRegion*)calloc(TV_BATCH_SIZE,sizeof(TvRegion));
+		batch.sorted=(TvRegion**)malloc(TV_BATCH_SIZE*sizeof(TvRegion*));
+		batch.groups=(int*)malloc((TV_BATCH_SIZE+1)*sizeof(int));
+		workers=(TvWorker*)calloc(n_workers+1,sizeof(TvWorker));
+		if(batch.regions==NULL || batch.sorted==NULL || batch.groups==NULL || workers==NULL)
+			{
+			fputs("Out of memory\n",stderr);
+			exit(EXIT_FAILURE);
+			}
+		pthread_mutex_init(&batch.lock,NULL);
+		pthread_cond_init(&batch.drawn,NULL);
+		/* each worker has its own files and buffers, the indexes are shared */
+		for(i=0;i< n_workers;++i)
+			{
+			workers[i].tv=ttv_init((const char* const*)&argv[optind], n_bams, fn_fa, tv->panels, &status);
+			if(workers[i].tv==NULL)
+				{
+				fprintf(stderr,"%s: %s\n",argv[0],ttview_strerror(status));
+				exit(EXIT_FAILURE);
+				}
+			if(ttv_copy_options(workers[i].tv,tv)!=0)
+				{
+				fputs("Out of memory\n",stderr);
+				exit(EXIT_FAILURE);
+				}
+			}
 		while(fgets(line,BUFSIZ,in)!=NULL)
 			{
+			TvRegion* r;
 			if(line[0]=='\n' || line[0]=='#') continue;
 			
 			bam_parse_region(tv->header, line, &tid, &beg, &end);
 			
 			if (tid < 0 || tid>=tv->header->n_targets)
 				{
-				fprintf(stderr,"Bad region %s\n",region);
+				fprintf(stderr,"Bad region %s\n",line);
+				continue;
 				}
-			else
+			r=&batch.regions[batch.n_regions];
+			r->line=strdup(line);
+			if(r->line==NULL)
 				{
-				ttv_draw_aln(tv, tid, (beg-shift<0?0:beg-shift));
-				fprintf(stdout,"\n\n> %s\n",line);
-				dump(tv);
-				fputc('\n',stdout);
+				fputs("Out of memory\n",stderr);
+				exit(EXIT_FAILURE);
 				}
+			r->tid=tid;
+			r->pos=(beg-shift<0?0:beg-shift);
+			r->index=batch.n_regions;
+			r->ready=0;
+			if(++batch.n_regions==TV_BATCH_SIZE)
+				{
+				ttv_draw_regions(tv,&batch,workers,n_workers);
+				}
+			}
+		ttv_draw_regions(tv,&batch,workers,n_workers);
+		for(i=0;i< n_workers;++i)
+			{
+			ttv_destroy(workers[i].tv);
 			}
+		free(workers);
+		free(batch.regions);
+		free(batch.sorted);
+		free(batch.groups);
+		pthread_mutex_destroy(&batch.lock);
+		pthread_cond_destroy(&batch.drawn);
 		if(strcmp(filename,"-")!=0)
 			{
 			fclose(in);
@@ -560,9 +2335,14 @@ int bam_ttview_main(int argc, char *argv[])
 		}
 	else
 		{
-		ttv_draw_aln(tv,0,0);
-		dump(tv);
+		if(ttv_draw_aln(tv,0,0)!=0)
+			{
+			fputs("Out of memory\n",stderr);
+			exit(EXIT_FAILURE);
+			}
+		dump(tv,NULL);
 		}
+	if(output==TV_OUTPUT_HTML) ttv_html_tail();
 	ttv_destroy(tv);
 	return 0;
 	}
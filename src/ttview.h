@@ -0,0 +1,49 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ * Motivation:
+ *	ttview as a library: a context keeps the BAM files, their indexes and the
+ *	reference open, and draws the regions in a buffer of the caller.
+ *	The contexts are independent, each thread can use its own context.
+ */
+#ifndef TTVIEW_H
+#define TTVIEW_H
+#include <stddef.h>
+
+typedef struct ttview_t ttview_t;
+
+#define TTVIEW_OK 0
+/* a BAM file or the reference cannot be opened */
+#define TTVIEW_ERR_OPEN (-1)
+/* a BAM file has no index */
+#define TTVIEW_ERR_INDEX (-2)
+/* the chromosome of the region is not in the BAM files */
+#define TTVIEW_ERR_REGION (-3)
+/* the buffer is too small */
+#define TTVIEW_ERR_BUFFER (-4)
+/* unknown option or bad value */
+#define TTVIEW_ERR_OPTION (-5)
+/* an allocation failed, nothing was drawn. The context can be used again.
+ * The allocations made inside samtools and faidx are not checked */
+#define TTVIEW_ERR_MEMORY (-6)
+
+/* opens the BAM files, drawn as panels, and the reference (fasta or .2bit, NULL for none).
+ * Returns NULL on error, the code is written in 'status' if not NULL */
+ttview_t* ttview_open(const char* const* bams,int n_bams,const char* ref,int* status);
+void ttview_close(ttview_t* tv);
+/* sets an option of the command line, e.g. ("-X","120"), ("-o","json"), ("-m","50").
+ * The switches (-d -i -r -s -N -C -S -P -D) have no value and are toggled like on the command line.
+ * With TTVIEW_ERR_MEMORY, -m leaves the files without a limit */
+int ttview_set(ttview_t* tv,const char* option,const char* value);
+/* draws 'region' (chrom:start-end, the view starts at 'start') with the format of -o in 'buffer',
+ * nul-terminated. The length of the text is written in 'len' if not NULL, with
+ * TTVIEW_ERR_BUFFER it is the length that does not fit */
+int ttview_render(ttview_t* tv,const char* region,char* buffer,size_t size,size_t* len);
+/* a message for a code */
+const char* ttview_strerror(int status);
+
+#endif
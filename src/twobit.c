@@ -0,0 +1,621 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ *	http://genome.ucsc.edu/FAQ/FAQformat.html#format7
+ * Motivation:
+ *	reads and writes genomes in the UCSC '.2bit' format.
+ *	Used by faidx.cgi and ttview. With -DSTANDALONE_VERSION, a tool
+ *	converting a fasta file to .2bit.
+ * Compilation:
+ *	gcc -o fa2bit -Wall -O2 -DSTANDALONE_VERSION twobit.c
+ * Usage:
+ *	fa2bit genome.fa genome.2bit
+ *	fa2bit -r chr1:100-200 genome.2bit
+ */
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "twobit.h"
+
+#define TWOBIT_SIGNATURE 0x1A412743
+
+/* one sequence, the arrays point into the mapped file */
+typedef struct
+	{
+	char* name;
+	int64_t length;
+	uint32_t n_blocks;
+	const unsigned char* n_starts;
+	const unsigned char* n_sizes;
+	uint32_t n_masks;
+	const unsigned char* mask_starts;
+	const unsigned char* mask_sizes;
+	const unsigned char* dna;
+	}TwoBitSeq;
+
+struct twobit_t
+	{
+	const unsigned char* map;
+	size_t size;
+	/* the file was written with the other byte order */
+	int swap;
+	int nseq;
+	TwoBitSeq* seqs;
+	/* open addressing hash table of the names, -1 if empty */
+	int32_t* slots;
+	size_t n_slots;
+	};
+
+/* the 4 bases of each byte, the first base in the high bits. A constant table:
+ * the genomes can be opened from several threads */
+#define UNPACK_BASE(b) ((b)==0?'T':(b)==1?'C':(b)==2?'A':'G')
+#define UNPACK_1(i) {UNPACK_BASE(((i)>>6)&3),UNPACK_BASE(((i)>>4)&3),UNPACK_BASE(((i)>>2)&3),UNPACK_BASE((i)&3)}
+#define UNPACK_4(i) UNPACK_1(i),UNPACK_1((i)+1),UNPACK_1((i)+2),UNPACK_1((i)+3)
+#define UNPACK_16(i) UNPACK_4(i),UNPACK_4((i)+4),UNPACK_4((i)+8),UNPACK_4((i)+12)
+#define UNPACK_64(i) UNPACK_16(i),UNPACK_16((i)+16),UNPACK_16((i)+32),UNPACK_16((i)+48)
+static const char UNPACK[256][4]={UNPACK_64(0),UNPACK_64(64),UNPACK_64(128),UNPACK_64(192)};
+
+static uint32_t get32(const twobit_t* tb,const unsigned char* p)
+	{
+	uint32_t v;
+	memcpy(&v,p,sizeof(uint32_t));
+	if(tb->swap)
+		{
+		v=((v>>24)&0xff)|((v>>8)&0xff00)|((v<<8)&0xff0000)|(v<<24);
+		}
+	return v;
+	}
+
+static uint64_t get64(const twobit_t* tb,const unsigned char* p)
+	{
+	uint64_t v;
+	memcpy(&v,p,sizeof(uint64_t));
+	if(tb->swap)
+		{
+		int i;
+		uint64_t r=0;
+		for(i=0;i< 8;++i)
+			{
+			r=(r<<8)|(v&0xff);
+			v>>=8;
+			}
+		v=r;
+		}
+	return v;
+	}
+
+static size_t hashName(const char* s)
+	{
+	/* FNV-1a */
+	size_t h=2166136261U;
+	while(*s!=0)
+		{
+		h=(h^(unsigned char)(*s++))*16777619U;
+		}
+	return h;
+	}
+
+void twobit_close(twobit_t* tb)
+	{
+	int i;
+	if(tb==NULL) return;
+	for(i=0;i< tb->nseq;++i) free(tb->seqs[i].name);
+	free(tb->seqs);
+	free(tb->slots);
+	if(tb->map!=NULL) munmap((void*)tb->map,tb->size);
+	free(tb);
+	}
+
+#define CHECK(n) if(p+(n)>end) goto truncated
+
+twobit_t* twobit_open(const char* path)
+	{
+	const unsigned char* p;
+	const unsigned char* end;
+	struct stat st;
+	uint32_t version;
+	size_t i;
+	int fd;
+	twobit_t* tb=calloc(1,sizeof(twobit_t));
+	if(tb==NULL) return NULL;
+	if((fd=open(path,O_RDONLY))<0 || fstat(fd,&st)!=0)
+		{
+		fprintf(stderr,"[twobit] cannot open %s: %s\n",path,strerror(errno));
+		if(fd>=0) close(fd);
+		free(tb);
+		return NULL;
+		}
+	tb->map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(tb->map==MAP_FAILED)
+		{
+		fprintf(stderr,"[twobit] cannot map %s: %s\n",path,strerror(errno));
+		free(tb);
+		return NULL;
+		}
+	tb->size=st.st_size;
+	p=tb->map;
+	end=tb->map+tb->size;
+	CHECK(16);
+	if(get32(tb,p)!=TWOBIT_SIGNATURE)
+		{
+		tb->swap=1;
+		if(get32(tb,p)!=TWOBIT_SIGNATURE)
+			{
+			fprintf(stderr,"[twobit] %s is not a .2bit file\n",path);
+			twobit_close(tb);
+			return NULL;
+			}
+		}
+	version=get32(tb,p+4);
+	tb->nseq=(int)get32(tb,p+8);
+	p+=16;
+	if(version>1 || tb->nseq<0 || (tb->seqs=calloc(tb->nseq+1,sizeof(TwoBitSeq)))==NULL)
+		{
+		fprintf(stderr,"[twobit] cannot read %s\n",path);
+		twobit_close(tb);
+		return NULL;
+		}
+	for(i=0;i< (size_t)tb->nseq;++i)
+		{
+		TwoBitSeq* seq=&tb->seqs[i];
+		const unsigned char* q;
+		uint64_t offset;
+		size_t len;
+		CHECK(1);
+		len=*p++;
+		CHECK(len);
+		if((seq->name=malloc(len+1))==NULL) goto truncated;
+		memcpy(seq->name,p,len);
+		seq->name[len]=0;
+		p+=len;
+		CHECK(version==0?4:8);
+		/* version 1 has 64 bits offsets */
+		offset=(version==0?get32(tb,p):get64(tb,p));
+		p+=(version==0?4:8);
+		/* the sequence record */
+		q=tb->map+offset;
+		if(offset+8>tb->size) goto truncated;
+		seq->length=get32(tb,q);
+		seq->n_blocks=get32(tb,q+4);
+		q+=8;
+		if((uint64_t)(q-tb->map)+8ULL*seq->n_blocks+4>tb->size) goto truncated;
+		seq->n_starts=q;
+		seq->n_sizes=q+4*seq->n_blocks;
+		q+=8*seq->n_blocks;
+		seq->n_masks=get32(tb,q);
+		q+=4;
+		if((uint64_t)(q-tb->map)+8ULL*seq->n_masks+4>tb->size) goto truncated;
+		seq->mask_starts=q;
+		seq->mask_sizes=q+4*seq->n_masks;
+		q+=8*seq->n_masks+4;
+		seq->dna=q;
+		if((uint64_t)(q-tb->map)+(seq->length+3)/4>tb->size) goto truncated;
+		}
+	/* power of 2, at least twice the number of sequences */
+	tb->n_slots=16;
+	while(tb->n_slots< 2*(size_t)tb->nseq) tb->n_slots*=2;
+	if((tb->slots=malloc(tb->n_slots*sizeof(int32_t)))==NULL) goto truncated;
+	for(i=0;i< tb->n_slots;++i) tb->slots[i]=-1;
+	for(i=0;i< (size_t)tb->nseq;++i)
+		{
+		size_t h=hashName(tb->seqs[i].name)&(tb->n_slots-1);
+		while(tb->slots[h]!=-1) h=(h+1)&(tb->n_slots-1);
+		tb->slots[h]=(int32_t)i;
+		}
+	return tb;
+	truncated:
+		fprintf(stderr,"[twobit] %s is truncated or out of memory\n",path);
+		twobit_close(tb);
+		return NULL;
+	}
+#undef CHECK
+
+int twobit_nseq(const twobit_t* tb)
+	{
+	return tb->nseq;
+	}
+
+const char* twobit_name(const twobit_t* tb,int tid)
+	{
+	return (tid<0 || tid>=tb->nseq)?NULL:tb->seqs[tid].name;
+	}
+
+int twobit_tid(const twobit_t* tb,const char* name)
+	{
+	size_t i=hashName(name)&(tb->n_slots-1);
+	while(tb->slots[i]!=-1)
+		{
+		if(strcmp(tb->seqs[tb->slots[i]].name,name)==0) return tb->slots[i];
+		i=(i+1)&(tb->n_slots-1);
+		}
+	return -1;
+	}
+
+int64_t twobit_length(const twobit_t* tb,int tid)
+	{
+	return (tid<0 || tid>=tb->nseq)?-1:tb->seqs[tid].length;
+	}
+
+/* index of the first block ending after 'start' */
+static uint32_t firstBlock(const twobit_t* tb,const unsigned char* starts,const unsigned char* sizes,uint32_t n,int64_t start)
+	{
+	uint32_t low=0,high=n;
+	while(low<high)
+		{
+		uint32_t mid=low+(high-low)/2;
+		if((int64_t)get32(tb,starts+4*mid)+get32(tb,sizes+4*mid)<=start) low=mid+1;
+		else high=mid;
+		}
+	return low;
+	}
+
+int64_t twobit_fetch(const twobit_t* tb,int tid,int64_t start,int64_t end,char* dest)
+	{
+	const TwoBitSeq* seq;
+	const unsigned char* dna;
+	int64_t i;
+	uint32_t k;
+	char* q=dest;
+	if(tid<0 || tid>=tb->nseq || start<0) return -1;
+	seq=&tb->seqs[tid];
+	if(end>seq->length) end=seq->length;
+	if(start>=end) return 0;
+	dna=seq->dna;
+	/* table lookup: 4 bases for each byte */
+	i=start;
+	while(i<end && (i&3)!=0)
+		{
+		*q++=UNPACK[dna[i>>2]][i&3];
+		++i;
+		}
+	while(i+4<=end)
+		{
+		memcpy(q,UNPACK[dna[i>>2]],4);
+		q+=4;
+		i+=4;
+		}
+	while(i<end)
+		{
+		*q++=UNPACK[dna[i>>2]][i&3];
+		++i;
+		}
+	/* runs of N */
+	for(k=firstBlock(tb,seq->n_starts,seq->n_sizes,seq->n_blocks,start);k< seq->n_blocks;++k)
+		{
+		int64_t b=get32(tb,seq->n_starts+4*k);
+		int64_t e=b+get32(tb,seq->n_sizes+4*k);
+		if(b>=end) break;
+		if(b<start) b=start;
+		if(e>end) e=end;
+		memset(dest+(b-start),'N',e-b);
+		}
+	/* soft-masked bases */
+	for(k=firstBlock(tb,seq->mask_starts,seq->mask_sizes,seq->n_masks,start);k< seq->n_masks;++k)
+		{
+		int64_t b=get32(tb,seq->mask_starts+4*k);
+		int64_t e=b+get32(tb,seq->mask_sizes+4*k);
+		if(b>=end) break;
+		if(b<start) b=start;
+		if(e>end) e=end;
+		for(i=b;i<e;++i) dest[i-start]|=0x20;
+		}
+	return end-start;
+	}
+
+/** writer */
+
+/* a run of N or of lowercase bases */
+typedef struct
+	{
+	uint32_t start;
+	uint32_t size;
+	}Block;
+
+typedef struct
+	{
+	char* name;
+	uint32_t length;
+	Block* n_blocks;
+	uint32_t n_n_blocks;
+	Block* masks;
+	uint32_t n_masks;
+	uint64_t offset;
+	}SeqInfo;
+
+typedef struct
+	{
+	SeqInfo* seqs;
+	size_t nseq;
+	/* packed byte and number of bases in it */
+	unsigned char byte;
+	int n_bits;
+	FILE* out;
+	}Builder;
+
+static int addBlock(Block** blocks,uint32_t* n,uint32_t pos)
+	{
+	if(*n>0 && (*blocks)[*n-1].start+(*blocks)[*n-1].size==pos)
+		{
+		(*blocks)[*n-1].size++;
+		return 0;
+		}
+	if((*n & (*n-1))==0 || *n==0)
+		{
+		/* grows for 1,2,4,8... */
+		Block* array=realloc(*blocks,sizeof(Block)*(*n==0?1:2*(*n)));
+		if(array==NULL) return -1;
+		*blocks=array;
+		}
+	(*blocks)[*n].start=pos;
+	(*blocks)[*n].size=1;
+	(*n)++;
+	return 0;
+	}
+
+static void write32(FILE* out,uint32_t v)
+	{
+	fwrite(&v,sizeof(uint32_t),1,out);
+	}
+
+static void writeRecordHeader(Builder* b,const SeqInfo* seq)
+	{
+	uint32_t i;
+	write32(b->out,seq->length);
+	write32(b->out,seq->n_n_blocks);
+	for(i=0;i< seq->n_n_blocks;++i) write32(b->out,seq->n_blocks[i].start);
+	for(i=0;i< seq->n_n_blocks;++i) write32(b->out,seq->n_blocks[i].size);
+	write32(b->out,seq->n_masks);
+	for(i=0;i< seq->n_masks;++i) write32(b->out,seq->masks[i].start);
+	for(i=0;i< seq->n_masks;++i) write32(b->out,seq->masks[i].size);
+	write32(b->out,0);
+	}
+
+static void flushByte(Builder* b)
+	{
+	if(b->n_bits==0) return;
+	b->byte<<=(8-b->n_bits);
+	fputc(b->byte,b->out);
+	b->byte=0;
+	b->n_bits=0;
+	}
+
+/* first pass (out==NULL): collect the sequences and their blocks. Second pass: write the records */
+static int scanFasta(FILE* in,Builder* b)
+	{
+	char* line=NULL;
+	size_t line_buff=0;
+	ssize_t len;
+	SeqInfo* seq=NULL;
+	size_t n=0;
+	while((len=getline(&line,&line_buff,in))!=-1)
+		{
+		ssize_t i;
+		if(line[0]=='>')
+			{
+			char* p=line+1;
+			char* name_end;
+			if(b->out!=NULL)
+				{
+				flushByte(b);
+				seq=&b->seqs[n++];
+				writeRecordHeader(b,seq);
+				continue;
+				}
+			name_end=p+strcspn(p," \t\r\n");
+			*name_end=0;
+			if(name_end-p>255)
+				{
+				fprintf(stderr,"[twobit] name too long %s\n",p);
+				free(line);
+				return -1;
+				}
+			if((b->nseq & (b->nseq-1))==0 || b->nseq==0)
+				{
+				SeqInfo* array=realloc(b->seqs,sizeof(SeqInfo)*(b->nseq==0?1:2*b->nseq));
+				if(array==NULL) { free(line); return -1; }
+				b->seqs=array;
+				}
+			seq=&b->seqs[b->nseq++];
+			memset(seq,0,sizeof(SeqInfo));
+			if((seq->name=strdup(p))==NULL) { free(line); return -1; }
+			continue;
+			}
+		if(seq==NULL) continue;
+		for(i=0;i< len;++i)
+			{
+			int c=(unsigned char)line[i];
+			if(isspace(c)) continue;
+			if(b->out!=NULL)
+				{
+				int code;
+				switch(toupper(c))
+					{
+					case 'C': code=1; break;
+					case 'A': code=2; break;
+					case 'G': code=3; break;
+					default: code=0; break;
+					}
+				b->byte=(b->byte<<2)|code;
+				b->n_bits+=2;
+				if(b->n_bits==8)
+					{
+					fputc(b->byte,b->out);
+					b->byte=0;
+					b->n_bits=0;
+					}
+				continue;
+				}
+			if(seq->length==UINT32_MAX)
+				{
+				fprintf(stderr,"[twobit] sequence too long %s\n",seq->name);
+				free(line);
+				return -1;
+				}
+			switch(toupper(c))
+				{
+				case 'A': case 'C': case 'G': case 'T': break;
+				default:
+					if(addBlock(&seq->n_blocks,&seq->n_n_blocks,seq->length)!=0) { free(line); return -1; }
+					break;
+				}
+			if(islower(c) && addBlock(&seq->masks,&seq->n_masks,seq->length)!=0) { free(line); return -1; }
+			seq->length++;
+			}
+		}
+	if(b->out!=NULL) flushByte(b);
+	free(line);
+	return 0;
+	}
+
+int twobit_build(const char* fasta,const char* path)
+	{
+	Builder b;
+	FILE* in;
+	uint64_t offset;
+	uint32_t version=0;
+	size_t i;
+	int ret=-1;
+	memset(&b,0,sizeof(Builder));
+	if((in=fopen(fasta,"r"))==NULL)
+		{
+		fprintf(stderr,"[twobit] cannot open %s: %s\n",fasta,strerror(errno));
+		return -1;
+		}
+	if(scanFasta(in,&b)!=0) goto end;
+	/* the offsets of the records */
+	offset=16;
+	for(i=0;i< b.nseq;++i) offset+=1+strlen(b.seqs[i].name)+4;
+	for(i=0;i< b.nseq;++i)
+		{
+		const SeqInfo* seq=&b.seqs[i];
+		offset+=16+8ULL*seq->n_n_blocks+8ULL*seq->n_masks+(seq->length+3)/4;
+		}
+	if(offset>UINT32_MAX) version=1;
+	offset=16;
+	for(i=0;i< b.nseq;++i) offset+=1+strlen(b.seqs[i].name)+(version==0?4:8);
+	for(i=0;i< b.nseq;++i)
+		{
+		SeqInfo* seq=&b.seqs[i];
+		seq->offset=offset;
+		offset+=16+8ULL*seq->n_n_blocks+8ULL*seq->n_masks+(seq->length+3)/4;
+		}
+	if((b.out=fopen(path,"wb"))==NULL)
+		{
+		fprintf(stderr,"[twobit] cannot write %s: %s\n",path,strerror(errno));
+		goto end;
+		}
+	write32(b.out,TWOBIT_SIGNATURE);
+	write32(b.out,version);
+	write32(b.out,(uint32_t)b.nseq);
+	write32(b.out,0);
+	for(i=0;i< b.nseq;++i)
+		{
+		const SeqInfo* seq=&b.seqs[i];
+		unsigned char len=(unsigned char)strlen(seq->name);
+		fputc(len,b.out);
+		fwrite(seq->name,1,len,b.out);
+		if(version==0) write32(b.out,(uint32_t)seq->offset);
+		else fwrite(&seq->offset,sizeof(uint64_t),1,b.out);
+		}
+	rewind(in);
+	if(scanFasta(in,&b)!=0) goto end;
+	if(fflush(b.out)!=0 || ferror(b.out))
+		{
+		fprintf(stderr,"[twobit] I/O error %s\n",path);
+		goto end;
+		}
+	ret=0;
+	end:
+		fclose(in);
+		if(b.out!=NULL && fclose(b.out)!=0) ret=-1;
+		for(i=0;i< b.nseq;++i)
+			{
+			free(b.seqs[i].name);
+			free(b.seqs[i].n_blocks);
+			free(b.seqs[i].masks);
+			}
+		free(b.seqs);
+		return ret;
+	}
+
+#ifdef STANDALONE_VERSION
+
+static void usage()
+	{
+	fprintf(stdout,"Pierre Lindenbaum PHD. 2011.\n");
+	fprintf(stdout,"Last compilation:%s %s\n",__DATE__,__TIME__);
+	fprintf(stdout,"Usage:\n");
+	fprintf(stdout,"  fa2bit <in.fa> <out.2bit>  converts a fasta file.\n");
+	fprintf(stdout,"  fa2bit -r <chrom:start-end> <in.2bit>  prints a region (0-based, end excluded).\n");
+	fprintf(stdout,"  fa2bit -l <in.2bit>  lists the sequences and their lengths.\n");
+	}
+
+int main(int argc,char** argv)
+	{
+	twobit_t* tb;
+	if(argc==2 && strcmp(argv[1],"-h")==0)
+		{
+		usage();
+		return EXIT_SUCCESS;
+		}
+	if(argc==3 && strcmp(argv[1],"-l")==0)
+		{
+		int i;
+		if((tb=twobit_open(argv[2]))==NULL) return EXIT_FAILURE;
+		for(i=0;i< twobit_nseq(tb);++i)
+			{
+			fprintf(stdout,"%s\t%lld\n",twobit_name(tb,i),(long long)twobit_length(tb,i));
+			}
+		twobit_close(tb);
+		return EXIT_SUCCESS;
+		}
+	if(argc==4 && strcmp(argv[1],"-r")==0)
+		{
+		char* region=strdup(argv[2]);
+		char* colon=(region==NULL?NULL:strrchr(region,':'));
+		long long start,end;
+		char* seq;
+		int tid;
+		int64_t n;
+		if(colon==NULL || sscanf(colon+1,"%lld-%lld",&start,&end)!=2 || start<0 || end<start)
+			{
+			fprintf(stderr,"bad region %s\n",argv[2]);
+			return EXIT_FAILURE;
+			}
+		*colon=0;
+		if((tb=twobit_open(argv[3]))==NULL) return EXIT_FAILURE;
+		if((tid=twobit_tid(tb,region))<0)
+			{
+			fprintf(stderr,"unknown sequence %s\n",region);
+			return EXIT_FAILURE;
+			}
+		if((seq=malloc(end-start+1))==NULL) return EXIT_FAILURE;
+		n=twobit_fetch(tb,tid,start,end,seq);
+		fwrite(seq,1,n<0?0:n,stdout);
+		fputc('\n',stdout);
+		free(seq);
+		free(region);
+		twobit_close(tb);
+		return EXIT_SUCCESS;
+		}
+	if(argc!=3)
+		{
+		usage();
+		return EXIT_FAILURE;
+		}
+	return twobit_build(argv[1],argv[2])==0?EXIT_SUCCESS:EXIT_FAILURE;
+	}
+#endif
@@ -0,0 +1,33 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ * Motivation:
+ *	read a genome packed in the UCSC '.2bit' format: 4 bases per byte,
+ *	plus the tables of the runs of 'N' and of the soft-masked (lowercase) bases.
+ *	The file is memory-mapped and can be shared by several threads.
+ */
+#ifndef TWOBIT_H
+#define TWOBIT_H
+#include <stdint.h>
+
+typedef struct twobit_t twobit_t;
+
+/* open and map a .2bit file, returns NULL on error */
+twobit_t* twobit_open(const char* path);
+void twobit_close(twobit_t* tb);
+/* number of sequences */
+int twobit_nseq(const twobit_t* tb);
+const char* twobit_name(const twobit_t* tb,int tid);
+/* index of a sequence, or -1 */
+int twobit_tid(const twobit_t* tb,const char* name);
+int64_t twobit_length(const twobit_t* tb,int tid);
+/* copy the bases [start,end) of 'tid' in 'dest' (not nul-terminated), returns the number of bases or -1 */
+int64_t twobit_fetch(const twobit_t* tb,int tid,int64_t start,int64_t end,char* dest);
+/* convert a fasta file to a .2bit file, returns 0 on success */
+int twobit_build(const char* fasta,const char* path);
+
+#endif